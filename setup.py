@@ -1,7 +1,7 @@
 from distutils.core import setup, Extension
 
 module1 = Extension('_memcev', sources = ['src/_memcevmodule.c'],
-                    libraries=['ev'],
+                    libraries=['ev', 'pthread', 'z'],
                     include_dirs=['/usr/include', '/usr/local/include', '/opt/local/include'],
                     library_dirs=['/usr/lib', '/usr/local/lib', '/opt/local/lib'])
 
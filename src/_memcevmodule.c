@@ -1,15 +1,70 @@
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
 #include <netdb.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <Python.h>
 #include <ev.h>
+#include <zlib.h>
 
 #include "_memcevmodule.h"
 
-static PyObject* _MemcevClient_start(_MemcevClient *self, PyObject *unused) {
-    // this is the function called in its own Thread
+// values at least this big are sent straight from the caller's buffer and
+// read straight into the string that we return, instead of being copied
+// through our own buffers. For anything smaller the copies are cheaper than
+// the bookkeeping (and on the receiving side, than taking the GIL)
+#define ZERO_COPY_MIN_SIZE 16384
+
+// memcached's own limits on how big keys and values can be
+#define MAX_KEY_LENGTH 250
+#define MAX_VALUE_LENGTH (1024*1024)
+
+// the most servers that a key can be written to
+#define MAX_REPLICAS 8
+
+// what's on the end of the set line of a set that's written behind
+#define NOREPLY " noreply"
+#define NOREPLY_LEN (sizeof(NOREPLY) - 1)
+
+// the most iovecs that we'll hand to a single writev. Well under IOV_MAX
+#define WRITE_MAX_IOVECS 64
+
+// how many requests each loop's pool starts out with by default, and how
+// many more it makes room for at a time when they're all in use
+#define REQUEST_POOL_SIZE 256
+#define REQUEST_SLAB_SIZE 64
+
+// raised for requests that ran out of time, so that callers can tell them
+// apart from other failures. It's an IOError like the rest of them
+static PyObject* MemcevTimeoutError = NULL;
+
+// and for requests that were shed because there was too much waiting ahead
+// of them. It's a kind of TimeoutError, since they're failed rather than
+// being left to wait for one
+static PyObject* MemcevOverloadError = NULL;
+
+static PyObject* _MemcevClient_start(_MemcevClient *self, PyObject *args) {
+    // this is the function called in its own Thread, once for each loop
+    int index = 0;
+
+    if(!PyArg_ParseTuple(args, "|i", &index)) {
+        return NULL;
+    }
+
+    if(index < 0 || index >= self->num_loops) {
+        PyErr_Format(PyExc_ValueError, "Unknown loop %d", index);
+        return NULL;
+    }
+
+    memcev_loop* loop = &self->loops[index];
 
     Py_INCREF(self);
 
@@ -17,593 +72,5718 @@ static PyObject* _MemcevClient_start(_MemcevClient *self, PyObject *unused) {
     // the watchers obtain it
     Py_BEGIN_ALLOW_THREADS;
 
-    ev_run(self->loop, 0);
+    ev_run(loop->loop, 0);
+
+    // somebody may have slipped a request onto the ring after we'd already
+    // stopped, and now nobody is ever going to run it
+    fail_submissions(loop);
 
     Py_END_ALLOW_THREADS;
 
     Py_DECREF(self);
 
-    // all done! someone must have terminated us with ev_break
+    // all done! someone must have terminated us with a stop request
     Py_RETURN_NONE;
 }
 
 static PyObject* _MemcevClient_stop(_MemcevClient *self, PyObject *unused) {
-    // called on the event loop thread, signal to the event loop that it should
-    // stop what it's doing. This will cause start() to return, leaving
-    // self.requests potentially full of work to do. This will cause any active
-    // clients to hang, but this should only be called on dealloc anyway
-    ev_break(self->loop, EVBREAK_ALL);
-
+    // signal to the event loops that they should stop what they're doing.
+    // This is just another request on their submission rings so it's safe to
+    // call from any thread. Anything that's still outstanding when an event
+    // loop gets to it is failed, so nobody is left waiting forever
+    if(submit_all(self, request_stop, -1, NULL, NULL, 0, NULL) == -1) {
+        return NULL;
+    }
     Py_RETURN_NONE;
 }
 
-static void notify_event_loop(struct ev_loop *loop, ev_async *watcher, int revents) {
-    // triggered on the the event loop thread by a call to MemcevClient.notify()
-    // to let us know that a new request has been added to the self.requests
-    // queue
+static int submission_push(memcev_loop* self, memcev_request* req) {
+    // this is Dmitry Vyukov's bounded MPMC queue, although we only ever have
+    // the one consumer. Every cell has a sequence number: when it equals the
+    // position that a producer is trying to write to, the cell is free. The
+    // producer claims it by bumping enqueue_pos with a CAS, and then publishes
+    // it by setting the sequence to one past its position, which is what the
+    // consumer is waiting for. So nobody ever takes a lock and the event loop
+    // never sees a half-written cell. Returns -1 if the ring is full
+    size_t pos = __atomic_load_n(&self->enqueue_pos, __ATOMIC_RELAXED);
+    submission_cell* cell;
+
+    for(;;) {
+        cell = &self->ring[pos & self->ring_mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&self->enqueue_pos, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+            // somebody else got there first, and the failed CAS has loaded
+            // their new position into pos for us to try next
 
-    // we're not called while holding the GIL, so we have to grab it to get
-    // access to Python methods
-    PyGILState_STATE gstate;
-    gstate = PyGILState_Ensure();
+        } else if(diff < 0) {
+            // the event loop hasn't emptied this cell from last time around
+            return -1;
 
-    _MemcevClient *self = (_MemcevClient*)ev_userdata(loop);
-    Py_INCREF(self);
+        } else {
+            // somebody else claimed this one between our two loads
+            pos = __atomic_load_n(&self->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
 
-    PyObject* result = PyObject_CallMethod((PyObject*)self, "_handle_work", NULL);
+    cell->req = req;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
 
-    if(result == NULL) {
-        // if an exception occurred, there's not really much we can do since
-        // we're in our own thread and there's nobody to raise it to. So
-        // hopefully handle_work() handles all of the errors that aren't
-        // programming errors
-        PyErr_Print();
+    return 0;
+}
+
+static memcev_request* submission_pop(memcev_loop* self) {
+    // only ever called by the event loop (or once it has stopped), so
+    // dequeue_pos doesn't need any synchronisation
+    size_t pos = self->dequeue_pos;
+    submission_cell* cell = &self->ring[pos & self->ring_mask];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+    if(sequence != pos + 1) {
+        // either it's empty, or a producer has claimed this cell but hasn't
+        // finished writing it yet. It'll notify us again when it has
+        return NULL;
     }
 
-    Py_XDECREF(result);
-    Py_DECREF(self);
+    memcev_request* req = cell->req;
 
-    // don't need the GIL anymore after we've handled all of the work
-    PyGILState_Release(gstate);
+    // mark it free for whoever comes around to this cell next time
+    __atomic_store_n(&cell->sequence, pos + self->ring_mask + 1, __ATOMIC_RELEASE);
+    self->dequeue_pos = pos + 1;
+
+    return req;
 }
 
-static PyObject* _MemcevClient_notify(_MemcevClient *self, PyObject *cb) {
-    // This is the MemcevClient.notify() Python method to let the event loop
-    // know that a new entry has been added on the self.requests queue. All we
-    // do is pass this information onto the event loop, who will trigger
-    // notify_event_loop (through the async_watcher) to do the work in that
-    // thread. It's safe to have multiple outstanding notifies going on
+static void release_waiter(memcev_waiter* waiter) {
+    // drop a reference to a waiter, freeing it if that was the last one
+    pthread_mutex_lock(&waiter->lock);
+    int refs = --waiter->refs;
+    pthread_mutex_unlock(&waiter->lock);
 
-    // the docs claim that ev_async_send doesn't block, but since it's thread-
-    // safe there is probably a mutex in there that I'd rather not block
-    // Python with if we don't have to
-    Py_BEGIN_ALLOW_THREADS;
-    ev_async_send(self->loop, &self->async_watcher);
-    Py_END_ALLOW_THREADS;
+    if(refs == 0) {
+        pthread_mutex_destroy(&waiter->lock);
+        pthread_cond_destroy(&waiter->cond);
+        free(waiter);
+    }
+}
+
+static int pool_grow(request_pool* pool, size_t count) {
+    // make room for count more requests
+    request_slab* slab = malloc(sizeof(request_slab) + count * sizeof(memcev_request));
+    size_t i;
+
+    if(slab == NULL) {
+        return -1;
+    }
+    slab->count = count;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    for(i = 0; i < count; i++) {
+        slab->requests[i].next = pool->free;
+        pool->free = &slab->requests[i];
+    }
+    __atomic_add_fetch(&pool->allocated, count, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static request_pool* pool_new(size_t count) {
+    request_pool* pool = calloc(1, sizeof(request_pool));
+    if(pool == NULL) {
+        return NULL;
+    }
+    pool->refs = 1;
+
+    if(count > 0 && pool_grow(pool, count) == -1) {
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+static void pool_release(request_pool* pool) {
+    // drop a reference to a pool, freeing it and all of its slabs if that was
+    // the last one
+    if(__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    while(pool->slabs != NULL) {
+        request_slab* slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    free(pool);
+}
+
+static memcev_request* pool_get(request_pool* pool) {
+    // take a zeroed request out of the pool. Must be called with the GIL
+    // held, which is what makes us the only thread taking from it
+    memcev_request* req;
+
+    if(pool->free == NULL) {
+        // take everything that's been given back since last time
+        pool->free = __atomic_exchange_n(&pool->returned, NULL, __ATOMIC_ACQUIRE);
+    }
+    if(pool->free == NULL && pool_grow(pool, REQUEST_SLAB_SIZE) == -1) {
+        return NULL;
+    }
+
+    req = pool->free;
+    pool->free = req->next;
+    memset(req, 0, sizeof(memcev_request));
+    req->pool = pool;
+
+    uint64_t in_use = __atomic_add_fetch(&pool->refs, 1, __ATOMIC_RELAXED) - 1;
+    if(in_use > pool->high_water) {
+        __atomic_store_n(&pool->high_water, in_use, __ATOMIC_RELAXED);
+    }
+
+    return req;
+}
+
+static void pool_put(memcev_request* req) {
+    // give a request back to its pool, from any thread. Only pool_get ever
+    // takes from returned, and it takes the whole list at once, so pushing
+    // onto it can't be confused by a request being taken and put back under
+    // us
+    request_pool* pool = req->pool;
+    memcev_request* head = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
+
+    do {
+        req->next = head;
+    } while(!__atomic_compare_exchange_n(&pool->returned, &head, req, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    pool_release(pool);
+}
+
+static int request_needs_gil(memcev_request* req) {
+    // whether we need the GIL to free this request, because it's holding onto
+    // Python objects
+    size_t i;
+
+    if(req->done_cb != NULL || req->has_value || req->parser.direct != NULL) {
+        return 1;
+    }
+    for(i = 0; i < req->parser.values_len; i++) {
+        if(req->parser.values[i].direct != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void free_request(memcev_request* req) {
+    // doesn't touch any of the Python objects, because that needs the GIL.
+    // See release_request
+    size_t i;
+
+    if(req->waiter != NULL) {
+        release_waiter(req->waiter);
+    }
+    if(req->target != NULL) {
+        release_waiter(req->target);
+    }
+    for(i = 0; i < req->parser.values_len; i++) {
+        free(req->parser.values[i].inflated);
+    }
+    if(req->body != req->body_inline) {
+        free(req->body);
+    }
+    free(req->response);
+    free(req->parser.values);
+    pool_put(req);
+}
+
+static void release_request(memcev_request* req) {
+    // free a request and everything it refers to. Must be called with the GIL
+    // held
+    size_t i;
+
+    Py_XDECREF(req->done_cb);
+    if(req->has_value) {
+        PyBuffer_Release(&req->value);
+    }
+    Py_XDECREF(req->parser.direct);
+    for(i = 0; i < req->parser.values_len; i++) {
+        Py_XDECREF(req->parser.values[i].direct);
+    }
+
+    free_request(req);
+}
+
+static memcev_request** append_request(memcev_request** tail, memcev_request* req) {
+    // add a request to the end of a list, returning the new tail
+    req->next = NULL;
+    *tail = req;
+    return &req->next;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int histogram_bucket(uint64_t ns) {
+    // which of a histogram's buckets a latency goes in. See HIST_SUB_BITS
+    if(ns < HIST_SUBS) {
+        return (int)ns;
+    }
+
+    int shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+    int bucket = (shift + 1) * HIST_SUBS + (int)(ns >> shift) - HIST_SUBS;
+
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+static uint64_t histogram_bucket_limit(int bucket) {
+    // the smallest latency that's too big for a bucket
+    if(bucket < HIST_SUBS) {
+        return bucket + 1;
+    }
+
+    int shift = bucket / HIST_SUBS - 1;
+    return ((uint64_t)(HIST_SUBS + bucket % HIST_SUBS) + 1) << shift;
+}
+
+static void histogram_record(memcev_histogram* histogram, uint64_t ns) {
+    // only the event loop calls this, so the max can't race with anybody
+    __atomic_add_fetch(&histogram->counts[histogram_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->total_ns, ns, __ATOMIC_RELAXED);
+    if(ns > histogram->max_ns) {
+        __atomic_store_n(&histogram->max_ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+static int request_failed(memcev_request* req) {
+    // whether a finished request didn't get a good response
+    return req->error != NULL || req->errnum || req->timed_out
+        || req->parser.state == parse_error;
+}
+
+static void record_request(memcev_loop* self, memcev_request* req, uint64_t now) {
+    // count a finished get or set and how long it spent where
+    if(req->op != request_get && req->op != request_set) {
+        return;
+    }
+
+    memcev_stats* stats = &self->stats;
+    memcev_histogram* latency = stats->latency[req->op];
+
+    __atomic_add_fetch(req->op == request_get ? &stats->gets : &stats->sets,
+                       1, __ATOMIC_RELAXED);
+    if(request_failed(req)) {
+        __atomic_add_fetch(&stats->errors, 1, __ATOMIC_RELAXED);
+    }
+    if(req->timed_out) {
+        __atomic_add_fetch(&stats->timeouts, 1, __ATOMIC_RELAXED);
+    }
+    if(req->overloaded) {
+        __atomic_add_fetch(&stats->overloaded, 1, __ATOMIC_RELAXED);
+    }
+    if(req->replica && request_failed(req)) {
+        __atomic_add_fetch(&stats->replica_set_failures, 1, __ATOMIC_RELAXED);
+    }
+
+    histogram_record(&latency[LATENCY_TOTAL], now - req->submitted_ns);
+    if(req->op == request_get && self->hedge_auto) {
+        hedge_sample(self, now - req->submitted_ns);
+    }
+
+    // followers and requests that failed before they were written never
+    // went over the wire themselves
+    if(req->sent_ns) {
+        histogram_record(&latency[LATENCY_QUEUE], req->sent_ns - req->submitted_ns);
+        histogram_record(&latency[LATENCY_WIRE], now - req->sent_ns);
+    }
+}
+
+static memcev_request* request_new(memcev_loop* self, request_op op, int server,
+                                   size_t header_len, Py_buffer* value,
+                                   PyObject* done_cb, memcev_waiter* waiter,
+                                   double timeout, memcev_waiter* target) {
+    // build a request with room for a header_len byte body, which the caller
+    // fills in before passing it to request_push. If there's a value then
+    // it's the buffer that the caller got for it, which the request now owns
+    // (even if this fails). Must be called with the GIL held
+
+    if(__atomic_load_n(&self->stopped, __ATOMIC_ACQUIRE)) {
+        if(value != NULL) {
+            PyBuffer_Release(value);
+        }
+        PyErr_SetString(PyExc_IOError, "Client closed");
+        return NULL;
+    }
+
+    memcev_request* req = pool_get(self->pool);
+    if(req == NULL) {
+        if(value != NULL) {
+            PyBuffer_Release(value);
+        }
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    req->op = op;
+    req->server = server;
+    req->state = request_submitted;
+    req->parser.type = op == request_set ? response_set : response_get;
+    req->parser.state = parse_line;
+    req->timeout = timeout > 0 ? timeout : 0;
+    req->wheel_slot = -1;
+    req->submitted_ns = monotonic_ns();
+
+    // unless they say otherwise, gets are somebody waiting for an answer and
+    // sets can wait behind them
+    req->priority = op == request_set ? PRIORITY_BULK : PRIORITY_INTERACTIVE;
+
+    if(value != NULL) {
+        req->value = *value;
+        req->has_value = 1;
+    }
+
+    size_t copied_len = header_len;
+
+    if(req->has_value
+       && (req->value.len < ZERO_COPY_MIN_SIZE || (done_cb == NULL && waiter == NULL))) {
+        // it's small enough that it's cheaper to copy it into the body. We
+        // also copy it if nobody is waiting for the result, because then we'd
+        // need the GIL just to let go of it afterwards
+        copied_len += req->value.len + 2;
+    }
+
+    if(copied_len <= REQUEST_INLINE_BODY) {
+        req->body = req->body_inline;
+    } else if((req->body = malloc(copied_len)) == NULL) {
+        if(req->has_value) {
+            PyBuffer_Release(&req->value);
+        }
+        pool_put(req);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    req->body_len = copied_len;
+
+    if(copied_len != header_len) {
+        memcpy(req->body + header_len, req->value.buf, req->value.len);
+        memcpy(req->body + header_len + req->value.len, "\r\n", 2);
+        PyBuffer_Release(&req->value);
+        req->has_value = 0;
+    }
+
+    // the event loop will hold onto these until it's done
+    Py_XINCREF(done_cb);
+    req->done_cb = done_cb;
+
+    if(waiter != NULL) {
+        pthread_mutex_lock(&waiter->lock);
+        waiter->refs++;
+        pthread_mutex_unlock(&waiter->lock);
+        req->waiter = waiter;
+    }
+
+    if(target != NULL) {
+        pthread_mutex_lock(&target->lock);
+        target->refs++;
+        pthread_mutex_unlock(&target->lock);
+        req->target = target;
+    }
+
+    return req;
+}
+
+static int request_push(memcev_loop* self, memcev_request* req) {
+    // push a request from request_new onto the submission ring. Must be
+    // called with the GIL held
+    int pushed = submission_push(self, req);
+
+    if(pushed == -1) {
+        // the ring is full. Waiting for room doesn't need the GIL, so let the
+        // other submitters in while we do
+        Py_BEGIN_ALLOW_THREADS;
+
+        do {
+            // all that we can do is make sure the event loop knows that
+            // there's work waiting, and give it a chance to make room
+            ev_async_send(self->loop, &self->async_watcher);
+            sched_yield();
+        } while((pushed = submission_push(self, req)) == -1
+                && !__atomic_load_n(&self->stopped, __ATOMIC_ACQUIRE));
+
+        Py_END_ALLOW_THREADS;
+    }
+
+    if(pushed == 0) {
+        // it's safe to have multiple outstanding sends, libev coalesces them
+        ev_async_send(self->loop, &self->async_watcher);
+    }
+
+    if(pushed == -1) {
+        // we were stopped while waiting for room
+        if(req->hedge != NULL) {
+            release_request(req->hedge);
+        }
+        release_request(req);
+        PyErr_SetString(PyExc_IOError, "Client closed");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* submit(memcev_loop* self, request_op op, int server,
+                        const char* body, size_t body_len, PyObject* value,
+                        PyObject* done_cb, memcev_waiter* waiter,
+                        double timeout, memcev_waiter* target) {
+    // build a request out of an already encoded body and push it onto the
+    // submission ring. Must be called with the GIL held
+    Py_buffer buffer;
+
+    if(value != NULL && PyObject_GetBuffer(value, &buffer, PyBUF_SIMPLE) == -1) {
+        return NULL;
+    }
+
+    memcev_request* req = request_new(self, op, server, body_len,
+                                      value != NULL ? &buffer : NULL,
+                                      done_cb, waiter, timeout, target);
+    if(req == NULL) {
+        return NULL;
+    }
+    if(body_len) {
+        memcpy(req->body, body, body_len);
+    }
 
+    if(request_push(self, req) == -1) {
+        return NULL;
+    }
     Py_RETURN_NONE;
 }
 
-static void getset_request_cb(struct ev_loop* loop, ev_io *watcher, int revents) {
-    // libev will call us here when we're ready to send the request, and again
-    // when we're ready to receive new data. we funnel that off to the parsing
-    // callbacks passed to us from Python repeatedly until he says he's done
+static int submit_all(_MemcevClient* self, request_op op, int server,
+                      PyObject* done_cb, memcev_waiter* waiter,
+                      double timeout, memcev_waiter* target) {
+    // submit a copy of a request that isn't for any key to every loop,
+    // returning how many of them there were (so how many results to expect)
+    int i;
+
+    for(i = 0; i < self->num_loops; i++) {
+        PyObject* result = submit(&self->loops[i], op, server, NULL, 0, NULL,
+                                  done_cb, waiter, timeout, target);
+        if(result == NULL) {
+            return -1;
+        }
+        Py_DECREF(result);
+    }
+
+    return self->num_loops;
+}
+
+static memcev_loop* loop_for_key(_MemcevClient* self, const char* key, size_t key_len) {
+    // which loop everything for a key goes to
+    if(self->num_loops == 1) {
+        return &self->loops[0];
+    }
+    return &self->loops[cache_hash(key, key_len) % self->num_loops];
+}
 
-    getset_request* req = (getset_request*)watcher->data;
+static memcev_loop* key_loop(_MemcevClient* self, const char* body, size_t body_len) {
+    // which loop a get or set goes to, by the (first) key in its body
+    const char* end = body + body_len;
+    const char* key = memchr(body, ' ', body_len);
+    const char* p;
+
+    if(self->num_loops == 1 || key == NULL) {
+        return &self->loops[0];
+    }
 
-    ev_connection* connection = NULL;
+    key++;
+    for(p = key; p < end && *p != ' ' && *p != '\r'; p++) {
+    }
 
-    // intermediate results that we use
-    PyObject* newacc = NULL;
-    PyObject* parse_response = NULL;
-    PyObject* done_bool = NULL;
-    PyObject* done_none_result = NULL;
+    return loop_for_key(self, key, p - key);
+}
 
-    // used in the error: label
-    PyObject* error_none_result = NULL;
-    PyObject* ptype = NULL;
-    PyObject* pvalue = NULL;
-    PyObject* ptraceback = NULL;
+static uint64_t word_has_byte(uint64_t word, unsigned char byte) {
+    // non-zero if any of the 8 bytes in word is byte. XORing leaves a zero
+    // byte where it was, and subtracting 1 from every byte only borrows into
+    // the top bit of a byte that was zero (or already had it set, which ~x
+    // rules out)
+    uint64_t x = word ^ (0x0101010101010101ULL * byte);
+    return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+}
 
-    PyGILState_STATE gstate;
-    gstate = PyGILState_Ensure();
+static int valid_key(const char* key, size_t key_len) {
+    // memcached takes any key up to MAX_KEY_LENGTH bytes that doesn't have
+    // a NUL or whitespace (space, tab, CR or LF) in it, since those would
+    // end it early. We look for all of them 8 bytes at a time
+    size_t i = 0;
 
-    connection = PyCapsule_GetPointer(req->connection, "connection");
-    if(connection == NULL) {
-        goto error;
+    if(key_len == 0 || key_len > MAX_KEY_LENGTH) {
+        return 0;
     }
 
-    if(EV_WRITE & revents) {
-        if(req->state == getset_not_started) {
-            char* request_string = PyString_AsString(req->body);
-            if(request_string == NULL) {
-                goto error;
-            }
+    for(; i + 8 <= key_len; i += 8) {
+        uint64_t word;
+        memcpy(&word, key + i, 8);
+        if(word_has_byte(word, '\0') | word_has_byte(word, ' ')
+           | word_has_byte(word, '\t') | word_has_byte(word, '\r')
+           | word_has_byte(word, '\n')) {
+            return 0;
+        }
+    }
 
-            size_t sent_size = send(connection->fd, request_string,
-                                    PyString_Size(req->body), 0);
+    for(; i < key_len; i++) {
+        char c = key[i];
+        if(c == '\0' || c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            return 0;
+        }
+    }
 
-            if(sent_size == -1) {
-                // have to build our own error
-                PyErr_SetFromErrno(PyExc_IOError);
-                goto error;
-            }
+    return 1;
+}
+
+static int check_key(PyObject* key) {
+    // raise a ValueError for anything that isn't a valid key
+    if(PyString_Check(key) && valid_key(PyString_AS_STRING(key), PyString_GET_SIZE(key))) {
+        return 0;
+    }
+
+    PyObject* repr = PyObject_Repr(key);
+    if(repr != NULL) {
+        PyErr_Format(PyExc_ValueError, "Invalid key: %s", PyString_AS_STRING(repr));
+        Py_DECREF(repr);
+    }
+    return -1;
+}
+
+static int check_priority(int priority) {
+    if(priority < 0 || priority >= PRIORITY_LANES) {
+        PyErr_Format(PyExc_ValueError, "Unknown priority %d", priority);
+        return -1;
+    }
+    return 0;
+}
+
+static size_t decimal_len(unsigned long long n) {
+    size_t len = 1;
+    while(n >= 10) {
+        n /= 10;
+        len++;
+    }
+    return len;
+}
+
+static char* write_decimal(char* p, unsigned long long n) {
+    // write n out in full, returning where it ends. There's no NUL, because
+    // it's going into the middle of a request
+    size_t len = decimal_len(n);
+    size_t i;
+
+    for(i = len; i > 0; i--) {
+        p[i - 1] = '0' + n % 10;
+        n /= 10;
+    }
+    return p + len;
+}
+
+static void write_set_header(char* p, const char* key, size_t key_len,
+                             unsigned long flags, long expire, size_t value_len,
+                             int noreply) {
+    // set <key> <flags> <expire> <length>[ noreply]\r\n, which
+    // set_header_len says how long it'll be
+    unsigned long long abs_expire = expire < 0 ? -(unsigned long long)expire : expire;
+
+    memcpy(p, "set ", 4);
+    p += 4;
+    memcpy(p, key, key_len);
+    p += key_len;
+    *p++ = ' ';
+    p = write_decimal(p, flags);
+    *p++ = ' ';
+    if(expire < 0) {
+        *p++ = '-';
+    }
+    p = write_decimal(p, abs_expire);
+    *p++ = ' ';
+    p = write_decimal(p, value_len);
+    if(noreply) {
+        memcpy(p, NOREPLY, NOREPLY_LEN);
+        p += NOREPLY_LEN;
+    }
+    memcpy(p, "\r\n", 2);
+}
+
+static size_t set_header_len(size_t key_len, unsigned long flags, long expire,
+                             size_t value_len, int noreply) {
+    unsigned long long abs_expire = expire < 0 ? -(unsigned long long)expire : expire;
+
+    return 4 + key_len + 1 + decimal_len(flags) + 1 + (expire < 0)
+        + decimal_len(abs_expire) + 1 + decimal_len(value_len)
+        + (noreply ? NOREPLY_LEN : 0) + 2;
+}
 
-            req->state = getset_awaiting_response;
+static int parse_done_cb(PyObject** done_cb, memcev_waiter** waiter) {
+    // work out whether done_cb is a callable, a _MemcevWaiter or None (see
+    // _submit), leaving it set only if it's a callable
+    *waiter = NULL;
+
+    if(*done_cb == Py_None) {
+        *done_cb = NULL;
+    } else if(PyObject_TypeCheck(*done_cb, &_MemcevWaiterType)) {
+        *waiter = ((_MemcevWaiter*)*done_cb)->waiter;
+        *done_cb = NULL;
+        if(*waiter == NULL) {
+            PyErr_SetString(PyExc_ValueError, "waiter isn't initialised");
+            return -1;
+        }
+    } else if(!PyCallable_Check(*done_cb)) {
+        PyErr_SetString(PyExc_TypeError, "done_cb must be callable or a waiter");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* _MemcevClient__submit(_MemcevClient *self, PyObject *args) {
+    // This is how Python hands us work: _submit(op, server, body, done_cb[,
+    // value[, timeout]]), which returns how many results it'll produce. body
+    // is the request already encoded in the memcached protocol (or None for
+    // ops that don't talk to the server). For sets it can stop after the
+    // command line, and then the value (any buffer) and a \r\n are sent
+    // after it. done_cb can be a callable to be called on the event loop
+    // thread with the result tuple, a _MemcevWaiter to collect the result
+    // from, or None if nobody cares. If the request hasn't finished within
+    // timeout seconds it fails with a TimeoutError
+    char* op_name = NULL;
+    int server = -1;
+    const char* body = NULL;
+    int body_len = 0;
+    PyObject* done_cb = NULL;
+    PyObject* value = NULL;
+    double timeout = 0;
+
+    if(!PyArg_ParseTuple(args, "siz#O|Od",
+                         &op_name, &server, &body, &body_len, &done_cb,
+                         &value, &timeout)) {
+        return NULL;
+    }
+
+    if(value == Py_None) {
+        value = NULL;
+    }
+
+    request_op op;
+    if(strcmp(op_name, "get") == 0) {
+        op = request_get;
+    } else if(strcmp(op_name, "set") == 0) {
+        op = request_set;
+    } else if(strcmp(op_name, "connect") == 0) {
+        op = request_connect;
+    } else if(strcmp(op_name, "check") == 0) {
+        op = request_check;
+    } else if(strcmp(op_name, "stop") == 0) {
+        op = request_stop;
+    } else if(strcmp(op_name, "flush") == 0) {
+        op = request_flush;
+    } else {
+        PyErr_Format(PyExc_ValueError, "Unknown op %s", op_name);
+        return NULL;
+    }
+
+    // we'd much rather bail here than on the event loop's thread, where
+    // there's nobody to raise to
+    if(op == request_get || op == request_set || op == request_connect) {
+        if(server < 0 || server >= self->loops[0].num_servers) {
+            PyErr_Format(PyExc_ValueError, "Unknown server %d", server);
+            return NULL;
+        }
+    }
+
+    if((op == request_get || op == request_set) && body_len == 0) {
+        PyErr_Format(PyExc_ValueError, "%s needs a body", op_name);
+        return NULL;
+    }
+
+    if(value != NULL && op != request_set) {
+        PyErr_Format(PyExc_ValueError, "%s doesn't take a value", op_name);
+        return NULL;
+    }
+
+    memcev_waiter* waiter = NULL;
+
+    if(parse_done_cb(&done_cb, &waiter) == -1) {
+        return NULL;
+    }
+
+    if(op == request_get || op == request_set) {
+        // everything for a key happens on the same loop, so it happens in
+        // the order that it was asked for
+        PyObject* result = submit(key_loop(self, body, body_len), op, server,
+                                  body, body_len, value, done_cb, waiter,
+                                  timeout, NULL);
+        if(result == NULL) {
+            return NULL;
+        }
+        Py_DECREF(result);
+        return PyInt_FromLong(1);
+    }
+
+    // and everything else is done by every loop, because they each have
+    // their own connections and their own machinery to check
+    int submitted = submit_all(self, op, server, done_cb, waiter, timeout, NULL);
+    if(submitted == -1) {
+        return NULL;
+    }
+    return PyInt_FromLong(submitted);
+}
+
+static PyObject* _MemcevClient__submit_get(_MemcevClient *self, PyObject *args) {
+    // _submit_get(keys, done_cb[, timeout[, server[, priority]]]) gets a
+    // list of keys, encoding the request straight into its body. They all go
+    // to server if it's given (and isn't -1), or otherwise to whichever one
+    // the first key lives on, in which case a get for a single key may be
+    // hedged to one of its replicas. The keys must all belong to the same
+    // loop (which _split_keys sorts them out by), so that the get can't
+    // overtake a set of any of them. Returns how many results it'll produce
+    // (always 1)
+    PyObject* keys = NULL;
+    PyObject* done_cb = NULL;
+    double timeout = 0;
+    int server = -1;
+    int priority = PRIORITY_INTERACTIVE;
+    int replica = -1;
+    memcev_waiter* waiter = NULL;
+    Py_ssize_t i;
+
+    if(!PyArg_ParseTuple(args, "O!O|dii", &PyList_Type, &keys, &done_cb,
+                         &timeout, &server, &priority)) {
+        return NULL;
+    }
+
+    if(check_priority(priority) == -1) {
+        return NULL;
+    }
+
+    Py_ssize_t num_keys = PyList_GET_SIZE(keys);
+    if(num_keys == 0) {
+        PyErr_SetString(PyExc_ValueError, "get needs a key");
+        return NULL;
+    }
+
+    PyObject* first = PyList_GET_ITEM(keys, 0);
+    if(check_key(first) == -1) {
+        return NULL;
+    }
+    const char* first_key = PyString_AS_STRING(first);
+    size_t first_len = PyString_GET_SIZE(first);
+    memcev_loop* loop = loop_for_key(self, first_key, first_len);
+
+    size_t body_len = sizeof("get\r\n") - 1;
+    for(i = 0; i < num_keys; i++) {
+        PyObject* key = PyList_GET_ITEM(keys, i);
+        if(check_key(key) == -1) {
+            return NULL;
+        }
+        if(loop_for_key(self, PyString_AS_STRING(key), PyString_GET_SIZE(key)) != loop) {
+            PyErr_SetString(PyExc_ValueError, "keys in one get must all be on the same loop");
+            return NULL;
+        }
+        body_len += 1 + PyString_GET_SIZE(key);
+    }
+
+    if(server == -1 && num_keys == 1 && self->hedging) {
+        int servers[2];
+        if(ketama_servers(self, first_key, first_len, servers, 2) == 2) {
+            replica = servers[1];
+        }
+        server = servers[0];
+    } else if(server == -1) {
+        server = ketama_server(self, first_key, first_len);
+    }
+    if(server < 0 || server >= self->loops[0].num_servers) {
+        PyErr_Format(PyExc_ValueError, "Unknown server %d", server);
+        return NULL;
+    }
+
+    if(parse_done_cb(&done_cb, &waiter) == -1) {
+        return NULL;
+    }
+
+    memcev_request* req = request_new(loop, request_get, server, body_len, NULL,
+                                      done_cb, waiter, timeout, NULL);
+    if(req == NULL) {
+        return NULL;
+    }
+
+    req->priority = priority;
+
+    char* p = req->body;
+    memcpy(p, "get", 3);
+    p += 3;
+    for(i = 0; i < num_keys; i++) {
+        PyObject* key = PyList_GET_ITEM(keys, i);
+        *p++ = ' ';
+        memcpy(p, PyString_AS_STRING(key), PyString_GET_SIZE(key));
+        p += PyString_GET_SIZE(key);
+    }
+    memcpy(p, "\r\n", 2);
+
+    if(replica != -1) {
+        // the copy that may be sent to the replica. We make it now, even
+        // though it probably won't be needed, because only submitters can
+        // take requests from the pool
+        memcev_request* hedge = request_new(loop, request_get, replica, body_len,
+                                            NULL, NULL, NULL, timeout, NULL);
+        if(hedge == NULL) {
+            release_request(req);
+            return NULL;
+        }
+        memcpy(hedge->body, req->body, body_len);
+        hedge->hedged = req;
+        req->hedge = hedge;
+    }
+
+    if(request_push(loop, req) == -1) {
+        return NULL;
+    }
+    return PyInt_FromLong(1);
+}
+
+static PyObject* _MemcevClient__submit_set(_MemcevClient *self, PyObject *args) {
+    // _submit_set(key, value, expire, done_cb[, timeout[, priority[,
+    // write_behind]]]) sets a key to a value (anything with a buffer) on
+    // whichever server it lives on, encoding the command line straight into
+    // the request's body. With replicas, copies also go to the next servers
+    // after it on the ring, but nobody hears how they went. With
+    // write_behind it waits in the loop's write-behind buffer and is sent
+    // with noreply, so nobody can hear how it went either. Returns how many
+    // results it'll produce (always 1)
+    PyObject* key = NULL;
+    PyObject* value = NULL;
+    long expire = 0;
+    PyObject* done_cb = NULL;
+    double timeout = 0;
+    int priority = PRIORITY_BULK;
+    int write_behind = 0;
+    memcev_waiter* waiter = NULL;
+    Py_buffer buffer;
+
+    if(!PyArg_ParseTuple(args, "OOlO|dii", &key, &value, &expire, &done_cb,
+                         &timeout, &priority, &write_behind)) {
+        return NULL;
+    }
+
+    if(check_key(key) == -1 || check_priority(priority) == -1
+       || parse_done_cb(&done_cb, &waiter) == -1) {
+        return NULL;
+    }
+
+    if(write_behind) {
+        if(self->loops[0].write_behind <= 0) {
+            PyErr_SetString(PyExc_ValueError, "write_behind isn't enabled");
+            return NULL;
+        }
+        if(done_cb != NULL || waiter != NULL) {
+            PyErr_SetString(PyExc_ValueError, "sets written behind can't be waited for");
+            return NULL;
+        }
+    }
+
+    if(PyObject_GetBuffer(value, &buffer, PyBUF_SIMPLE) == -1) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_ValueError, "values must be strings or buffers of len<=1mb");
+        return NULL;
+    }
+    if(buffer.len > MAX_VALUE_LENGTH) {
+        PyBuffer_Release(&buffer);
+        PyErr_SetString(PyExc_ValueError, "values must be strings or buffers of len<=1mb");
+        return NULL;
+    }
+
+    const char* key_str = PyString_AS_STRING(key);
+    size_t key_len = PyString_GET_SIZE(key);
+    size_t value_len = buffer.len;
+    size_t header_len = set_header_len(key_len, 0, expire, value_len, write_behind);
+    int servers[MAX_REPLICAS];
+    int num_servers = ketama_servers(self, key_str, key_len, servers, self->replicas);
+    int i;
+
+    if(servers[0] >= self->loops[0].num_servers) {
+        PyBuffer_Release(&buffer);
+        PyErr_Format(PyExc_ValueError, "Unknown server %d", servers[0]);
+        return NULL;
+    }
+
+    memcev_loop* loop = loop_for_key(self, key_str, key_len);
+    memcev_request* reqs[MAX_REPLICAS];
+
+    // every copy is built before any of them is pushed, so that if we raise
+    // then none of them was sent
+    for(i = 0; i < num_servers; i++) {
+        if(i > 0 && PyObject_GetBuffer(value, &buffer, PyBUF_SIMPLE) == -1) {
+            goto error;
+        }
+
+        memcev_request* req = request_new(loop, request_set, servers[i], header_len,
+                                          &buffer, i == 0 ? done_cb : NULL,
+                                          i == 0 ? waiter : NULL, timeout, NULL);
+        if(req == NULL) {
+            goto error;
+        }
+        reqs[i] = req;
+
+        req->priority = priority;
+        req->replica = i > 0;
+        write_set_header(req->body, key_str, key_len, 0, expire, value_len, write_behind);
+        req->set_header_len = header_len;
+        req->set_key_len = key_len;
+        req->set_expire = expire;
+        req->set_value_len = value_len;
+        if(write_behind) {
+            req->write_behind = 1;
+            req->parser.type = response_none;
+        }
+    }
+
+    for(i = 0; i < num_servers; i++) {
+        if(request_push(loop, reqs[i]) == -1) {
+            // the client has been closed, so the rest of them can't go
+            // either. But once the set itself has gone it's going to be
+            // answered, so then only its copies are lost
+            int pushed = i;
+            while(++i < num_servers) {
+                release_request(reqs[i]);
+            }
+            if(pushed == 0) {
+                return NULL;
+            }
+            PyErr_Clear();
+            break;
+        }
+    }
+
+    return PyInt_FromLong(1);
+
+error:
+    while(i-- > 0) {
+        release_request(reqs[i]);
+    }
+    return NULL;
+}
+
+static PyObject* _MemcevClient__split_keys(_MemcevClient *self, PyObject *args) {
+    // check a list of keys and sort them out into a dict of lists by the
+    // (server, loop) that they live on. Each list can be got in one request
+    // that stays in order with the sets of its keys
+    PyObject* keys = NULL;
+    PyObject* by_server = NULL;
+    Py_ssize_t i;
+
+    if(!PyArg_ParseTuple(args, "O!", &PyList_Type, &keys)) {
+        return NULL;
+    }
+
+    if((by_server = PyDict_New()) == NULL) {
+        return NULL;
+    }
+
+    for(i = 0; i < PyList_GET_SIZE(keys); i++) {
+        PyObject* key = PyList_GET_ITEM(keys, i);
+
+        if(check_key(key) == -1) {
+            goto error;
+        }
+
+        const char* key_str = PyString_AS_STRING(key);
+        size_t key_len = PyString_GET_SIZE(key);
+        memcev_loop* loop = loop_for_key(self, key_str, key_len);
+        PyObject* where = Py_BuildValue("(in)", ketama_server(self, key_str, key_len),
+                                        (Py_ssize_t)(loop - self->loops));
+        if(where == NULL) {
+            goto error;
+        }
+
+        PyObject* server_keys = PyDict_GetItem(by_server, where);
+        if(server_keys == NULL) {
+            if((server_keys = PyList_New(0)) == NULL
+               || PyDict_SetItem(by_server, where, server_keys) == -1) {
+                Py_XDECREF(server_keys);
+                Py_DECREF(where);
+                goto error;
+            }
+            Py_DECREF(server_keys); // the dict has it now
+        }
+        Py_DECREF(where);
+
+        if(PyList_Append(server_keys, key) == -1) {
+            goto error;
+        }
+    }
+
+    return by_server;
+
+error:
+    Py_DECREF(by_server);
+    return NULL;
+}
+
+static PyObject* _MemcevClient__valid_key(PyObject *unused, PyObject *args) {
+    PyObject* key = NULL;
+
+    if(!PyArg_ParseTuple(args, "O", &key)) {
+        return NULL;
+    }
+
+    return PyBool_FromLong(PyString_Check(key)
+                           && valid_key(PyString_AS_STRING(key), PyString_GET_SIZE(key)));
+}
+
+static PyObject* _MemcevClient__cancel(_MemcevClient *self, PyObject *args) {
+    // cancel every request that was submitted with a waiter that hasn't
+    // finished yet. They fail as if they'd timed out, but with their own
+    // error
+    PyObject* waiter_obj = NULL;
+
+    if(!PyArg_ParseTuple(args, "O!", &_MemcevWaiterType, &waiter_obj)) {
+        return NULL;
+    }
+
+    memcev_waiter* target = ((_MemcevWaiter*)waiter_obj)->waiter;
+    if(target == NULL) {
+        PyErr_SetString(PyExc_ValueError, "waiter isn't initialised");
+        return NULL;
+    }
+
+    if(submit_all(self, request_cancel, -1, NULL, NULL, 0, target) == -1) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static int stats_set(PyObject* dict, const char* name, uint64_t value) {
+    PyObject* number = PyLong_FromUnsignedLongLong(value);
+    if(number == NULL) {
+        return -1;
+    }
+    int ret = PyDict_SetItemString(dict, name, number);
+    Py_DECREF(number);
+    return ret;
+}
+
+static uint64_t stats_load(uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static PyObject* histogram_snapshot(_MemcevClient* self, request_op op, int stage) {
+    // one of the latency histograms, added up over all of the loops, as
+    // ([(limit_ns, count), ...], total_ns, max_ns) with a pair for every
+    // bucket that isn't empty. limit_ns is the smallest latency that's too
+    // big to be in that bucket
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    int bucket;
+    int i;
+
+    PyObject* buckets = PyList_New(0);
+    if(buckets == NULL) {
+        return NULL;
+    }
+
+    for(bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+        uint64_t count = 0;
+        for(i = 0; i < self->num_loops; i++) {
+            count += stats_load(&self->loops[i].stats.latency[op][stage].counts[bucket]);
+        }
+        if(count == 0) {
+            continue;
+        }
+
+        PyObject* pair = Py_BuildValue("(KK)",
+                                       (unsigned PY_LONG_LONG)histogram_bucket_limit(bucket),
+                                       (unsigned PY_LONG_LONG)count);
+        if(pair == NULL || PyList_Append(buckets, pair) == -1) {
+            Py_XDECREF(pair);
+            Py_DECREF(buckets);
+            return NULL;
+        }
+        Py_DECREF(pair);
+    }
+
+    for(i = 0; i < self->num_loops; i++) {
+        memcev_histogram* histogram = &self->loops[i].stats.latency[op][stage];
+        uint64_t loop_max = stats_load(&histogram->max_ns);
+
+        total_ns += stats_load(&histogram->total_ns);
+        if(loop_max > max_ns) {
+            max_ns = loop_max;
+        }
+    }
+
+    return Py_BuildValue("(NKK)", buckets,
+                         (unsigned PY_LONG_LONG)total_ns,
+                         (unsigned PY_LONG_LONG)max_ns);
+}
+
+static PyObject* _MemcevClient__stats(_MemcevClient *self, PyObject *unused) {
+    // the client's counters, added up over all of its loops. They're read
+    // while the loops carry on running, each one atomically but not all at
+    // once, so they may be a request or two out of step with each other
+    static const struct {
+        const char* name;
+        size_t offset;
+    } counters[] = {
+        {"compressed_values", offsetof(memcev_stats, compressed_values)},
+        {"bytes_before_compression", offsetof(memcev_stats, bytes_before_compression)},
+        {"bytes_after_compression", offsetof(memcev_stats, bytes_after_compression)},
+        {"decompressed_values", offsetof(memcev_stats, decompressed_values)},
+        {"unreadable_values", offsetof(memcev_stats, unreadable_values)},
+        {"coalesced_gets", offsetof(memcev_stats, coalesced_gets)},
+        {"gets", offsetof(memcev_stats, gets)},
+        {"sets", offsetof(memcev_stats, sets)},
+        {"errors", offsetof(memcev_stats, errors)},
+        {"timeouts", offsetof(memcev_stats, timeouts)},
+        {"overloaded", offsetof(memcev_stats, overloaded)},
+        {"bytes_sent", offsetof(memcev_stats, bytes_sent)},
+        {"bytes_received", offsetof(memcev_stats, bytes_received)},
+        {"pool_exhausted", offsetof(memcev_stats, pool_exhausted)},
+        {"hedges", offsetof(memcev_stats, hedges)},
+        {"hedge_wins", offsetof(memcev_stats, hedge_wins)},
+        {"replica_set_failures", offsetof(memcev_stats, replica_set_failures)},
+        {"write_behind_coalesced", offsetof(memcev_stats, write_behind_coalesced)},
+    };
+    static const struct {
+        const char* name;
+        size_t offset;
+    } server_counters[] = {
+        {"requests", offsetof(memcev_server_stats, requests)},
+        {"bytes_sent", offsetof(memcev_server_stats, bytes_sent)},
+        {"bytes_received", offsetof(memcev_server_stats, bytes_received)},
+        {"failures", offsetof(memcev_server_stats, failures)},
+    };
+    static const char* ops[] = {"get", "set"};
+    static const char* stages[] = {"queue", "wire", "total"};
+
+    PyObject* stats = NULL;
+    PyObject* latency = NULL;
+    PyObject* servers = NULL;
+    size_t c;
+    int i, j;
+
+    if((stats = PyDict_New()) == NULL) {
+        goto error;
+    }
+
+    for(c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+        uint64_t total = 0;
+        for(i = 0; i < self->num_loops; i++) {
+            total += stats_load((uint64_t*)((char*)&self->loops[i].stats
+                                            + counters[c].offset));
+        }
+        if(stats_set(stats, counters[c].name, total) == -1) {
+            goto error;
+        }
+    }
+
+    // the pools' in_use is read from their refs, less the loop's own
+    uint64_t pool_allocated = 0, pool_in_use = 0, pool_high_water = 0;
+    for(i = 0; i < self->num_loops; i++) {
+        request_pool* pool = self->loops[i].pool;
+        if(pool != NULL) {
+            pool_allocated += stats_load(&pool->allocated);
+            pool_in_use += stats_load(&pool->refs) - 1;
+            pool_high_water += stats_load(&pool->high_water);
+        }
+    }
+    if(stats_set(stats, "request_pool_allocated", pool_allocated) == -1
+       || stats_set(stats, "request_pool_in_use", pool_in_use) == -1
+       || stats_set(stats, "request_pool_high_water", pool_high_water) == -1) {
+        goto error;
+    }
+
+    // we have the GIL, so the near cache's are all up to date
+    if(stats_set(stats, "cache_hits", self->cache_hits) == -1
+       || stats_set(stats, "cache_misses", self->cache_misses) == -1
+       || stats_set(stats, "cache_evictions", self->cache_evictions) == -1
+       || stats_set(stats, "cache_entries", self->cache_count) == -1
+       || stats_set(stats, "cache_bytes", self->cache_bytes) == -1) {
+        goto error;
+    }
+
+    if((latency = PyDict_New()) == NULL
+       || PyDict_SetItemString(stats, "latency", latency) == -1) {
+        goto error;
+    }
+    for(i = request_get; i <= request_set; i++) {
+        for(j = 0; j < LATENCY_STAGES; j++) {
+            char name[32];
+            PyObject* histogram = histogram_snapshot(self, i, j);
+            if(histogram == NULL) {
+                goto error;
+            }
+            snprintf(name, sizeof(name), "%s_%s", ops[i], stages[j]);
+            int ret = PyDict_SetItemString(latency, name, histogram);
+            Py_DECREF(histogram);
+            if(ret == -1) {
+                goto error;
+            }
+        }
+    }
+
+    // and one dict per server, in the order that they were given to
+    // _set_servers
+    int num_servers = self->num_loops ? self->loops[0].num_servers : 0;
+    if((servers = PyList_New(num_servers)) == NULL
+       || PyDict_SetItemString(stats, "servers", servers) == -1) {
+        goto error;
+    }
+    for(j = 0; j < num_servers; j++) {
+        PyObject* server = PyDict_New();
+        if(server == NULL) {
+            goto error;
+        }
+        PyList_SET_ITEM(servers, j, server);
+
+        for(c = 0; c < sizeof(server_counters) / sizeof(server_counters[0]); c++) {
+            uint64_t total = 0;
+            for(i = 0; i < self->num_loops; i++) {
+                total += stats_load((uint64_t*)((char*)&self->loops[i].servers[j].stats
+                                                + server_counters[c].offset));
+            }
+            if(stats_set(server, server_counters[c].name, total) == -1) {
+                goto error;
+            }
+        }
+    }
+
+    Py_DECREF(latency);
+    Py_DECREF(servers);
+    return stats;
+
+error:
+    Py_XDECREF(stats);
+    Py_XDECREF(latency);
+    Py_XDECREF(servers);
+    return NULL;
+}
+
+static void notify_event_loop(struct ev_loop *loop, ev_async *watcher, int revents) {
+    // triggered on the the event loop thread when somebody has pushed requests
+    // onto the submission ring. Because of libev event coalescing there may be
+    // several, or none. Routing them doesn't need the GIL at all: we only take
+    // it at the end to deliver the ones that have already finished
+
+    memcev_loop* self = (memcev_loop*)ev_userdata(loop);
+    memcev_request* completed = NULL;
+    memcev_request** completed_tail = &completed;
+    memcev_request* req;
+    int i;
+
+    while((req = submission_pop(self)) != NULL) {
+        if(self->stopped) {
+            // this was submitted before the stop, but got here after it
+            req->error = "Client closed";
+            completed_tail = append_request(completed_tail, req);
+            continue;
+        }
+
+        if(req->timeout > 0 && !req->write_behind) {
+            // the clock starts now, which is close enough to when it was
+            // submitted. For sets that are written behind it starts when
+            // they're flushed
+            req->deadline = ev_now(loop) + req->timeout;
+            wheel_add(self, req);
+        }
+
+        if(req->op == request_set && self->compress_threshold) {
+            compress_request(self, req);
+        }
+
+        if(req->op == request_set) {
+            // gets from before this can't be followed by ones after it
+            self->inflight_generation++;
+        } else if(req->op == request_get && coalesce_get(self, req)) {
+            // it'll be finished along with the one that it's following, so
+            // it has no use for a hedge of its own
+            if(req->hedge != NULL) {
+                free_request(req->hedge);
+                req->hedge = NULL;
+            }
+            continue;
+        }
+
+        if(req->hedge != NULL) {
+            hedge_queue(self, req);
+        }
+
+        if(req->write_behind) {
+            write_behind_add(self, req);
+            continue;
+        } else if(self->wb_count > 0
+                  && (req->op == request_get || req->op == request_set)) {
+            // anything still buffered for its keys has to go first, so that
+            // it doesn't read a value from before it or get overwritten by it
+            write_behind_release(self, req);
+        }
+
+        switch(req->op) {
+        case request_get:
+        case request_set:
+            // these wait in line at their server until a connection has
+            // room. Since each server has its own line, a slow server doesn't
+            // hold up work for the others
+            completed_tail = admit_pending(self, &self->servers[req->server],
+                                           req, completed_tail);
+            break;
+
+        case request_connect:
+            completed_tail = start_connect(self, req, completed_tail);
+            break;
+
+        case request_cancel:
+            completed_tail = cancel_waiter(self, req->target, completed_tail);
+            completed_tail = append_request(completed_tail, req);
+            break;
+
+        case request_check:
+            // if we got this far then the machinery works
+            completed_tail = append_request(completed_tail, req);
+            break;
+
+        case request_stop:
+            completed_tail = stop_client(self, completed_tail);
+            completed_tail = append_request(completed_tail, req);
+            break;
+
+        case request_flush:
+            completed_tail = start_flush(self, req, completed_tail);
+            break;
+        }
+    }
+
+    if(!self->stopped) {
+        // now that everything has been routed, hand out whatever we can to the
+        // servers' connections
+        for(i = 0; i < self->num_servers; i++) {
+            completed_tail = dispatch_server(self, &self->servers[i], completed_tail);
+        }
+    }
+
+    deliver_requests(self, completed);
+}
+
+static void fail_submissions(memcev_loop* self) {
+    // fail everything left on the submission ring. Only call this once the
+    // event loop has stopped
+    memcev_request* completed = NULL;
+    memcev_request** completed_tail = &completed;
+    memcev_request* req;
+
+    while((req = submission_pop(self)) != NULL) {
+        req->error = "Client closed";
+        completed_tail = append_request(completed_tail, req);
+    }
+
+    deliver_requests(self, completed);
+}
+
+// the longest response line (not including VALUE payloads) that we're willing
+// to buffer before deciding that the server is broken
+#define MAX_LINE_LENGTH 2048
+
+// how big the receive buffer starts, and the most that we'll try to recv() at
+// once when we don't know how big the response is going to be
+#define RBUF_INITIAL_SIZE 4096
+
+static int line_is(const char* line, size_t line_len, const char* expected) {
+    size_t expected_len = strlen(expected);
+    return line_len == expected_len && memcmp(line, expected, expected_len) == 0;
+}
+
+static int line_starts_with(const char* line, size_t line_len, const char* prefix) {
+    size_t prefix_len = strlen(prefix);
+    return line_len >= prefix_len && memcmp(line, prefix, prefix_len) == 0;
+}
+
+static void parse_error_line(response_parser* parser, const char* error,
+                             size_t start, size_t len, int fatal) {
+    parser->state = parse_error;
+    parser->error = error;
+    parser->error_start = start;
+    parser->error_len = len;
+    parser->fatal = fatal;
+}
+
+static const char* parse_number(const char* p, const char* end,
+                                unsigned long max, unsigned long* number) {
+    // read a decimal number of at most max out of [p, end). Unlike strtoul it
+    // only takes digits, so there's no sign or whitespace, and it can't run
+    // past the end of the line. Returns where it stopped, or NULL if there
+    // wasn't a number there or it was too big
+    const char* start = p;
+    unsigned long n = 0;
+
+    while(p < end && *p >= '0' && *p <= '9') {
+        unsigned long digit = *p - '0';
+        if(n > (max - digit) / 10) {
+            return NULL;
+        }
+        n = n * 10 + digit;
+        p++;
+    }
+
+    if(p == start) {
+        return NULL;
+    }
+    *number = n;
+    return p;
+}
+
+static int parse_value_line(response_parser* parser, const char* buf,
+                            size_t line_start, size_t line_len) {
+    // VALUE <key> <flags> <bytes> [<cas unique>]
+    const char* line = buf + line_start;
+    const char* end = line + line_len;
+    const char* p = line + strlen("VALUE ");
+
+    const char* key = p;
+    while(p < end && *p != ' ') {
+        p++;
+    }
+    if(p == key || p == end) {
+        return -1;
+    }
+    parser->current.key_start = key - buf;
+    parser->current.key_len = p - key;
+    parser->current.inflated = NULL;
+    parser->current.unreadable = 0;
+    p++;
+
+    // flags are 32 bits, and no value can be bigger than memcached will
+    // store. Anything else means that we can't trust the length to find the
+    // end of the payload with
+    unsigned long value_len = 0;
+    p = parse_number(p, end, UINT32_MAX, &parser->current.flags);
+    if(p == NULL || p == end || *p != ' ') {
+        return -1;
+    }
+    p++;
+
+    p = parse_number(p, end, MAX_VALUE_LENGTH, &value_len);
+    if(p == NULL || (p < end && *p != ' ')) {
+        return -1;
+    }
+    parser->current.value_len = value_len;
+
+    return 0;
+}
+
+static int push_value(response_parser* parser) {
+    // add the VALUE block that we just finished to the list of them
+    if(parser->values_len == parser->values_size) {
+        size_t new_size = parser->values_size ? parser->values_size * 2 : 4;
+        parsed_value* new_values = realloc(parser->values,
+                                           new_size * sizeof(parsed_value));
+        if(new_values == NULL) {
+            parse_error_line(parser, "Out of memory parsing response", 0, 0, 1);
+            return -1;
+        }
+        parser->values = new_values;
+        parser->values_size = new_size;
+    }
+
+    parser->values[parser->values_len++] = parser->current;
+    return 0;
+}
+
+static void parse_response(response_parser* parser, const char* buf, size_t len) {
+    // incrementally parse a memcached text protocol response out of buf, which
+    // holds everything that we've received so far. Because we remember where
+    // we left off in parser->pos we never look at the same bytes twice, and
+    // when we're inside of a VALUE we skip straight to the end of the payload
+    // using its declared length instead of scanning it
+
+    while(parser->state == parse_line || parser->state == parse_value
+          || parser->state == parse_value_end) {
+        if(parser->state == parse_value_end) {
+            // the payload went straight into parser->direct
+            if(len - parser->pos < 2) {
+                return;
+            }
+            if(buf[parser->pos] != '\r' || buf[parser->pos + 1] != '\n') {
+                parse_error_line(parser, "Malformed VALUE payload from server", 0, 0, 1);
+                return;
+            }
+            parser->pos += 2;
+            parser->state = parse_line;
+            continue;
+        }
+
+        if(parser->state == parse_value) {
+            size_t value_len = parser->current.value_len;
+
+            if(parser->direct != NULL) {
+                // it's being read straight into its string instead
+                return;
+            }
+
+            if(len - parser->pos < value_len + 2) {
+                // need more data
+                return;
+            }
+
+            if(buf[parser->pos + value_len] != '\r'
+               || buf[parser->pos + value_len + 1] != '\n') {
+                parse_error_line(parser, "Malformed VALUE payload from server", 0, 0, 1);
+                return;
+            }
+
+            parser->current.value_start = parser->pos;
+            parser->current.direct = NULL;
+            if(push_value(parser) == -1) {
+                return;
+            }
+            parser->pos += value_len + 2;
+            parser->state = parse_line;
+            continue;
+        }
+
+        const char* line = buf + parser->pos;
+        const char* newline = memchr(line, '\n', len - parser->pos);
+
+        if(newline == NULL) {
+            if(len - parser->pos > MAX_LINE_LENGTH) {
+                parse_error_line(parser, "Response line too long", 0, 0, 1);
+            }
+            // otherwise we need more data
+            return;
+        }
+
+        if(newline == line || newline[-1] != '\r') {
+            parse_error_line(parser, "Malformed response line from server", 0, 0, 1);
+            return;
+        }
+
+        size_t line_start = parser->pos;
+        size_t line_len = newline - line - 1; // minus the \r
+        parser->pos += line_len + 2;
+
+        if(line_is(line, line_len, "ERROR")) {
+            parse_error_line(parser, "Unknown error from server", 0, 0, 0);
+
+        } else if(line_starts_with(line, line_len, "CLIENT_ERROR ")) {
+            parse_error_line(parser, "Client error",
+                             line_start + strlen("CLIENT_ERROR "),
+                             line_len - strlen("CLIENT_ERROR "), 0);
+
+        } else if(line_starts_with(line, line_len, "SERVER_ERROR ")) {
+            parse_error_line(parser, "Server error",
+                             line_start + strlen("SERVER_ERROR "),
+                             line_len - strlen("SERVER_ERROR "), 0);
+
+        } else if(parser->type == response_set && line_is(line, line_len, "STORED")) {
+            parser->state = parse_done;
+
+        } else if(parser->type == response_get && line_is(line, line_len, "END")) {
+            parser->state = parse_done;
+
+        } else if(parser->type == response_get
+                  && line_starts_with(line, line_len, "VALUE ")) {
+            if(parse_value_line(parser, buf, line_start, line_len) == -1) {
+                parse_error_line(parser, "Malformed VALUE line from server",
+                                 line_start, line_len, 1);
+                return;
+            }
+            parser->state = parse_value;
+
+        } else {
+            parse_error_line(parser, "Unexpected response from server",
+                             line_start, line_len, 1);
+        }
+    }
+}
+
+static size_t parse_wants(response_parser* parser) {
+    // how many bytes of rbuf the parser needs before it can make progress, if
+    // it knows. This lets us grow the buffer once to fit a large value rather
+    // than doubling our way up to it
+    if(parser->state == parse_value) {
+        return parser->pos + parser->current.value_len + 2;
+    }
+    return 0;
+}
+
+static int ensure_rbuf(ev_connection* connection, size_t wanted) {
+    // make sure that there's room in the connection's rbuf for `wanted` total
+    // bytes, and for at least some more to be read
+    size_t needed = connection->rbuf_len + RBUF_INITIAL_SIZE;
+    if(wanted > needed) {
+        needed = wanted;
+    }
+
+    if(needed <= connection->rbuf_size) {
+        return 0;
+    }
+
+    size_t new_size = connection->rbuf_size ? connection->rbuf_size : RBUF_INITIAL_SIZE;
+    while(new_size < needed) {
+        if(new_size > SIZE_MAX / 2) {
+            // doubling would wrap around, so it has to be exactly this big
+            new_size = needed;
+            break;
+        }
+        new_size *= 2;
+    }
+
+    char* new_rbuf = realloc(connection->rbuf, new_size);
+    if(new_rbuf == NULL) {
+        return -1;
+    }
+
+    connection->rbuf = new_rbuf;
+    connection->rbuf_size = new_size;
+    return 0;
+}
+
+// set on values that we compressed. This is the same bit that pylibmc and
+// python-memcached use, so they can read each other's values
+#define FLAG_COMPRESSED (1 << 3)
+
+// compression happens on the event loop, so we'd rather it was fast than
+// small
+#define COMPRESS_LEVEL 1
+
+
+static void compress_request(memcev_loop* self, memcev_request* req) {
+    // compress a set's value if it's big enough and it's worth it, rewriting
+    // the set line to mark it with FLAG_COMPRESSED. If anything goes wrong it
+    // just goes out as it is. Only sets that _submit_set encoded are
+    // compressed, because we know what's in their set line without having to
+    // parse it (and their flags are always 0)
+    size_t header_len = req->set_header_len;
+    size_t value_len = req->set_value_len;
+    const char* value;
+
+    if(header_len == 0 || value_len < self->compress_threshold) {
+        return;
+    }
+
+    if(req->has_value) {
+        value = req->value.buf;
+    } else if(req->body_len == header_len + value_len + 2) {
+        value = req->body + header_len;
+    } else {
+        return;
+    }
+
+    uLongf compressed_len = compressBound(value_len);
+    char* compressed = malloc(compressed_len);
+    if(compressed == NULL) {
+        return;
+    }
+
+    if(compress2((Bytef*)compressed, &compressed_len, (const Bytef*)value,
+                 value_len, COMPRESS_LEVEL) != Z_OK
+       || compressed_len >= value_len) {
+        // it doesn't compress, so the server may as well have it as it is
+        free(compressed);
+        return;
+    }
+
+    const char* key = req->body + 4;
+    size_t key_len = req->set_key_len;
+    long expire = req->set_expire;
+    size_t new_header_len = set_header_len(key_len, FLAG_COMPRESSED, expire,
+                                           compressed_len, req->write_behind);
+    char* body = malloc(new_header_len + compressed_len + 2);
+    if(body == NULL) {
+        free(compressed);
+        return;
+    }
+
+    write_set_header(body, key, key_len, FLAG_COMPRESSED, expire, compressed_len,
+                     req->write_behind);
+    memcpy(body + new_header_len, compressed, compressed_len);
+    memcpy(body + new_header_len + compressed_len, "\r\n", 2);
+    free(compressed);
+
+    if(req->body != req->body_inline) {
+        free(req->body);
+    }
+    req->body = body;
+    req->body_len = new_header_len + compressed_len + 2;
+
+    if(req->has_value) {
+        // we have to keep holding the buffer until we have the GIL to let go
+        // of it, but it's not sent anymore
+        req->value_compressed = 1;
+    }
+
+    __atomic_add_fetch(&self->stats.compressed_values, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&self->stats.bytes_before_compression, value_len,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&self->stats.bytes_after_compression, compressed_len,
+                       __ATOMIC_RELAXED);
+}
+
+static int inflate_value(memcev_loop* self, parsed_value* value, const char* rbuf) {
+    // undo compress_request for a value that we got back from the server,
+    // keeping the original in value->inflated. We never compress anything
+    // bigger than MAX_VALUE_LENGTH, so anything that inflates past that is
+    // corrupt or isn't ours
+    const char* data = value->direct != NULL
+        ? PyString_AS_STRING(value->direct)
+        : rbuf + value->value_start;
+    size_t size = value->value_len * 4 + 64;
+    if(size > MAX_VALUE_LENGTH) {
+        size = MAX_VALUE_LENGTH;
+    }
+
+    char* inflated = malloc(size);
+    if(inflated == NULL) {
+        return -1;
+    }
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if(inflateInit(&stream) != Z_OK) {
+        free(inflated);
+        return -1;
+    }
+
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = value->value_len;
+    stream.next_out = (Bytef*)inflated;
+    stream.avail_out = size;
+
+    int err;
+    while((err = inflate(&stream, Z_NO_FLUSH)) != Z_STREAM_END) {
+        if(err != Z_OK && err != Z_BUF_ERROR) {
+            break;
+        }
+        if(stream.avail_out > 0 || size == MAX_VALUE_LENGTH) {
+            // it ran out of input before the end of the stream, or it wants
+            // more room than any value of ours could need
+            break;
+        }
+
+        // grow the buffer and carry on from where it left off
+        size_t new_size = size * 2;
+        if(new_size > MAX_VALUE_LENGTH) {
+            new_size = MAX_VALUE_LENGTH;
+        }
+        char* new_inflated = realloc(inflated, new_size);
+        if(new_inflated == NULL) {
+            break;
+        }
+        inflated = new_inflated;
+        stream.next_out = (Bytef*)inflated + size;
+        stream.avail_out = new_size - size;
+        size = new_size;
+    }
+
+    inflateEnd(&stream);
+
+    if(err != Z_STREAM_END) {
+        free(inflated);
+        return -1;
+    }
+
+    value->inflated = inflated;
+    value->inflated_len = stream.total_out;
+    __atomic_add_fetch(&self->stats.decompressed_values, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static PyObject* build_response(memcev_request* req) {
+    // turn a finished request into the result tuple for the done_cb. Must be
+    // called with the GIL held
+    response_parser* parser = &req->parser;
+
+    if(req->overloaded) {
+        PyErr_SetString(MemcevOverloadError,
+                        req->error ? req->error : "Request timed out waiting for a connection");
+        return NULL;
+    }
+
+    if(req->timed_out) {
+        PyErr_SetString(MemcevTimeoutError, "Request timed out");
+        return NULL;
+    }
+
+    if(req->errnum) {
+        errno = req->errnum;
+        return PyErr_SetFromErrno(PyExc_IOError);
+    }
+
+    if(req->error) {
+        PyErr_SetString(PyExc_IOError, req->error);
+        return NULL;
+    }
+
+    switch(req->op) {
+    case request_connect:
+        return Py_BuildValue("(s)", "connected");
+    case request_check:
+        return Py_BuildValue("(s)", "checked");
+    case request_stop:
+        return Py_BuildValue("(s)", "stopped");
+    case request_flush:
+        return Py_BuildValue("(s)", "flushed");
+    default:
+        break;
+    }
+
+    // everything else got a response from the server, which is either still
+    // in the connection's rbuf or has been copied out for a waiter
+    const char* rbuf = req->response ? req->response
+                       : req->conn ? req->conn->rbuf : NULL;
+
+    if(parser->state == parse_error) {
+        PyObject* message = PyString_FromString(parser->error);
+        if(message != NULL && parser->error_len) {
+            PyString_ConcatAndDel(&message, PyString_FromString(": "));
+            PyString_ConcatAndDel(&message,
+                PyString_FromStringAndSize(rbuf + parser->error_start,
+                                           parser->error_len));
+        }
+        if(message == NULL) {
+            return NULL;
+        }
+
+        PyObject* exc = PyObject_CallFunctionObjArgs(PyExc_Exception, message, NULL);
+        Py_DECREF(message);
+        if(exc == NULL) {
+            return NULL;
+        }
+
+        return Py_BuildValue("(sN)", "error", exc);
+    }
+
+    if(parser->type == response_set) {
+        return Py_BuildValue("(s)", "setted");
+    }
+
+    // gets return a dict of every key that was found. Any that the server
+    // didn't have are simply missing
+    PyObject* found = PyDict_New();
+    if(found == NULL) {
+        return NULL;
+    }
+
+    size_t i;
+    for(i = 0; i < parser->values_len; i++) {
+        parsed_value* value = &parser->values[i];
+
+        if(value->unreadable) {
+            continue;
+        }
+
+        PyObject* key = PyString_FromStringAndSize(rbuf + value->key_start,
+                                                   value->key_len);
+        PyObject* payload = NULL;
+
+        if(value->inflated != NULL) {
+            payload = PyString_FromStringAndSize(value->inflated,
+                                                 value->inflated_len);
+        } else if(value->direct != NULL) {
+            // it's already been read into its own string
+            payload = value->direct;
+            Py_INCREF(payload);
+        } else {
+            payload = PyString_FromStringAndSize(rbuf + value->value_start,
+                                                 value->value_len);
+        }
+
+        if(key == NULL || payload == NULL || PyDict_SetItem(found, key, payload) == -1) {
+            Py_XDECREF(key);
+            Py_XDECREF(payload);
+            Py_DECREF(found);
+            return NULL;
+        }
+
+        Py_DECREF(key);
+        Py_DECREF(payload);
+    }
+
+    return Py_BuildValue("(sN)", "getted", found);
+}
+
+static PyObject* response_tuple(memcev_request* req) {
+    // like build_response, but exceptions are turned into an error tuple that
+    // can be handed back to whoever is waiting. Must be called with the GIL
+    // held
+    PyObject* result = build_response(req);
+
+    if(result == NULL) {
+        // there's an exception on the stack that occurred that we can
+        // report back up through the cb
+        PyObject* ptype = NULL;
+        PyObject* pvalue = NULL;
+        PyObject* ptraceback = NULL;
+
+        PyErr_Fetch(&ptype, &pvalue, &ptraceback);
+        // since we're actually "handling" it, we can normalise it
+        PyErr_NormalizeException(&ptype, &pvalue, &ptraceback);
+
+        result = Py_BuildValue("(sO)", "error", pvalue ? pvalue : Py_None);
+
+        Py_XDECREF(ptype);
+        Py_XDECREF(pvalue);
+        Py_XDECREF(ptraceback);
+    }
+
+    return result;
+}
+
+static int detach_response(memcev_request* req, const char* rbuf, size_t start) {
+    // the response to a request lives in its connection's rbuf, which gets
+    // reused as soon as we've delivered it. That's fine for done_cbs, but a
+    // waiter picks its results up later on another thread, so it needs its own
+    // copy with the parser's offsets moved to match
+    response_parser* parser = &req->parser;
+    size_t i;
+
+    if(parser->values_len == 0 && parser->error_len == 0) {
+        // nothing in there that build_response is going to look at
+        return 0;
+    }
+
+    if((req->response = malloc(parser->pos - start)) == NULL) {
+        return -1;
+    }
+    memcpy(req->response, rbuf + start, parser->pos - start);
+    req->response_len = parser->pos - start;
+
+    for(i = 0; i < parser->values_len; i++) {
+        parser->values[i].key_start -= start;
+        parser->values[i].value_start -= start;
+    }
+    parser->error_start -= start;
+
+    return 0;
+}
+
+// single-flight gets. When a stampede of callers all want the same thing at
+// once, only the first of them goes to the server and the rest follow it,
+// getting their own copies of its response. Only a get that's still on its
+// way can be followed, and never across a set, so nobody gets anything older
+// than they could have got by asking themselves
+
+#define INFLIGHT_BUCKETS 1024
+
+static int coalesce_get(memcev_loop* self, memcev_request* req) {
+    // if an identical get is already running, make req one of its followers
+    // and return 1. Otherwise it becomes one that later ones can follow
+    uint32_t hash = cache_hash(req->body, req->body_len);
+    memcev_request** bucket = &self->inflight[hash & (INFLIGHT_BUCKETS - 1)];
+    memcev_request* leader;
+
+    for(leader = *bucket; leader != NULL; leader = leader->inflight_next) {
+        if(leader->body_hash == hash
+           && leader->generation == self->inflight_generation
+           && leader->state != request_finished
+           && leader->server == req->server
+           && leader->body_len == req->body_len
+           && memcmp(leader->body, req->body, req->body_len) == 0) {
+            req->state = request_following;
+            req->leader = leader;
+            req->follow_next = leader->followers;
+            leader->followers = req;
+            __atomic_add_fetch(&self->stats.coalesced_gets, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+
+    req->inflight = 1;
+    req->body_hash = hash;
+    req->generation = self->inflight_generation;
+    req->inflight_next = *bucket;
+    *bucket = req;
+    return 0;
+}
+
+static void inflight_remove(memcev_loop* self, memcev_request* req) {
+    // it's finished, so nothing else can follow it
+    memcev_request** link = &self->inflight[req->body_hash & (INFLIGHT_BUCKETS - 1)];
+
+    while(*link != req) {
+        link = &(*link)->inflight_next;
+    }
+    *link = req->inflight_next;
+    req->inflight_next = NULL;
+    req->inflight = 0;
+}
+
+static void inflight_replace(memcev_loop* self, memcev_request* req,
+                             memcev_request* heir) {
+    // heir is taking over from req, so identical gets follow it instead
+    heir->body_hash = req->body_hash;
+    heir->generation = req->generation;
+    inflight_remove(self, req);
+    heir->inflight = 1;
+    heir->inflight_next = self->inflight[heir->body_hash & (INFLIGHT_BUCKETS - 1)];
+    self->inflight[heir->body_hash & (INFLIGHT_BUCKETS - 1)] = heir;
+}
+
+static void unfollow(memcev_request* req) {
+    // take a follower off of its leader's list, because it's giving up
+    memcev_request** link = &req->leader->followers;
+
+    while(*link != req) {
+        link = &(*link)->follow_next;
+    }
+    *link = req->follow_next;
+    req->follow_next = NULL;
+    req->leader = NULL;
+}
+
+static void promote_follower(memcev_loop* self, memcev_request* req) {
+    // req is being given up on for its own reasons (it timed out or was
+    // cancelled), which its followers shouldn't have to share. So the first
+    // of them takes its place, and goes to the server itself
+    memcev_request* heir = req->followers;
+    memcev_request* follower;
+
+    req->followers = NULL;
+    heir->followers = heir->follow_next;
+    heir->follow_next = NULL;
+    heir->leader = NULL;
+    for(follower = heir->followers; follower != NULL; follower = follower->follow_next) {
+        follower->leader = heir;
+    }
+
+    if(req->inflight) {
+        inflight_replace(self, req, heir);
+    }
+
+    pending_push(&self->servers[heir->server], heir);
+}
+
+static int copy_response(memcev_request* leader, memcev_request* follower) {
+    // give a follower its own copy of its leader's outcome. The leader's
+    // response has always been detached from the rbuf. If it read any values
+    // straight into strings then this must be called with the GIL held
+    response_parser* parser = &follower->parser;
+    size_t i;
+
+    follower->errnum = leader->errnum;
+    follower->error = leader->error;
+    follower->timed_out = leader->timed_out;
+    follower->overloaded = leader->overloaded;
+
+    *parser = leader->parser;
+    parser->direct = NULL;
+    parser->values = NULL;
+    parser->values_len = 0;
+    parser->values_size = 0;
+
+    if(leader->response != NULL) {
+        if((follower->response = malloc(leader->response_len)) == NULL) {
+            return -1;
+        }
+        memcpy(follower->response, leader->response, leader->response_len);
+        follower->response_len = leader->response_len;
+    }
+
+    if(leader->parser.values_len == 0) {
+        return 0;
+    }
+
+    parser->values = malloc(leader->parser.values_len * sizeof(parsed_value));
+    if(parser->values == NULL) {
+        return -1;
+    }
+    parser->values_size = leader->parser.values_len;
+
+    for(i = 0; i < leader->parser.values_len; i++) {
+        parsed_value* value = &parser->values[i];
+
+        *value = leader->parser.values[i];
+        Py_XINCREF(value->direct);
+        parser->values_len++;
+
+        if(value->inflated != NULL) {
+            char* inflated = malloc(value->inflated_len ? value->inflated_len : 1);
+            if(inflated == NULL) {
+                value->inflated = NULL;
+                return -1;
+            }
+            memcpy(inflated, value->inflated, value->inflated_len);
+            value->inflated = inflated;
+        }
+    }
+
+    return 0;
+}
+
+static void share_response(memcev_request* leader) {
+    // hand a copy of a finished get's outcome to each of its followers, and
+    // put them in the list of completed requests straight after it
+    memcev_request* followers = leader->followers;
+    memcev_request* follower;
+    memcev_request* last = NULL;
+    int needs_gil = 0;
+    size_t i;
+    PyGILState_STATE gstate;
+
+    for(i = 0; i < leader->parser.values_len; i++) {
+        if(leader->parser.values[i].direct != NULL) {
+            needs_gil = 1;
+        }
+    }
+
+    if(needs_gil) {
+        gstate = PyGILState_Ensure();
+    }
+
+    for(follower = followers; follower != NULL; follower = follower->follow_next) {
+        if(copy_response(leader, follower) == -1) {
+            follower->errnum = ENOMEM;
+        }
+        follower->state = request_finished;
+        follower->leader = NULL;
+        follower->next = follower->follow_next;
+        last = follower;
+    }
+
+    if(needs_gil) {
+        PyGILState_Release(gstate);
+    }
+
+    for(follower = followers; follower != NULL; follower = follower->next) {
+        follower->follow_next = NULL;
+    }
+
+    leader->followers = NULL;
+    last->next = leader->next;
+    leader->next = followers;
+}
+
+static int complete_waiter(memcev_request* req) {
+    // hand a finished request to its waiter and wake them up. This doesn't
+    // need the GIL. Returns -1 if the waiter is gone, in which case the
+    // request is still ours to free
+    memcev_waiter* waiter = req->waiter;
+
+    pthread_mutex_lock(&waiter->lock);
+
+    if(waiter->abandoned) {
+        // nobody is ever going to collect it
+        pthread_mutex_unlock(&waiter->lock);
+        return -1;
+    }
+
+    req->next = NULL;
+    if(waiter->done_tail == NULL) {
+        waiter->done_head = req;
+    } else {
+        waiter->done_tail->next = req;
+    }
+    waiter->done_tail = req;
+
+    pthread_cond_broadcast(&waiter->cond);
+    pthread_mutex_unlock(&waiter->lock);
+
+    return 0;
+}
+
+static void deliver_requests(memcev_loop* self, memcev_request* completed) {
+    // hand the results of a list of finished requests back to whoever is
+    // waiting for them. Waiters don't need the GIL so they're woken up
+    // straight away. We only need it to call done_cbs and to let go of Python
+    // objects, and we only take it once no matter how many responses came in
+    // together
+    memcev_request* needs_gil = NULL;
+    memcev_request** needs_gil_tail = &needs_gil;
+    memcev_request* req;
+    uint64_t now = completed != NULL ? monotonic_ns() : 0;
+
+    for(req = completed; req != NULL; req = req->next) {
+        // wherever they were, they aren't any more
+        req->state = request_finished;
+    }
+
+    while(completed != NULL) {
+        req = completed;
+
+        if(req->hedge != NULL || req->hedged != NULL) {
+            // only one of a get and its hedge is delivered
+            settle_hedge(self, req);
+        }
+        if(req->inflight) {
+            inflight_remove(self, req);
+        }
+        if(req->followers != NULL) {
+            // they're delivered straight after it
+            share_response(req);
+        }
+        if(req->flush != NULL) {
+            // and so are any flushes that were only waiting for it
+            flush_written(self, req);
+        }
+
+        completed = req->next;
+
+        // it's done, so it can't time out any more
+        wheel_remove(self, req);
+        if(!req->hedge_lost) {
+            record_request(self, req, now);
+        }
+
+        if(req->waiter != NULL) {
+            // they build their result on another thread, maybe after the
+            // connection has been closed, so they mustn't touch it. Anything
+            // in its rbuf that they need was already copied by
+            // detach_response
+            req->conn = NULL;
+            if(complete_waiter(req) == 0) {
+                continue;
+            }
+        }
+
+        if(request_needs_gil(req)) {
+            needs_gil_tail = append_request(needs_gil_tail, req);
+        } else {
+            free_request(req);
+        }
+    }
+
+    if(needs_gil == NULL) {
+        return;
+    }
+
+    PyGILState_STATE gstate;
+    gstate = PyGILState_Ensure();
+
+    while(needs_gil != NULL) {
+        req = needs_gil;
+        needs_gil = req->next;
+
+        if(req->done_cb != NULL) {
+            PyObject* none_result = NULL;
+            PyObject* result = response_tuple(req);
+
+            if(result != NULL) {
+                none_result = PyObject_CallFunctionObjArgs(req->done_cb, result, NULL);
+            }
+
+            Py_XDECREF(none_result);
+            Py_XDECREF(result);
+        }
+
+        // we're totally done so free everything up now
+        release_request(req);
+
+        if(PyErr_Occurred()) {
+            // there's no way to bubble this back up, so the best we can do is
+            // print and clear it
+            PyErr_Print();
+        }
+    }
+
+    PyGILState_Release(gstate);
+}
+
+static void update_watcher(struct ev_loop* loop, ev_connection* connection) {
+    // make the connection's watcher listen for writes if we have anything to
+    // send. It always listens for reads, even when nothing is waiting on a
+    // response, because that's how we find out that the server has hung up on
+    // an idle connection. Until it's connected it isn't ours to touch
+    int events = EV_READ;
+
+    if(connection->state != connection_connected) {
+        return;
+    }
+
+    if(connection->unsent != NULL) {
+        events |= EV_WRITE;
+    }
+
+    if(events == connection->events) {
+        return;
+    }
+
+    ev_io_stop(loop, &connection->watcher);
+    if(events) {
+        ev_io_set(&connection->watcher, connection->fd, events);
+        ev_io_start(loop, &connection->watcher);
+    }
+    connection->events = events;
+}
+
+static void consume_rbuf(ev_connection* connection) {
+    // throw away the responses that we've delivered, keeping anything that
+    // arrived after them. Because the parser works in offsets, the one for the
+    // request that we're still reading has to be moved along with the data
+    size_t consumed = connection->rpos;
+
+    if(consumed == 0) {
+        return;
+    }
+
+    memmove(connection->rbuf, connection->rbuf + consumed,
+            connection->rbuf_len - consumed);
+    connection->rbuf_len -= consumed;
+    connection->rpos = 0;
+
+    if(connection->head != NULL && connection->head != connection->unsent) {
+        response_parser* parser = &connection->head->parser;
+        size_t i;
+
+        parser->pos -= consumed;
+        if(parser->state == parse_value) {
+            parser->current.key_start -= consumed;
+        }
+        for(i = 0; i < parser->values_len; i++) {
+            parser->values[i].key_start -= consumed;
+            parser->values[i].value_start -= consumed;
+        }
+    }
+}
+
+static void count_bulk_set(memcev_server* server, memcev_request* req, int delta) {
+    // keep track of the keys of sets that are waiting in the bulk lane
+    if(req->op != request_set || req->priority != PRIORITY_BULK) {
+        return;
+    }
+    server->bulk_sets += delta;
+    server->bulk_set_keys[req->key_hash & (BULK_SET_FILTER - 1)] += delta;
+}
+
+static const char* next_key(memcev_request* req, const char* key, size_t* key_len) {
+    // find the key after key in a request's body (or the first one if key
+    // is NULL). Bodies are "<command> <key>[ <key>...]" and then either " "
+    // or "\r\n". Returns NULL when there aren't any more
+    const char* end = req->body + req->body_len;
+    const char* p;
+
+    if(key == NULL) {
+        key = memchr(req->body, ' ', req->body_len);
+    } else {
+        key += *key_len;
+    }
+    if(key == NULL || key >= end || *key != ' ') {
+        return NULL;
+    }
+
+    key++;
+    for(p = key; p < end && *p != ' ' && *p != '\r'; p++) {
+    }
+    *key_len = p - key;
+    return key;
+}
+
+static int behind_bulk_set(memcev_server* server, memcev_request* req) {
+    // whether any of the keys in a request might be the same as one for a
+    // set that's waiting in the bulk lane
+    const char* key = NULL;
+    size_t key_len = 0;
+
+    while((key = next_key(req, key, &key_len)) != NULL) {
+        if(server->bulk_set_keys[cache_hash(key, key_len) & (BULK_SET_FILTER - 1)]) {
+            return 1;
+        }
+        if(req->op == request_set) {
+            // only gets have more than one key
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static void pending_push(memcev_server* server, memcev_request* req) {
+    // add a request to the end of its lane in its server's pending queue
+    int lane = req->priority;
+
+    req->state = request_pending;
+    req->next = NULL;
+    req->prev = server->pending_tail[lane];
+
+    if(server->pending_tail[lane] == NULL) {
+        server->pending_head[lane] = req;
+    } else {
+        server->pending_tail[lane]->next = req;
+    }
+    server->pending_tail[lane] = req;
+    server->pending_count++;
+    count_bulk_set(server, req, 1);
+}
+
+static void pending_remove(memcev_server* server, memcev_request* req) {
+    // take a request out of the pending queue, wherever it is in there
+    int lane = req->priority;
+
+    if(req->prev == NULL) {
+        server->pending_head[lane] = req->next;
+    } else {
+        req->prev->next = req->next;
+    }
+    if(req->next == NULL) {
+        server->pending_tail[lane] = req->prev;
+    } else {
+        req->next->prev = req->prev;
+    }
+
+    req->next = NULL;
+    req->prev = NULL;
+    server->pending_count--;
+    count_bulk_set(server, req, -1);
+}
+
+static memcev_request* pending_pop(memcev_server* server) {
+    // take the next request to send, from the first lane that has any
+    int lane;
+
+    for(lane = 0; lane < PRIORITY_LANES; lane++) {
+        memcev_request* req = server->pending_head[lane];
+        if(req != NULL) {
+            pending_remove(server, req);
+            return req;
+        }
+    }
+    return NULL;
+}
+
+static void pending_requeue(memcev_server* server, memcev_request* requeue) {
+    // put a list of requests back at the front of their lanes, in the same
+    // order, because they were there before anything that's in them now.
+    // They were already let in once, so they don't count against
+    // max_pending
+    memcev_request* reversed = NULL;
+    memcev_request* req;
+
+    while((req = requeue) != NULL) {
+        requeue = req->next;
+        req->next = reversed;
+        reversed = req;
+    }
+
+    while((req = reversed) != NULL) {
+        int lane = req->priority;
+        reversed = req->next;
+
+        req->state = request_pending;
+        req->prev = NULL;
+        req->next = server->pending_head[lane];
+        if(server->pending_head[lane] == NULL) {
+            server->pending_tail[lane] = req;
+        } else {
+            server->pending_head[lane]->prev = req;
+        }
+        server->pending_head[lane] = req;
+        server->pending_count++;
+        count_bulk_set(server, req, 1);
+    }
+}
+
+static memcev_request** admit_pending(memcev_loop* self, memcev_server* server,
+                                      memcev_request* req,
+                                      memcev_request** completed_tail) {
+    // put a new request in line at its server. If the line is already full
+    // then something fails straight away, because an error now is better
+    // than making everybody wait longer: the newest request from a lane
+    // behind this one's if there are any, so that bulk work gives way to
+    // interactive work, or otherwise this one
+    if(req->op == request_set && req->priority == PRIORITY_BULK) {
+        size_t key_len = 0;
+        const char* key = next_key(req, NULL, &key_len);
+        req->key_hash = cache_hash(key, key != NULL ? key_len : 0);
+
+    } else if(req->priority != PRIORITY_BULK && server->bulk_sets > 0
+              && behind_bulk_set(server, req)) {
+        // everything for a key still happens in the order that it was asked
+        // for, so this can't go ahead of a set of the same key
+        req->priority = PRIORITY_BULK;
+    }
+
+    if(server->pending_count >= self->max_pending) {
+        memcev_request* shed = req;
+        int lane;
+
+        for(lane = PRIORITY_LANES - 1; lane > req->priority; lane--) {
+            if(server->pending_tail[lane] != NULL) {
+                shed = server->pending_tail[lane];
+                pending_remove(server, shed);
+                break;
+            }
+        }
+
+        shed->overloaded = 1;
+        shed->error = "Too many requests waiting for the server";
+        shed->state = request_finished;
+        completed_tail = append_request(completed_tail, shed);
+
+        if(shed == req) {
+            return completed_tail;
+        }
+    }
+
+    pending_push(server, req);
+    return completed_tail;
+}
+
+static memcev_request* pop_request(ev_connection* connection) {
+    // take the head request off of the connection's FIFO. The next one's
+    // response starts where this one's ended
+    memcev_request* req = connection->head;
+
+    connection->head = req->next;
+    if(connection->head == NULL) {
+        connection->tail = NULL;
+    } else if(connection->head != connection->unsent) {
+        connection->head->parser.pos = connection->rpos;
+    }
+    if(connection->unsent == req) {
+        connection->unsent = req->next;
+    }
+    connection->inflight--;
+
+    req->next = NULL;
+    return req;
+}
+
+static memcev_request* fail_connection(memcev_loop* self, ev_connection* connection,
+                                       int errnum, const char* error,
+                                       memcev_request* completed) {
+    // something has gone wrong such that we can't use this connection anymore.
+    // Everything that we've written to it fails, because we can't know
+    // whether the server did it, and they're all added to the completed list.
+    // Whatever we hadn't started writing yet goes back to its server's queue
+    // to be sent on another connection, and this one is reopened
+    memcev_server* server = &self->servers[connection->server];
+    memcev_request* requeue = NULL;
+    memcev_request** requeue_tail = &requeue;
+    memcev_request** completed_tail = &completed;
+    while(*completed_tail != NULL) {
+        completed_tail = &(*completed_tail)->next;
+    }
+
+    __atomic_add_fetch(&server->stats.failures, 1, __ATOMIC_RELAXED);
+
+    while(connection->head != NULL) {
+        memcev_request* req = connection->head;
+        int written = req != connection->unsent || connection->wpos > 0;
+
+        if(req == connection->unsent) {
+            // whatever comes after it hasn't been started
+            connection->wpos = 0;
+        }
+        pop_request(connection);
+
+        if(!written && !self->stopped) {
+            requeue_tail = append_request(requeue_tail, req);
+            continue;
+        }
+
+        // timed out and cancelled requests already have their own errors
+        if(req->parser.state != parse_error && !req->timed_out
+           && req->error == NULL) {
+            req->errnum = errnum;
+            req->error = error;
+        }
+        req->state = request_finished;
+
+        completed_tail = append_request(completed_tail, req);
+    }
+
+    pending_requeue(server, requeue);
+
+    connection->error = (char*)(error ? error : strerror(errnum));
+    connection_reconnect(self, connection);
+
+    return completed;
+}
+
+static size_t request_len(memcev_request* req) {
+    // how many bytes we send for a request
+    return req->body_len
+        + (req->has_value && !req->value_compressed ? req->value.len + 2 : 0);
+}
+
+static int request_iovecs(memcev_request* req, size_t skip, struct iovec* iov) {
+    // fill in iov with the pieces of a request that are left after the first
+    // skip bytes, returning how many there are (never more than 3). A big
+    // set's value is sent straight out of the caller's buffer
+    struct iovec pieces[3];
+    int count = 1;
+    int i;
+    int ret = 0;
+
+    pieces[0].iov_base = req->body;
+    pieces[0].iov_len = req->body_len;
+    if(req->has_value && !req->value_compressed) {
+        pieces[1].iov_base = req->value.buf;
+        pieces[1].iov_len = req->value.len;
+        pieces[2].iov_base = (void*)"\r\n";
+        pieces[2].iov_len = 2;
+        count = 3;
+    }
+
+    for(i = 0; i < count; i++) {
+        if(skip >= pieces[i].iov_len) {
+            skip -= pieces[i].iov_len;
+            continue;
+        }
+        iov[ret].iov_base = (char*)pieces[i].iov_base + skip;
+        iov[ret].iov_len = pieces[i].iov_len - skip;
+        skip = 0;
+        ret++;
+    }
+
+    return ret;
+}
+
+static int connection_write(memcev_loop* self, ev_connection* connection) {
+    // write out as many of the unsent requests as the socket will take,
+    // batched together into as few writev()s as we can. If it only takes part
+    // of them then wpos remembers how far into the first unsent one we got,
+    // the watcher stays armed for EV_WRITE, and we carry on from there when
+    // there's room. So however big a value is, it's streamed out as fast as
+    // the socket drains without ever blocking the loop. Returns an errno if
+    // the connection is broken
+    while(connection->unsent != NULL) {
+        struct iovec iov[WRITE_MAX_IOVECS];
+        int iovcnt = 0;
+        size_t skip = connection->wpos;
+        size_t total = 0;
+        memcev_request* req;
+        int i;
+
+        for(req = connection->unsent;
+            req != NULL && iovcnt + 3 <= WRITE_MAX_IOVECS;
+            req = req->next) {
+            iovcnt += request_iovecs(req, skip, iov + iovcnt);
+            skip = 0;
+        }
+        for(i = 0; i < iovcnt; i++) {
+            total += iov[i].iov_len;
+        }
+
+        ssize_t sent_size = writev(connection->fd, iov, iovcnt);
+
+        if(sent_size == -1) {
+            if(errno == EAGAIN || errno == EINTR) {
+                return 0;
+            }
+            return errno;
+        }
+
+        memcev_server_stats* server_stats = &self->servers[connection->server].stats;
+        __atomic_add_fetch(&self->stats.bytes_sent, sent_size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&server_stats->bytes_sent, sent_size, __ATOMIC_RELAXED);
+
+        // move past every request that's now been completely written
+        size_t sent = sent_size;
+        uint64_t now = 0;
+        while(connection->unsent != NULL) {
+            req = connection->unsent;
+            size_t left = request_len(req) - connection->wpos;
+
+            if(sent < left) {
+                connection->wpos += sent;
+                break;
+            }
+
+            sent -= left;
+            connection->wpos = 0;
+
+            if(now == 0) {
+                now = monotonic_ns();
+            }
+            req->sent_ns = now;
+
+            req->state = request_awaiting_response;
+            if(req == connection->head) {
+                req->parser.pos = connection->rpos;
+            }
+            connection->unsent = req->next;
+        }
+
+        if((size_t)sent_size < total) {
+            // the socket is full, so wait until it's writeable again
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+static int start_direct_value(ev_connection* connection, response_parser* parser) {
+    // the parser has just started on a big VALUE payload that hasn't all
+    // arrived yet. Rather than growing the rbuf to fit it and then copying it
+    // into a string, make the string now and read the rest straight into it.
+    // Whatever of it is already in the rbuf is moved over
+    size_t value_len = parser->current.value_len;
+    size_t have = connection->rbuf_len - parser->pos;
+
+    PyGILState_STATE gstate;
+    gstate = PyGILState_Ensure();
+    parser->direct = PyString_FromStringAndSize(NULL, value_len);
+    if(parser->direct == NULL) {
+        PyErr_Clear();
+    }
+    PyGILState_Release(gstate);
+
+    if(parser->direct == NULL) {
+        return -1;
+    }
+
+    memcpy(PyString_AS_STRING(parser->direct), connection->rbuf + parser->pos, have);
+    parser->direct_filled = have;
+    connection->rbuf_len = parser->pos;
+
+    return 0;
+}
+
+static int read_direct_value(ev_connection* connection, response_parser* parser) {
+    // read more of a big VALUE payload into its string. Returns like recv()
+    ssize_t received_size = recv(connection->fd,
+                                 PyString_AS_STRING(parser->direct) + parser->direct_filled,
+                                 parser->current.value_len - parser->direct_filled,
+                                 0);
+
+    if(received_size <= 0) {
+        return received_size;
+    }
+
+    parser->direct_filled += received_size;
+
+    if(parser->direct_filled == parser->current.value_len) {
+        // that's all of it, so now all that's left is the \r\n
+        parser->current.direct = parser->direct;
+        if(push_value(parser) == 0) {
+            parser->direct = NULL;
+            parser->state = parse_value_end;
+        }
+    }
+
+    return received_size;
+}
+
+static memcev_request* connection_read(memcev_loop* self, ev_connection* connection) {
+    // read what's available and parse it, returning the list of requests that
+    // are now complete (in the order that they were sent)
+    memcev_request* completed = NULL;
+    memcev_request** completed_tail = &completed;
+    ssize_t received_size;
+
+    memcev_request* head = connection->head;
+    if(head == connection->unsent) {
+        // nothing is waiting for a response
+        head = NULL;
+    }
+
+    if(head != NULL && head->parser.state == parse_value
+       && head->parser.direct == NULL
+       && head->parser.current.value_len >= ZERO_COPY_MIN_SIZE
+       && connection->rbuf_len - head->parser.pos < head->parser.current.value_len) {
+        if(start_direct_value(connection, &head->parser) == -1) {
+            return fail_connection(self, connection, ENOMEM, NULL, NULL);
+        }
+    }
+
+    if(head != NULL && head->parser.direct != NULL) {
+        received_size = read_direct_value(connection, &head->parser);
+
+    } else {
+        size_t wants = head != NULL ? parse_wants(&head->parser) : 0;
+
+        if(ensure_rbuf(connection, wants) == -1) {
+            return fail_connection(self, connection, ENOMEM, NULL, NULL);
+        }
+
+        received_size = recv(connection->fd,
+                             connection->rbuf + connection->rbuf_len,
+                             connection->rbuf_size - connection->rbuf_len,
+                             0);
+
+        if(received_size > 0) {
+            connection->rbuf_len += received_size;
+        }
+    }
+
+    if(received_size == -1) {
+        if(errno == EAGAIN || errno == EINTR) {
+            return NULL;
+        }
+        return fail_connection(self, connection, errno, NULL, NULL);
+    }
+
+    __atomic_add_fetch(&self->stats.bytes_received, received_size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&self->servers[connection->server].stats.bytes_received,
+                       received_size, __ATOMIC_RELAXED);
+
+    if(received_size == 0) {
+        // they hung up on us, possibly mid-response
+        return fail_connection(self, connection, 0, "Connection closed by server", NULL);
+    }
+
+    if(head == NULL) {
+        // nobody asked for this. We only listen to idle connections so that
+        // we notice when the server goes away, and if it's talking out of
+        // turn then we can't trust it to stay in step with our requests
+        return fail_connection(self, connection, 0, "Unexpected data from server", NULL);
+    }
+
+    // a single read may have finished any number of pipelined responses
+    while(connection->head != NULL && connection->head != connection->unsent) {
+        memcev_request* req = connection->head;
+
+        if(req->parser.type == response_none) {
+            // it was sent with noreply, so there's nothing to read for it
+            pop_request(connection);
+            *completed_tail = req;
+            completed_tail = &req->next;
+            continue;
+        }
+
+        parse_response(&req->parser, connection->rbuf, connection->rbuf_len);
+
+        if(req->parser.state != parse_done && req->parser.state != parse_error) {
+            // we need more data
+            break;
+        }
+
+        if(req->parser.state == parse_done) {
+            size_t i;
+            for(i = 0; i < req->parser.values_len; i++) {
+                parsed_value* value = &req->parser.values[i];
+                if((value->flags & FLAG_COMPRESSED)
+                   && inflate_value(self, value, connection->rbuf) == -1) {
+                    // only this key is lost. The rest of a get_multi is
+                    // still good
+                    value->unreadable = 1;
+                    __atomic_add_fetch(&self->stats.unreadable_values, 1,
+                                       __ATOMIC_RELAXED);
+                }
+            }
+        }
+
+        // a hedge that answers first takes over its original's waiter
+        if((req->waiter != NULL || req->followers != NULL || req->hedged != NULL)
+           && detach_response(req, connection->rbuf, connection->rpos) == -1) {
+            req->errnum = ENOMEM;
+        }
+
+        connection->rpos = req->parser.pos;
+        pop_request(connection);
+
+        // it's healthy, so the next time it breaks we can reconnect straight
+        // away
+        connection->failures = 0;
+
+        *completed_tail = req;
+        completed_tail = &req->next;
+
+        if(req->parser.state == parse_error && req->parser.fatal) {
+            // we can't find the start of the next response, so nobody else on
+            // this connection is going to get one
+            return fail_connection(self, connection, 0,
+                                   "Connection failed by an earlier bad response",
+                                   completed);
+        }
+    }
+
+    return completed;
+}
+
+static memcev_request* finish_noreply(ev_connection* connection) {
+    // sets sent with noreply are done as soon as they've been written, but
+    // they only leave the FIFO from its head so that the responses to the
+    // requests in front of them still line up. Returns the ones that are
+    memcev_request* completed = NULL;
+    memcev_request** completed_tail = &completed;
+
+    while(connection->head != NULL && connection->head != connection->unsent
+          && connection->head->parser.type == response_none) {
+        completed_tail = append_request(completed_tail, pop_request(connection));
+    }
+
+    return completed;
+}
+
+static void connection_io_cb(struct ev_loop* loop, ev_io *watcher, int revents) {
+    // libev will call us here when the connection is ready for us to send
+    // requests, or when there are responses to read. We parse the responses
+    // ourselves as they come in without holding the GIL, and only grab it to
+    // hand back finished results
+
+    ev_connection* connection = (ev_connection*)watcher->data;
+    memcev_loop* self = (memcev_loop*)ev_userdata(loop);
+    memcev_request* completed = NULL;
+
+    connection->last_used = ev_now(loop);
+
+    memcev_request** completed_tail = &completed;
+
+    if(EV_WRITE & revents) {
+        int errnum = connection_write(self, connection);
+        if(errnum) {
+            completed = fail_connection(self, connection, errnum, NULL, NULL);
+        } else {
+            completed = finish_noreply(connection);
+        }
+    }
+
+    if((EV_READ & revents) && connection->state == connection_connected) {
+        while(*completed_tail != NULL) {
+            completed_tail = &(*completed_tail)->next;
+        }
+        *completed_tail = connection_read(self, connection);
+    }
+
+    // now that some requests have finished there may be room on this
+    // connection for more of the ones waiting at its server
+    while(*completed_tail != NULL) {
+        completed_tail = &(*completed_tail)->next;
+    }
+    dispatch_server(self, &self->servers[connection->server], completed_tail);
+
+    update_watcher(loop, connection);
+
+    // the completed requests refer to the rbuf, so we can only throw it away
+    // after they've been delivered
+    deliver_requests(self, completed);
+    consume_rbuf(connection);
+}
+
+static void connection_push(struct ev_loop* loop, ev_connection* connection,
+                            memcev_request* req) {
+    // add a request to the end of the connection's pipeline. Its response
+    // will be parsed according to its response_type
+    req->conn = connection;
+    req->state = request_not_started;
+    req->next = NULL;
+    connection->last_used = ev_now(loop);
+
+    if(connection->tail == NULL) {
+        connection->head = req;
+    } else {
+        connection->tail->next = req;
+    }
+    connection->tail = req;
+    if(connection->unsent == NULL) {
+        connection->unsent = req;
+    }
+    connection->inflight++;
+
+    update_watcher(loop, connection);
+}
+
+static memcev_request** dispatch_server(memcev_loop* self, memcev_server* server,
+                                        memcev_request** completed_tail) {
+    // send as much of a server's pending work as its connections will take,
+    // each request going to whichever connection has the fewest in flight
+    // (or the first of those, so that the ones at the end of the list are
+    // the ones that go idle and get closed). If they're all full then we open
+    // another one. Anything that can never be sent is added to the completed
+    // list
+    while(server->pending_count > 0) {
+        ev_connection* best = NULL;
+        int alive = 0;
+        int connecting = 0;
+        int backoff = 0;
+        int i;
+
+        for(i = 0; i < server->num_connections; i++) {
+            ev_connection* connection = server->connections[i];
+
+            if(connection->state == connection_connecting) {
+                connecting++;
+            } else if(connection->state != connection_connected) {
+                backoff++;
+                continue;
+            }
+            alive++;
+
+            if(connection->state == connection_connected
+               && connection->inflight < self->pipeline_depth
+               && (best == NULL || connection->inflight < best->inflight)) {
+                best = connection;
+            }
+        }
+
+        if(best == NULL) {
+            const char* error = "No connections available";
+            int errnum = 0;
+
+            if(connecting == 0 && backoff == 0
+               && server->num_connections < self->max_connections) {
+                // one at a time, because if it's a burst then by the time
+                // this one has connected the others may have room again. And
+                // not while any are broken, because then the server is
+                // probably in trouble and more connections won't help
+                if(add_connection(self, server - self->servers,
+                                  &errnum, &error) != NULL) {
+                    break;
+                }
+            }
+
+            if(alive == 0) {
+                // every connection that we had is broken and waiting to be
+                // reconnected (or we couldn't even open one), so rather than
+                // waiting for that we tell them that the server is down now
+                while(server->pending_count > 0) {
+                    memcev_request* req = pending_pop(server);
+                    req->errnum = errnum;
+                    req->error = errnum ? NULL : error;
+                    completed_tail = append_request(completed_tail, req);
+                }
+            }
+            // otherwise they wait until a connection has room
+            if(alive > 0) {
+                __atomic_add_fetch(&self->stats.pool_exhausted, 1, __ATOMIC_RELAXED);
+            }
+            break;
+        }
+
+        __atomic_add_fetch(&server->stats.requests, 1, __ATOMIC_RELAXED);
+        connection_push(self->loop, best, pending_pop(server));
+    }
+
+    return completed_tail;
+}
+
+static ev_connection* add_connection(memcev_loop* self, int server_index,
+                                     int* errnum, const char** error) {
+    // start opening another connection to a server and add it to its pool.
+    // connect_cb finds out whether it worked. Returns NULL with errnum or
+    // error set if it has already failed
+    memcev_server* server = &self->servers[server_index];
+    memcev_address address;
+
+    if(server_address(server, 0, &address) == -1) {
+        *error = "Server has no known addresses";
+        return NULL;
+    }
+
+    ev_connection* connection = make_connection(&address);
+
+    if(connection == NULL) {
+        *errnum = ENOMEM;
+        return NULL;
+    }
+
+    if(connection->state == connection_error) {
+        // since we're connecting in a non-blocking way, these errors can only
+        // be errors in creating the socket. we don't find out about any
+        // others until later. (The error strings are all static.)
+        *error = connection->error;
+        free(connection);
+        return NULL;
+    }
+
+    if(server->num_connections == server->connections_size) {
+        int new_size = server->connections_size ? server->connections_size * 2 : 4;
+        ev_connection** new_connections = realloc(server->connections,
+                                                  new_size * sizeof(ev_connection*));
+        if(new_connections == NULL) {
+            close(connection->fd);
+            free(connection);
+            *errnum = ENOMEM;
+            return NULL;
+        }
+        server->connections = new_connections;
+        server->connections_size = new_size;
+    }
+
+    server->connections[server->num_connections++] = connection;
+    connection->server = server_index;
+    connection->last_used = ev_now(self->loop);
+
+    // we find out that the connect finished when the socket becomes writeable
+    ev_io_set(&connection->watcher, connection->fd, EV_WRITE);
+    ev_io_start(self->loop, &connection->watcher);
+    connection->events = EV_WRITE;
+
+    return connection;
+}
+
+static memcev_request** start_connect(memcev_loop* self, memcev_request* req,
+                                      memcev_request** completed_tail) {
+    // open another connection to the request's server. The request is
+    // answered once we know whether that worked, unless it has already failed
+    // in which case it's added to the completed list now
+    ev_connection* connection = add_connection(self, req->server,
+                                               &req->errnum, &req->error);
+
+    if(connection == NULL) {
+        return append_request(completed_tail, req);
+    }
+
+    connection->connecting = req;
+    req->conn = connection;
+    req->state = request_connecting;
+
+    return completed_tail;
+}
+
+static void connect_cb(struct ev_loop* loop, ev_io *watcher, int revents) {
+    if(!(EV_WRITE & revents)) {
+        return;
+    }
+
+    memcev_loop* self = (memcev_loop*)ev_userdata(loop);
+    ev_connection* connection = (ev_connection*)watcher->data;
+    memcev_request* req = connection->connecting;
+    connection->connecting = NULL;
+
+    ev_io_stop(loop, watcher);
+    ev_timer_stop(loop, &connection->retry_timer);
+    connection->events = 0;
+
+    int so_error;
+    socklen_t len = sizeof(so_error);
+    int sockopt_result = getsockopt(connection->fd, SOL_SOCKET,
+                                    SO_ERROR, &so_error, &len);
+
+    if(sockopt_result != -1 && so_error == 0) {
+        // success! from now on the same watcher handles all of the
+        // connection's requests
+        connection->state = connection_connected;
+        ev_set_cb(watcher, connection_io_cb);
+        update_watcher(loop, connection);
+    } else {
+        if(sockopt_result == -1) {
+            connection->error = strerror(errno);
+        } else {
+            connection->error = strerror(so_error);
+        }
+
+        if(req != NULL) {
+            req->error = connection->error;
+        }
+
+        // whoever asked for it hears that it failed, but it stays in the pool
+        // and we keep trying
+        connection_reconnect(self, connection);
+    }
+
+    // tell whoever asked for it (if anybody did: reconnects are our own
+    // idea), and if it worked then it can start taking the server's pending
+    // work straight away
+    memcev_request* completed = NULL;
+    memcev_request** completed_tail = &completed;
+    if(req != NULL) {
+        completed_tail = append_request(completed_tail, req);
+    }
+    dispatch_server(self, &self->servers[connection->server], completed_tail);
+
+    deliver_requests(self, completed);
+}
+
+// broken connections are reopened straight away the first time, and after
+// that with exponential backoff between RECONNECT_MIN_DELAY and
+// RECONNECT_MAX_DELAY seconds until one gets a response. A reconnect that
+// hasn't finished after RECONNECT_TIMEOUT seconds counts as a failure
+#define RECONNECT_MIN_DELAY 0.01
+#define RECONNECT_MAX_DELAY 5.0
+#define RECONNECT_TIMEOUT 5.0
+
+static void connection_retry(memcev_loop* self, ev_connection* connection) {
+    // open a new socket for a connection that's been closed. If the server
+    // has several addresses then each failure moves us on to the next
+    memcev_server* server = &self->servers[connection->server];
+    memcev_address address;
+
+    if(server_address(server, connection->failures, &address) == -1) {
+        connection->state = connection_error;
+        connection->error = "Server has no known addresses";
+    } else {
+        connection_open(connection, &address);
+    }
+
+    if(connection->state == connection_error) {
+        connection_reconnect(self, connection);
+        return;
+    }
+
+    ev_io_set(&connection->watcher, connection->fd, EV_WRITE);
+    ev_io_start(self->loop, &connection->watcher);
+    connection->events = EV_WRITE;
+
+    ev_timer_set(&connection->retry_timer, RECONNECT_TIMEOUT, 0);
+    ev_timer_start(self->loop, &connection->retry_timer);
+}
+
+static void connection_reconnect(memcev_loop* self, ev_connection* connection) {
+    // close a connection that's broken and arrange for it to be reopened.
+    // Whatever was on it must already have been dealt with. While it's
+    // waiting dispatch_server won't give it anything
+    ev_io_stop(self->loop, &connection->watcher);
+    ev_timer_stop(self->loop, &connection->retry_timer);
+    connection->events = 0;
+
+    if(connection->fd != -1) {
+        close(connection->fd);
+        connection->fd = -1;
+    }
+
+    // anything left in the rbuf belonged to the old socket. The bytes are
+    // left alone, because completed requests that haven't been delivered yet
+    // may still be pointing at them
+    connection->rbuf_len = 0;
+    connection->rpos = 0;
+    connection->wpos = 0;
+
+    if(self->stopped) {
+        connection->state = connection_error;
+        return;
+    }
+
+    if(connection->failures++ == 0) {
+        // it was working until just now, so it's probably just this one
+        // socket that's gone bad
+        connection_retry(self, connection);
+        return;
+    }
+
+    ev_tstamp delay = RECONNECT_MIN_DELAY;
+    int i;
+    for(i = 2; i < connection->failures && delay < RECONNECT_MAX_DELAY; i++) {
+        delay *= 2;
+    }
+    if(delay > RECONNECT_MAX_DELAY) {
+        delay = RECONNECT_MAX_DELAY;
+    }
+
+    connection->state = connection_backoff;
+    ev_timer_set(&connection->retry_timer, delay, 0);
+    ev_timer_start(self->loop, &connection->retry_timer);
+}
+
+static void retry_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
+    // either it's time to try reconnecting, or a reconnect has taken too long
+    memcev_loop* self = (memcev_loop*)ev_userdata(loop);
+    ev_connection* connection = (ev_connection*)timer->data;
+
+    if(connection->state == connection_connecting) {
+        connection->error = "Connect timed out";
+        connection_reconnect(self, connection);
+    } else {
+        connection_retry(self, connection);
+    }
+}
+
+static void idle_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
+    // close connections that nobody has used for idle_timeout, as long as
+    // that leaves their server with at least min_connections
+    memcev_loop* self = (memcev_loop*)ev_userdata(loop);
+    ev_tstamp now = ev_now(loop);
+    int i, c;
+
+    for(i = 0; i < self->num_servers; i++) {
+        memcev_server* server = &self->servers[i];
+
+        // from the end, because that's where dispatch_server leaves the idle
+        // ones
+        for(c = server->num_connections - 1;
+            c >= 0 && server->num_connections > self->min_connections;
+            c--) {
+            ev_connection* connection = server->connections[c];
+
+            if(connection->head != NULL || connection->connecting != NULL
+               || connection->state == connection_connecting
+               || now - connection->last_used < self->idle_timeout) {
+                continue;
+            }
+
+            ev_io_stop(loop, &connection->watcher);
+            ev_timer_stop(loop, &connection->retry_timer);
+            if(connection->fd != -1) {
+                close(connection->fd);
+            }
+            free(connection->rbuf);
+            free(connection);
+
+            // keep the rest in the same order
+            memmove(&server->connections[c], &server->connections[c + 1],
+                    (server->num_connections - c - 1) * sizeof(ev_connection*));
+            server->num_connections--;
+        }
+    }
+}
+
+static memcev_request** stop_client(memcev_loop* self,
+                                    memcev_request** completed_tail) {
+    // stop the event loop, failing every request that's still outstanding
+    // instead of leaving their callers to wait forever
+    int i, c;
+
+    __atomic_store_n(&self->stopped, 1, __ATOMIC_RELEASE);
+    ev_break(self->loop, EVBREAK_ALL);
+
+    // whatever is still buffered fails along with everything else, and
+    // nothing is left for the flushes to wait for
+    write_behind_flush(self, NULL);
+    while(self->flush_head != NULL) {
+        memcev_request* flush = self->flush_head;
+        flush_detach(self, flush);
+        flush->error = "Client closed";
+        completed_tail = append_request(completed_tail, flush);
+    }
+
+    for(i = 0; i < self->num_servers; i++) {
+        memcev_server* server = &self->servers[i];
+
+        while(server->pending_count > 0) {
+            memcev_request* req = pending_pop(server);
+            req->error = "Client closed";
+            completed_tail = append_request(completed_tail, req);
+        }
+
+        for(c = 0; c < server->num_connections; c++) {
+            ev_connection* connection = server->connections[c];
+
+            if(connection->connecting != NULL) {
+                ev_io_stop(self->loop, &connection->watcher);
+                connection->connecting->error = "Client closed";
+                completed_tail = append_request(completed_tail,
+                                                connection->connecting);
+                connection->connecting = NULL;
+            }
+
+            if(connection->head != NULL) {
+                *completed_tail = fail_connection(self, connection, 0, "Client closed", NULL);
+                while(*completed_tail != NULL) {
+                    completed_tail = &(*completed_tail)->next;
+                }
+            }
+        }
+    }
+
+    return completed_tail;
+}
+
+// deadlines. Every request with a timeout goes into a hashed timer wheel by
+// when its deadline is, and one repeating timer that ticks every WHEEL_TICK
+// looks through the slot for each tick that has passed. So however many
+// requests are in flight, adding and removing them is O(1) and libev only
+// ever has the one timer to think about. Deadlines more than a whole turn of
+// the wheel away just share a slot with nearer ones, and are skipped until
+// their turn really comes
+
+#define WHEEL_TICK 0.01
+#define WHEEL_SLOTS 256
+
+static uint64_t wheel_tick_at(ev_tstamp when) {
+    return (uint64_t)(when / WHEEL_TICK);
+}
+
+static void wheel_add(memcev_loop* self, memcev_request* req) {
+    if(self->wheel_count == 0) {
+        // the timer has been stopped, so it doesn't have anything to catch up
+        // on
+        self->wheel_tick = wheel_tick_at(ev_now(self->loop));
+        ev_timer_set(&self->wheel_timer, WHEEL_TICK, WHEEL_TICK);
+        ev_timer_start(self->loop, &self->wheel_timer);
+    }
+
+    uint64_t tick = wheel_tick_at(req->deadline);
+    if(tick < self->wheel_tick) {
+        tick = self->wheel_tick;
+    }
+
+    req->wheel_slot = tick & (WHEEL_SLOTS - 1);
+    req->wheel_prev = NULL;
+    req->wheel_next = self->wheel[req->wheel_slot];
+    if(req->wheel_next != NULL) {
+        req->wheel_next->wheel_prev = req;
+    }
+    self->wheel[req->wheel_slot] = req;
+    self->wheel_count++;
+}
+
+static void wheel_remove(memcev_loop* self, memcev_request* req) {
+    if(req->wheel_slot == -1) {
+        return;
+    }
+
+    if(req->wheel_prev == NULL) {
+        self->wheel[req->wheel_slot] = req->wheel_next;
+    } else {
+        req->wheel_prev->wheel_next = req->wheel_next;
+    }
+    if(req->wheel_next != NULL) {
+        req->wheel_next->wheel_prev = req->wheel_prev;
+    }
+
+    req->wheel_slot = -1;
+    req->wheel_next = NULL;
+    req->wheel_prev = NULL;
+
+    if(--self->wheel_count == 0) {
+        ev_timer_stop(self->loop, &self->wheel_timer);
+    }
+}
+
+static void connection_unlink(ev_connection* connection, memcev_request* req) {
+    // take a request that hasn't been written yet out of its connection's
+    // FIFO. Nothing after it can have been written either, so none of the
+    // parsers need to move
+    memcev_request** link = &connection->head;
+    memcev_request* prev = NULL;
+
+    while(*link != req) {
+        prev = *link;
+        link = &prev->next;
+    }
+    *link = req->next;
+
+    if(connection->tail == req) {
+        connection->tail = prev;
+    }
+    if(connection->unsent == req) {
+        connection->unsent = req->next;
+    }
+    connection->inflight--;
+
+    req->next = NULL;
+}
+
+static memcev_request** abandon_connection(memcev_loop* self,
+                                           ev_connection* connection,
+                                           memcev_request** completed_tail) {
+    // a request that we've already written has to be abandoned, but its
+    // response is still going to turn up and we'd have no way of telling it
+    // apart from the ones after it. So the only safe thing to do is to reset
+    // the connection, which fails everything else that's been written to it
+    // too. It's the request that's the problem rather than the connection,
+    // so that doesn't count towards the reconnect backoff
+    connection->failures = 0;
+    *completed_tail = fail_connection(self, connection, 0,
+                                      "Connection reset after a request was abandoned",
+                                      NULL);
+    while(*completed_tail != NULL) {
+        completed_tail = &(*completed_tail)->next;
+    }
+
+    return completed_tail;
+}
+
+static memcev_request** expire_request(memcev_loop* self, memcev_request* req,
+                                       memcev_request** completed_tail) {
+    // fail a request that's still somewhere in the machinery, which has
+    // already had its timed_out or error set. Wherever it is, it has to be
+    // taken out without disturbing anything else that's in there with it
+    ev_connection* connection = req->conn;
+
+    if(req->followers != NULL && req->state != request_finished) {
+        promote_follower(self, req);
+    }
+
+    switch(req->state) {
+    case request_following:
+        unfollow(req);
+        break;
+
+    case request_pending:
+        pending_remove(&self->servers[req->server], req);
+        break;
+
+    case request_connecting:
+        // the connection stays in the pool, but we start it over
+        connection->error = "Connect timed out";
+        connection->connecting = NULL;
+        connection_reconnect(self, connection);
+        break;
+
+    case request_not_started:
+        if(!(req == connection->unsent && connection->wpos > 0)) {
+            // nothing has gone out yet, so we can just forget about it
+            connection_unlink(connection, req);
+            update_watcher(self->loop, connection);
+            break;
+        }
+        // otherwise we're part way through writing it, which is as good as
+        // having written it
+        return abandon_connection(self, connection, completed_tail);
+
+    case request_awaiting_response:
+        return abandon_connection(self, connection, completed_tail);
+
+    case request_flushing:
+        // the sets that it was waiting for carry on without it, and the
+        // flushes behind it may only have been waiting for it
+        flush_detach(self, req);
+        req->state = request_finished;
+        completed_tail = append_request(completed_tail, req);
+        return finish_flushes(self, completed_tail);
+
+    default:
+        // it's already on its way back
+        return completed_tail;
+    }
+
+    req->state = request_finished;
+    return append_request(completed_tail, req);
+}
+
+static memcev_request** expire_requests(memcev_loop* self, memcev_request* expired,
+                                        memcev_request** completed_tail) {
+    // expire a list of requests chained together by wheel_next. Recycling a
+    // connection for one of them may already have finished off some of the
+    // others
+    while(expired != NULL) {
+        memcev_request* req = expired;
+        expired = req->wheel_next;
+        req->wheel_next = NULL;
+
+        completed_tail = expire_request(self, req, completed_tail);
+    }
+
+    return completed_tail;
+}
+
+static void wheel_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
+    // visit every slot since the last time we were here (but no slot more
+    // than once) and expire whatever in them is due
+    memcev_loop* self = (memcev_loop*)ev_userdata(loop);
+    ev_tstamp now = ev_now(loop);
+    uint64_t now_tick = wheel_tick_at(now);
+    uint64_t tick = self->wheel_tick;
+    memcev_request* expired = NULL;
+    memcev_request** expired_tail = &expired;
+    memcev_request* completed = NULL;
+    memcev_request** completed_tail = &completed;
+    int i;
+
+    if(now_tick - tick >= WHEEL_SLOTS) {
+        tick = now_tick - WHEEL_SLOTS + 1;
+    }
+
+    for(; tick <= now_tick; tick++) {
+        memcev_request* req = self->wheel[tick & (WHEEL_SLOTS - 1)];
+
+        while(req != NULL) {
+            memcev_request* next = req->wheel_next;
+
+            if(req->deadline <= now) {
+                wheel_remove(self, req);
+                req->timed_out = 1;
+                // if it's still waiting for a connection then it's because
+                // of everything ahead of it
+                req->overloaded = req->state == request_pending;
+                *expired_tail = req;
+                expired_tail = &req->wheel_next;
+            }
+
+            req = next;
+        }
+    }
+
+    // the current tick may still have requests in it that are due later on
+    // in it, so we come back to it next time
+    self->wheel_tick = now_tick;
+
+    if(expired == NULL) {
+        return;
+    }
+
+    completed_tail = expire_requests(self, expired, completed_tail);
+
+    // anything that was taken off of a connection made room on it, and
+    // anything that was requeued needs to go somewhere
+    for(i = 0; i < self->num_servers; i++) {
+        completed_tail = dispatch_server(self, &self->servers[i], completed_tail);
+    }
+
+    deliver_requests(self, completed);
+}
+
+static memcev_request** cancel_followers(memcev_loop* self, memcev_request* leader,
+                                        memcev_waiter* target,
+                                        memcev_request** expired_tail) {
+    // add a leader's followers that belong to target to a list of requests
+    // to expire
+    memcev_request* req;
+
+    for(req = leader->followers; req != NULL; req = req->follow_next) {
+        if(req->waiter == target) {
+            wheel_remove(self, req);
+            req->error = "Request cancelled";
+            req->cancelled = 1;
+            *expired_tail = req;
+            expired_tail = &req->wheel_next;
+        }
+    }
+
+    return expired_tail;
+}
+
+static memcev_request** cancel_waiter(memcev_loop* self, memcev_waiter* target,
+                                      memcev_request** completed_tail) {
+    // find every request that's still outstanding for a waiter and expire
+    // them. There's no index by waiter because this is rare, so we just look
+    // everywhere that they could be
+    memcev_request* expired = NULL;
+    memcev_request** expired_tail = &expired;
+    memcev_request* req;
+    int i, c, lane;
+
+    for(i = 0; i < self->num_servers; i++) {
+        memcev_server* server = &self->servers[i];
+
+        for(lane = 0; lane < PRIORITY_LANES; lane++) {
+            for(req = server->pending_head[lane]; req != NULL; req = req->next) {
+                expired_tail = cancel_followers(self, req, target, expired_tail);
+                if(req->waiter == target) {
+                    wheel_remove(self, req);
+                    req->error = "Request cancelled";
+                    req->cancelled = 1;
+                    *expired_tail = req;
+                    expired_tail = &req->wheel_next;
+                }
+            }
+        }
+
+        for(c = 0; c < server->num_connections; c++) {
+            ev_connection* connection = server->connections[c];
+
+            if(connection->connecting != NULL
+               && connection->connecting->waiter == target) {
+                req = connection->connecting;
+                wheel_remove(self, req);
+                req->error = "Request cancelled";
+                req->cancelled = 1;
+                *expired_tail = req;
+                expired_tail = &req->wheel_next;
+            }
+
+            for(req = connection->head; req != NULL; req = req->next) {
+                expired_tail = cancel_followers(self, req, target, expired_tail);
+                if(req->waiter == target) {
+                    wheel_remove(self, req);
+                    req->error = "Request cancelled";
+                    req->cancelled = 1;
+                    *expired_tail = req;
+                    expired_tail = &req->wheel_next;
+                }
+            }
+        }
+    }
+
+    for(req = self->flush_head; req != NULL; req = req->next) {
+        if(req->waiter == target) {
+            wheel_remove(self, req);
+            req->error = "Request cancelled";
+            req->cancelled = 1;
+            *expired_tail = req;
+            expired_tail = &req->wheel_next;
+        }
+    }
+
+    return expire_requests(self, expired, completed_tail);
+}
+
+// hedged gets. When every key is written to more than one server, a get
+// that's taking too long can be sent to the next of them as well, so that
+// one slow server doesn't hold it up. Its copy is made by the submitter and
+// waits in the loop's hedge queue until it's due, and is thrown away if the
+// original is answered first. Once both are out, whichever of them answers
+// first is delivered and the other is taken back out of its queue, or if
+// it's already been written, left to finish by itself. We don't reset its
+// connection like we would for a timeout, because its response will turn
+// up in the right place, we just don't want it any more. Errors don't count
+// as answers as long as the other one might still get one
+
+// with hedge_delay set automatically, how many gets' latencies it's worked
+// out from each time, and which percentile of them it is
+#define HEDGE_WINDOW 1024
+#define HEDGE_PERCENTILE 95
+
+static void hedge_queue(memcev_loop* self, memcev_request* req) {
+    // put a get that's just arrived in line to send its hedge, unless we
+    // don't know how long to give it yet
+    if(self->hedge_delay <= 0) {
+        free_request(req->hedge);
+        req->hedge = NULL;
+        return;
+    }
+
+    req->hedge_at = ev_now(self->loop) + self->hedge_delay;
+    req->hedge_queued = 1;
+    req->hedge_next = NULL;
+    req->hedge_prev = self->hedge_tail;
+
+    if(self->hedge_tail == NULL) {
+        self->hedge_head = req;
+        ev_timer_set(&self->hedge_timer, self->hedge_delay, 0);
+        ev_timer_start(self->loop, &self->hedge_timer);
+    } else {
+        self->hedge_tail->hedge_next = req;
+    }
+    self->hedge_tail = req;
+}
+
+static void hedge_unqueue(memcev_loop* self, memcev_request* req) {
+    if(req->hedge_prev == NULL) {
+        self->hedge_head = req->hedge_next;
+    } else {
+        req->hedge_prev->hedge_next = req->hedge_next;
+    }
+    if(req->hedge_next == NULL) {
+        self->hedge_tail = req->hedge_prev;
+    } else {
+        req->hedge_next->hedge_prev = req->hedge_prev;
+    }
+
+    req->hedge_queued = 0;
+    req->hedge_next = NULL;
+    req->hedge_prev = NULL;
+
+    if(self->hedge_head == NULL) {
+        ev_timer_stop(self->loop, &self->hedge_timer);
+    }
+}
+
+static void hedge_sample(memcev_loop* self, uint64_t ns) {
+    // count a get's latency towards the next automatic hedge_delay, and
+    // once there are HEDGE_WINDOW of them, work it out and start again
+    memcev_histogram* window = &self->hedge_window;
+    uint64_t wanted, seen = 0;
+    int bucket;
+
+    window->counts[histogram_bucket(ns)]++;
+    if(++self->hedge_samples < HEDGE_WINDOW) {
+        return;
+    }
+
+    wanted = (self->hedge_samples * HEDGE_PERCENTILE + 99) / 100;
+    for(bucket = 0; bucket < HIST_BUCKETS - 1; bucket++) {
+        seen += window->counts[bucket];
+        if(seen >= wanted) {
+            break;
+        }
+    }
+    self->hedge_delay = histogram_bucket_limit(bucket) / 1e9;
+
+    memset(window, 0, sizeof(memcev_histogram));
+    self->hedge_samples = 0;
+}
+
+static void hedge_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
+    // send the hedges of the gets that have waited long enough for an
+    // answer
+    memcev_loop* self = (memcev_loop*)ev_userdata(loop);
+    ev_tstamp now = ev_now(loop);
+    memcev_request* completed = NULL;
+    memcev_request** completed_tail = &completed;
+    memcev_request* req;
+    int i;
+
+    while((req = self->hedge_head) != NULL && req->hedge_at <= now) {
+        memcev_request* hedge = req->hedge;
+
+        hedge_unqueue(self, req);
+        if(self->wb_count > 0) {
+            write_behind_release(self, hedge);
+        }
+        hedge->priority = req->priority;
+        __atomic_add_fetch(&self->stats.hedges, 1, __ATOMIC_RELAXED);
+        completed_tail = admit_pending(self, &self->servers[hedge->server],
+                                       hedge, completed_tail);
+    }
+
+    if(self->hedge_head != NULL) {
+        // they're only roughly in order if hedge_delay has changed, in
+        // which case the rest may be a little late
+        ev_timer_set(timer, self->hedge_head->hedge_at - now, 0);
+        ev_timer_start(loop, timer);
+    }
+
+    for(i = 0; i < self->num_servers; i++) {
+        completed_tail = dispatch_server(self, &self->servers[i], completed_tail);
+    }
+
+    deliver_requests(self, completed);
+}
+
+static void hedge_transfer(memcev_loop* self, memcev_request* from,
+                           memcev_request* to) {
+    // to answers in from's place, so it takes over whoever is waiting for
+    // from, its followers, its place in the inflight table and its deadline
+    memcev_request* follower;
+
+    to->waiter = from->waiter;
+    from->waiter = NULL;
+    to->done_cb = from->done_cb;
+    from->done_cb = NULL;
+    to->submitted_ns = from->submitted_ns;
+
+    to->followers = from->followers;
+    from->followers = NULL;
+    for(follower = to->followers; follower != NULL; follower = follower->follow_next) {
+        follower->leader = to;
+    }
+
+    if(from->inflight) {
+        inflight_replace(self, from, to);
+    }
+
+    if(from->wheel_slot != -1) {
+        wheel_remove(self, from);
+        if(to->state != request_finished && to->wheel_slot == -1) {
+            to->deadline = from->deadline;
+            wheel_add(self, to);
+        }
+    }
+}
+
+static void hedge_abandon(memcev_loop* self, memcev_request* loser) {
+    // take whichever of a get and its hedge lost out of wherever it is. If
+    // it's already been written, or it's further along the list that's
+    // being delivered, it's thrown away when it gets there
+    ev_connection* connection = loser->conn;
+
+    loser->hedge_lost = 1;
+    wheel_remove(self, loser);
+
+    switch(loser->state) {
+    case request_pending:
+        pending_remove(&self->servers[loser->server], loser);
+        free_request(loser);
+        break;
+
+    case request_not_started:
+        if(!(loser == connection->unsent && connection->wpos > 0)) {
+            connection_unlink(connection, loser);
+            update_watcher(self->loop, connection);
+            free_request(loser);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void settle_hedge(memcev_loop* self, memcev_request* req) {
+    // req has finished and is either a get with a hedge, or a hedge, so
+    // decide which of the two of them is delivered
+    memcev_request* hedge = req->hedge;
+    memcev_request* original = req->hedged;
+
+    if(hedge != NULL) {
+        req->hedge = NULL;
+        hedge->hedged = NULL;
+
+        if(hedge->state == request_submitted) {
+            // it was never sent, so nobody else knows about it
+            if(req->hedge_queued) {
+                hedge_unqueue(self, req);
+            }
+            free_request(hedge);
+
+        } else if(request_failed(req) && !req->timed_out && !req->cancelled) {
+            // the hedge may still get an answer
+            hedge_transfer(self, req, hedge);
+            req->hedge_lost = 1;
+
+        } else {
+            hedge_abandon(self, hedge);
+        }
+        return;
+    }
+
+    original->hedge = NULL;
+    req->hedged = NULL;
+
+    if(request_failed(req) || req->parser.values_len == 0) {
+        // but the original may still get an answer. A replica that doesn't
+        // have the key may just have missed the set, so only the original
+        // gets to say that it's not there
+        req->hedge_lost = 1;
+        return;
+    }
+
+    hedge_transfer(self, original, req);
+    hedge_abandon(self, original);
+    __atomic_add_fetch(&self->stats.hedge_wins, 1, __ATOMIC_RELAXED);
+}
+
+// write-behind sets. Sets that nobody waits for can be buffered on their
+// loop instead of being sent straight away, in a table by server and key
+// where a newer set replaces an older one that hasn't gone yet. The table is
+// flushed write_behind seconds after it stopped being empty, or as soon as
+// it holds write_behind_bytes, and everything in it goes out together as a
+// pipeline of noreply sets. Anything else for a key that has a set buffered
+// sends that set first, so that the key's requests still happen in order.
+// A flush request sends the buffer too, but with replies so that it can
+// tell whether they worked, and finishes once they have, along with every
+// noreply set from before it that was still on its way out
+
+#define WRITE_BEHIND_BUCKETS 1024
+
+static memcev_request** write_behind_find(memcev_loop* self, int server,
+                                          const char* key, size_t key_len,
+                                          uint32_t hash) {
+    // the link to the buffered set for a key at a server, which points at
+    // NULL if there isn't one
+    memcev_request** link = &self->wb_table[hash & (WRITE_BEHIND_BUCKETS - 1)];
+    memcev_request* req;
+
+    while((req = *link) != NULL) {
+        size_t req_key_len = 0;
+        const char* req_key = next_key(req, NULL, &req_key_len);
+
+        if(req->server == server && req->key_hash == hash
+           && req_key_len == key_len && memcmp(req_key, key, key_len) == 0) {
+            break;
+        }
+        link = &req->wb_next;
+    }
+
+    return link;
+}
+
+static void write_behind_add(memcev_loop* self, memcev_request* req) {
+    // buffer a set, replacing the one before it for the same key
+    size_t key_len = 0;
+    const char* key = next_key(req, NULL, &key_len);
+
+    // admit_pending would have worked this out, but it's skipped when
+    // they're flushed
+    req->key_hash = cache_hash(key, key != NULL ? key_len : 0);
+
+    memcev_request** link = write_behind_find(self, req->server, key, key_len,
+                                              req->key_hash);
+    memcev_request* older = *link;
+
+    if(older != NULL) {
+        // last writer wins, and the one that lost never has to be sent. It
+        // has nobody waiting for it and its value was copied, so it can go
+        // without the GIL
+        req->wb_next = older->wb_next;
+        self->wb_bytes -= older->body_len;
+        free_request(older);
+        __atomic_add_fetch(&self->stats.write_behind_coalesced, 1, __ATOMIC_RELAXED);
+    } else {
+        req->wb_next = NULL;
+        self->wb_count++;
+    }
+    *link = req;
+    self->wb_bytes += req->body_len;
+
+    if(self->wb_bytes >= self->write_behind_bytes) {
+        write_behind_flush(self, NULL);
+    } else if(!ev_is_active(&self->wb_timer)) {
+        ev_timer_set(&self->wb_timer, self->write_behind, 0);
+        ev_timer_start(self->loop, &self->wb_timer);
+    }
+}
+
+static void write_behind_send(memcev_loop* self, memcev_request* req,
+                              memcev_request* flush) {
+    // put a set that was buffered in line at its server. It was already let
+    // in once, so it doesn't count against max_pending. If a flush is
+    // sending it then it needs a reply after all
+    if(flush != NULL) {
+        char* header_end = memchr(req->body, '\r', req->body_len);
+        char* noreply = header_end - NOREPLY_LEN;
+
+        memmove(noreply, header_end, req->body + req->body_len - header_end);
+        req->body_len -= NOREPLY_LEN;
+        req->parser.type = response_set;
+        req->flush = flush;
+        flush->flush_waiting++;
+    }
+
+    if(req->timeout > 0) {
+        req->deadline = ev_now(self->loop) + req->timeout;
+        wheel_add(self, req);
+    }
+
+    req->wb_next = NULL;
+    pending_push(&self->servers[req->server], req);
+}
+
+static void write_behind_release(memcev_loop* self, memcev_request* req) {
+    // send whatever is buffered for a request's keys ahead of it
+    const char* key = NULL;
+    size_t key_len = 0;
+
+    while((key = next_key(req, key, &key_len)) != NULL) {
+        memcev_request** link = write_behind_find(self, req->server, key, key_len,
+                                                  cache_hash(key, key_len));
+        memcev_request* buffered = *link;
+
+        if(buffered != NULL) {
+            *link = buffered->wb_next;
+            self->wb_count--;
+            self->wb_bytes -= buffered->body_len;
+            write_behind_send(self, buffered, NULL);
+        }
+        if(req->op == request_set) {
+            // only gets have more than one key
+            break;
+        }
+    }
+
+    if(self->wb_count == 0) {
+        ev_timer_stop(self->loop, &self->wb_timer);
+    }
+}
+
+static void write_behind_flush(memcev_loop* self, memcev_request* flush) {
+    // send everything that's buffered, in no particular order since they're
+    // all for different keys
+    size_t i;
+
+    if(self->wb_count == 0) {
+        return;
+    }
+
+    for(i = 0; i < WRITE_BEHIND_BUCKETS; i++) {
+        memcev_request* req;
+
+        while((req = self->wb_table[i]) != NULL) {
+            self->wb_table[i] = req->wb_next;
+            write_behind_send(self, req, flush);
+        }
+    }
+
+    self->wb_count = 0;
+    self->wb_bytes = 0;
+    ev_timer_stop(self->loop, &self->wb_timer);
+}
+
+static void write_behind_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
+    // the oldest buffered set has waited long enough
+    memcev_loop* self = (memcev_loop*)ev_userdata(loop);
+    memcev_request* completed = NULL;
+    memcev_request** completed_tail = &completed;
+    int i;
+
+    write_behind_flush(self, NULL);
+
+    for(i = 0; i < self->num_servers; i++) {
+        completed_tail = dispatch_server(self, &self->servers[i], completed_tail);
+    }
+
+    deliver_requests(self, completed);
+}
+
+static void flush_tag(memcev_request* req, memcev_request* from,
+                      memcev_request* to) {
+    // move a set from waiting for one flush to another (either of which
+    // can be NULL)
+    if(req->flush != from || !req->write_behind) {
+        return;
+    }
+    if(from != NULL) {
+        from->flush_waiting--;
+    }
+    if(to != NULL) {
+        to->flush_waiting++;
+    }
+    req->flush = to;
+}
+
+static void flush_retag(memcev_loop* self, memcev_request* from,
+                        memcev_request* to) {
+    // move every set that's waiting for from to to. There's no index of
+    // them, so we look everywhere that they could be
+    memcev_request* req;
+    int i, c, lane;
+
+    for(i = 0; i < self->num_servers; i++) {
+        memcev_server* server = &self->servers[i];
+
+        for(lane = 0; lane < PRIORITY_LANES; lane++) {
+            for(req = server->pending_head[lane]; req != NULL; req = req->next) {
+                flush_tag(req, from, to);
+            }
+        }
+
+        for(c = 0; c < server->num_connections; c++) {
+            for(req = server->connections[c]->head; req != NULL; req = req->next) {
+                flush_tag(req, from, to);
+            }
+        }
+    }
+}
+
+static memcev_request** start_flush(memcev_loop* self, memcev_request* flush,
+                                    memcev_request** completed_tail) {
+    // send everything that's buffered and wait for it, along with the
+    // noreply sets that haven't been written yet
+    write_behind_flush(self, flush);
+    flush_retag(self, NULL, flush);
+
+    flush->state = request_flushing;
+    flush->next = NULL;
+    if(self->flush_tail == NULL) {
+        self->flush_head = flush;
+    } else {
+        self->flush_tail->next = flush;
+    }
+    self->flush_tail = flush;
+
+    // which may be nothing at all
+    return finish_flushes(self, completed_tail);
+}
+
+static memcev_request** finish_flushes(memcev_loop* self,
+                                       memcev_request** completed_tail) {
+    // finish the flushes that aren't waiting for anything any more. Each one
+    // is also waiting for everything that the ones before it are, so they
+    // finish in order
+    memcev_request* flush;
+
+    while((flush = self->flush_head) != NULL && flush->flush_waiting == 0) {
+        self->flush_head = flush->next;
+        if(self->flush_head == NULL) {
+            self->flush_tail = NULL;
+        }
+        flush->state = request_finished;
+        completed_tail = append_request(completed_tail, flush);
+    }
+
+    return completed_tail;
+}
+
+static void flush_written(memcev_loop* self, memcev_request* req) {
+    // a set that a flush was waiting for has finished, which may finish
+    // flushes too. They're delivered straight after it
+    memcev_request* flush = req->flush;
+    memcev_request* finished = NULL;
+    memcev_request** finished_tail;
+
+    req->flush = NULL;
+    flush->flush_waiting--;
+    if(request_failed(req) && flush->error == NULL) {
+        flush->error = "A set that was written behind failed";
+    }
+
+    finished_tail = finish_flushes(self, &finished);
+    if(finished != NULL) {
+        *finished_tail = req->next;
+        req->next = finished;
+    }
+}
+
+static void flush_detach(memcev_loop* self, memcev_request* flush) {
+    // take a flush that isn't going to wait any more out of the line. What
+    // it was waiting for, the one behind it waits for instead
+    memcev_request** link = &self->flush_head;
+    memcev_request* prev = NULL;
+
+    while(*link != flush) {
+        prev = *link;
+        link = &prev->next;
+    }
+    *link = flush->next;
+    if(self->flush_tail == flush) {
+        self->flush_tail = prev;
+    }
+
+    flush_retag(self, flush, flush->next);
+    flush->next = NULL;
+}
+
+// the DNS cache. Resolving a name can take as long as it likes, so the event
+// loop never does it: servers are resolved by whoever calls _set_servers,
+// and after that connections take their addresses from here. It's shared by
+// every client in the process, so new clients for the same servers don't
+// resolve them again either. getaddrinfo doesn't tell us the records' real
+// TTLs, so entries are refreshed DNS_CACHE_TTL seconds after they were
+// resolved, by a thread of their own. Until that's done we carry on with the
+// old addresses, which are very probably still good. Servers named
+// "unix:/some/path" are Unix domain sockets, which have nothing to resolve but
+// go through here anyway so that nothing else has to know the difference
+
+#define DNS_CACHE_TTL 60
+
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static dns_entry* dns_cache = NULL;
+
+static int dns_resolve(const char* host, int port, memcev_address** addrs,
+                       const char** error) {
+    // look up every address for a host, IPv4 and IPv6 alike, in the order
+    // that getaddrinfo prefers them. Blocks, so never call it on the event
+    // loop. Returns how many there are, or -1 with error set
+    struct addrinfo hints;
+    struct addrinfo* results = NULL;
+    struct addrinfo* ai;
+    char service[16];
+    int count = 0;
+
+    if(strncmp(host, "unix:", 5) == 0) {
+        const char* path = host + 5;
+        struct sockaddr_un* sun;
+
+        if(strlen(path) >= sizeof(sun->sun_path)) {
+            *error = "Unix socket path is too long";
+            return -1;
+        }
+
+        if((*addrs = calloc(1, sizeof(memcev_address))) == NULL) {
+            *error = strerror(ENOMEM);
+            return -1;
+        }
+
+        sun = (struct sockaddr_un*)&(*addrs)->addr;
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, path);
+        (*addrs)->len = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+
+        return 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%d", port);
+
+    int status = getaddrinfo(host, service, &hints, &results);
+    if(status != 0) {
+        *error = status == EAI_SYSTEM ? strerror(errno) : gai_strerror(status);
+        return -1;
+    }
+
+    for(ai = results; ai != NULL; ai = ai->ai_next) {
+        count++;
+    }
+
+    *addrs = malloc(count * sizeof(memcev_address));
+    if(*addrs == NULL) {
+        freeaddrinfo(results);
+        *error = strerror(ENOMEM);
+        return -1;
+    }
+
+    count = 0;
+    for(ai = results; ai != NULL; ai = ai->ai_next) {
+        if(ai->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        memcpy(&(*addrs)[count].addr, ai->ai_addr, ai->ai_addrlen);
+        (*addrs)[count].len = ai->ai_addrlen;
+        count++;
+    }
+
+    freeaddrinfo(results);
+
+    if(count == 0) {
+        free(*addrs);
+        *error = "No usable addresses";
+        return -1;
+    }
+
+    return count;
+}
+
+static dns_entry* dns_find(const char* host, int port) {
+    // must be called with dns_lock held
+    dns_entry* entry;
+
+    for(entry = dns_cache; entry != NULL; entry = entry->next) {
+        if(entry->port == port && strcmp(entry->host, host) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static void dns_store(const char* host, int port, memcev_address* addrs, int naddrs) {
+    // remember a host's addresses, which the cache now owns
+    pthread_mutex_lock(&dns_lock);
+
+    dns_entry* entry = dns_find(host, port);
+
+    if(entry == NULL) {
+        // entries are never removed. There's one per server that any client
+        // has ever talked to, which is never going to be many
+        entry = calloc(1, sizeof(dns_entry));
+        if(entry == NULL || (entry->host = strdup(host)) == NULL) {
+            pthread_mutex_unlock(&dns_lock);
+            free(entry);
+            free(addrs);
+            return;
+        }
+        entry->port = port;
+        entry->next = dns_cache;
+        dns_cache = entry;
+    }
+
+    free(entry->addrs);
+    entry->addrs = addrs;
+    entry->naddrs = naddrs;
+    entry->expires = time(NULL) + DNS_CACHE_TTL;
+    entry->refreshing = 0;
+
+    pthread_mutex_unlock(&dns_lock);
+}
+
+static int dns_fresh(const char* host, int port) {
+    // whether we have addresses for a host that don't need refreshing yet
+    int fresh;
+
+    pthread_mutex_lock(&dns_lock);
+    dns_entry* entry = dns_find(host, port);
+    fresh = entry != NULL && entry->expires > time(NULL);
+    pthread_mutex_unlock(&dns_lock);
+
+    return fresh;
+}
+
+static void* dns_refresh_thread(void* arg) {
+    dns_refresh_job* job = (dns_refresh_job*)arg;
+    memcev_address* addrs = NULL;
+    const char* error = NULL;
+
+    int naddrs = dns_resolve(job->host, job->port, &addrs, &error);
+
+    if(naddrs > 0) {
+        dns_store(job->host, job->port, addrs, naddrs);
+    } else {
+        // keep what we had, and try again after another TTL
+        pthread_mutex_lock(&dns_lock);
+        dns_entry* entry = dns_find(job->host, job->port);
+        entry->expires = time(NULL) + DNS_CACHE_TTL;
+        entry->refreshing = 0;
+        pthread_mutex_unlock(&dns_lock);
+    }
+
+    free(job->host);
+    free(job);
+    return NULL;
+}
+
+static void dns_refresh(const char* host, int port) {
+    // re-resolve a host in the background. dns_lookup has already marked it
+    // as refreshing so nobody else starts another one
+    dns_refresh_job* job = malloc(sizeof(dns_refresh_job));
+    pthread_attr_t attr;
+    pthread_t thread;
+    int started = 0;
+
+    if(job != NULL && (job->host = strdup(host)) != NULL) {
+        job->port = port;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        started = pthread_create(&thread, &attr, dns_refresh_thread, job) == 0;
+        pthread_attr_destroy(&attr);
+    }
+
+    if(!started) {
+        // somebody will try again next time they need an address
+        if(job != NULL) {
+            free(job->host);
+            free(job);
+        }
+        pthread_mutex_lock(&dns_lock);
+        dns_entry* entry = dns_find(host, port);
+        if(entry != NULL) {
+            entry->refreshing = 0;
+        }
+        pthread_mutex_unlock(&dns_lock);
+    }
+}
+
+static int server_address(memcev_server* server, int index, memcev_address* address) {
+    // copy one of a server's addresses out of the cache, cycling through
+    // them by index so that a connection that keeps failing tries each of
+    // them in turn. Never blocks, so it's safe on the event loop. Returns -1
+    // if it's never been resolved
+    int refresh = 0;
+
+    pthread_mutex_lock(&dns_lock);
+
+    dns_entry* entry = dns_find(server->host, server->port);
+    if(entry == NULL) {
+        pthread_mutex_unlock(&dns_lock);
+        return -1;
+    }
+
+    *address = entry->addrs[index % entry->naddrs];
+
+    if(entry->expires <= time(NULL) && !entry->refreshing) {
+        entry->refreshing = 1;
+        refresh = 1;
+    }
+
+    pthread_mutex_unlock(&dns_lock);
+
+    if(refresh) {
+        dns_refresh(server->host, server->port);
+    }
+
+    return 0;
+}
+
+static PyObject* _MemcevClient__set_servers(_MemcevClient *self, PyObject *args) {
+    // tell us which servers we're talking to, as a list of (host, port)
+    // tuples in the same order that they were given to _ketama_build. This
+    // has to be done before the event loop is started because nothing
+    // protects it from the event loop's thread
+    PyObject* list = NULL;
+
+    if(!PyArg_ParseTuple(args, "O!", &PyList_Type, &list)) {
+        return NULL;
+    }
+
+    if(self->loops[0].servers != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "servers have already been set");
+        return NULL;
+    }
+
+    Py_ssize_t num_servers = PyList_GET_SIZE(list);
+    Py_ssize_t i;
+    int l;
+
+    memcev_server* servers = calloc(num_servers ? num_servers : 1,
+                                    sizeof(memcev_server));
+    if(servers == NULL) {
+        return PyErr_NoMemory();
+    }
+
+    for(i = 0; i < num_servers; i++) {
+        char* host = NULL;
+        int port = 0;
+
+        if(!PyArg_ParseTuple(PyList_GET_ITEM(list, i), "si", &host, &port)) {
+            goto error;
+        }
+
+        if((servers[i].host = strdup(host)) == NULL) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        servers[i].port = port;
+
+        // this is our only chance to resolve them without holding up the
+        // event loop, unless another client already did it for us
+        if(!dns_fresh(servers[i].host, port)) {
+            memcev_address* addrs = NULL;
+            memcev_address address;
+            const char* error = NULL;
+            int naddrs;
+
+            Py_BEGIN_ALLOW_THREADS;
+            naddrs = dns_resolve(servers[i].host, port, &addrs, &error);
+            Py_END_ALLOW_THREADS;
+
+            if(naddrs > 0) {
+                dns_store(servers[i].host, port, addrs, naddrs);
+            } else if(server_address(&servers[i], 0, &address) == -1) {
+                // if we had it before then we can make do with that
+                PyErr_Format(PyExc_IOError, "Couldn't resolve %s: %s",
+                             servers[i].host, error);
+                goto error;
+            }
+        }
+    }
+
+    // each loop has its own copy, for its own connections
+    for(l = 0; l < self->num_loops; l++) {
+        memcev_loop* loop = &self->loops[l];
+
+        if(l == 0) {
+            loop->servers = servers;
+        } else {
+            loop->servers = calloc(num_servers ? num_servers : 1,
+                                   sizeof(memcev_server));
+            if(loop->servers == NULL) {
+                PyErr_NoMemory();
+                goto loop_error;
+            }
+            for(i = 0; i < num_servers; i++) {
+                loop->servers[i].port = servers[i].port;
+                if((loop->servers[i].host = strdup(servers[i].host)) == NULL) {
+                    PyErr_NoMemory();
+                    loop->num_servers = i;
+                    goto loop_error;
+                }
+            }
+        }
+        loop->num_servers = num_servers;
+    }
+
+    Py_RETURN_NONE;
+
+loop_error:
+    // the loops that we'd already got to are cleaned up by loop_dealloc,
+    // but this one is only part of the way there
+    for(i = 0; i < self->loops[l].num_servers; i++) {
+        free(self->loops[l].servers[i].host);
+    }
+    free(self->loops[l].servers);
+    self->loops[l].servers = NULL;
+    self->loops[l].num_servers = 0;
+    return NULL;
+
+error:
+    for(i = 0; i < num_servers; i++) {
+        free(servers[i].host);
+    }
+    free(servers);
+
+    return NULL;
+}
+
+static ev_connection* make_connection(const memcev_address* address) {
+    ev_connection* ret = malloc(sizeof(ev_connection));
+
+    if(ret == NULL) {
+        return NULL;
+    }
+
+    ret->server = -1;
+    ret->connecting = NULL;
+
+    ev_init(&ret->retry_timer, retry_cb);
+    ret->retry_timer.data = ret;
+    ret->failures = 0;
+
+    ret->events = 0;
+    ret->head = NULL;
+    ret->tail = NULL;
+    ret->unsent = NULL;
+    ret->inflight = 0;
+    ret->wpos = 0;
+
+    ret->rbuf = NULL;
+    ret->rbuf_len = 0;
+    ret->rbuf_size = 0;
+    ret->rpos = 0;
+
+    connection_open(ret, address);
+
+    return ret;
+}
+
+static void connection_open(ev_connection* connection, const memcev_address* address) {
+    // start connecting a new socket for the connection. connect_cb hears
+    // about it when it's done, unless it's already failed in which case the
+    // state is connection_error. We never resolve anything here: the address
+    // comes from the DNS cache, so this doesn't block
+    int sock = socket(address->addr.ss_family, SOCK_STREAM, 0);
+
+    if(sock == -1) {
+        connection->fd = -1;
+        connection->state = connection_error;
+        connection->error = strerror(errno);
+        return;
+    }
+
+    connection->fd = sock;
+    connection->state = connection_connecting;
+
+    // connect_cb switches it over to connection_io_cb once we're connected
+    ev_io_init(&connection->watcher, connect_cb, sock, 0);
+    connection->watcher.data = connection;
+
+    /* set it non-blocking */
+    if(-1 == fcntl(sock, F_SETFL, O_NONBLOCK | fcntl(sock, F_GETFL))) {
+        connection->state = connection_error;
+        connection->error = strerror(errno);
+
+    } else if(connect(sock, (struct sockaddr*)&address->addr, address->len) == 0) {
+        // Unix sockets can connect straight away. The socket is writeable, so
+        // connect_cb will still hear about it just like any other
+
+    } else if(errno != EINPROGRESS) {
+        // anything else is wrong
+        connection->state = connection_error;
+        connection->error = strerror(errno);
+    }
+
+    if(connection->state == connection_error) {
+        close(sock);
+        connection->fd = -1;
+    }
+}
+
+// ketama consistent hashing. This is compatible with libketama: each server
+// gets 160 points on the ring (scaled by its share of the total weight), the
+// points for a server named "host:port" are the md5s of "host:port-0",
+// "host:port-1", ..., four points to a digest, and a key belongs to the first
+// server at or after the first four bytes of its own md5
+
+#define KETAMA_POINTS_PER_HASH 4
+#define KETAMA_HASHES_PER_SERVER 40
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const unsigned char md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(uint32_t h[4], const unsigned char* block) {
+    uint32_t w[16];
+    int i;
+
+    for(i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i*4]
+             | ((uint32_t)block[i*4+1] << 8)
+             | ((uint32_t)block[i*4+2] << 16)
+             | ((uint32_t)block[i*4+3] << 24);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+
+    for(i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+
+        if(i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if(i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5*i + 1) % 16;
+        } else if(i < 48) {
+            f = b ^ c ^ d;
+            g = (3*i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7*i) % 16;
+        }
+
+        uint32_t x = a + f + md5_k[i] + w[g];
+        a = d;
+        d = c;
+        c = b;
+        b = b + ((x << md5_r[i]) | (x >> (32 - md5_r[i])));
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+static void md5(const char* data, size_t len, unsigned char digest[16]) {
+    uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    unsigned char tail[128];
+    size_t done = 0;
+    int i;
+
+    while(len - done >= 64) {
+        md5_block(h, (const unsigned char*)data + done);
+        done += 64;
+    }
+
+    // pad out what's left with a 1 bit, zeroes, and the length in bits
+    size_t remaining = len - done;
+    size_t tail_len = remaining < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + done, remaining);
+    tail[remaining] = 0x80;
+    for(i = 0; i < 8; i++) {
+        tail[tail_len - 8 + i] = (unsigned char)(bits >> (8*i));
+    }
+
+    md5_block(h, tail);
+    if(tail_len == 128) {
+        md5_block(h, tail + 64);
+    }
+
+    for(i = 0; i < 4; i++) {
+        digest[i*4] = (unsigned char)h[i];
+        digest[i*4+1] = (unsigned char)(h[i] >> 8);
+        digest[i*4+2] = (unsigned char)(h[i] >> 16);
+        digest[i*4+3] = (unsigned char)(h[i] >> 24);
+    }
+}
+
+static uint32_t ketama_point_from_digest(const unsigned char* digest, int n) {
+    return ((uint32_t)digest[3 + n*4] << 24)
+         | ((uint32_t)digest[2 + n*4] << 16)
+         | ((uint32_t)digest[1 + n*4] << 8)
+         | (uint32_t)digest[n*4];
+}
+
+static int compare_ketama_points(const void* a, const void* b) {
+    uint32_t pa = ((const ketama_point*)a)->point;
+    uint32_t pb = ((const ketama_point*)b)->point;
+    return pa < pb ? -1 : pa > pb ? 1 : 0;
+}
+
+static int ketama_servers(_MemcevClient* self, const char* key, size_t key_len,
+                          int* servers, int max) {
+    // find the servers that a key lives on: the one that its point on the
+    // ring belongs to, and then up to max-1 more, the next different ones
+    // clockwise from there. Returns how many there are
+    if(self->ketama_len == 0) {
+        servers[0] = 0;
+        return 1;
+    }
+
+    unsigned char digest[16];
+    md5(key, key_len, digest);
+    uint32_t hash = ketama_point_from_digest(digest, 0);
+
+    // binary search for the first point >= hash, wrapping around the ring
+    size_t lo = 0;
+    size_t hi = self->ketama_len;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(self->ketama[mid].point < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if(lo == self->ketama_len) {
+        lo = 0;
+    }
+
+    int found = 0;
+    size_t n;
+    int i;
+
+    for(n = 0; n < self->ketama_len && found < max; n++) {
+        int server = self->ketama[(lo + n) % self->ketama_len].server;
+
+        for(i = 0; i < found && servers[i] != server; i++) {
+        }
+        if(i == found) {
+            servers[found++] = server;
+        }
+    }
+
+    return found;
+}
+
+static int ketama_server(_MemcevClient* self, const char* key, size_t key_len) {
+    // find which server a key lives on
+    int server;
+
+    ketama_servers(self, key, key_len, &server, 1);
+    return server;
+}
+
+static PyObject* _MemcevClient__ketama_build(_MemcevClient *self, PyObject *args) {
+    // build the hash ring from a list of (name, weight) tuples, where the index
+    // of each server in the list is what _ketama_lookup will return for it
+    PyObject* servers = NULL;
+
+    if(!PyArg_ParseTuple(args, "O!", &PyList_Type, &servers)) {
+        return NULL;
+    }
+
+    Py_ssize_t num_servers = PyList_GET_SIZE(servers);
+    Py_ssize_t i;
+    double total_weight = 0;
+
+    for(i = 0; i < num_servers; i++) {
+        char* name = NULL;
+        int weight = 0;
+        if(!PyArg_ParseTuple(PyList_GET_ITEM(servers, i), "si", &name, &weight)) {
+            return NULL;
+        }
+        if(weight <= 0) {
+            PyErr_SetString(PyExc_ValueError, "server weights must be positive");
+            return NULL;
+        }
+        total_weight += weight;
+    }
+
+    // the weighted shares are rounded down, so this is the most we can need
+    size_t max_points = num_servers * KETAMA_HASHES_PER_SERVER * KETAMA_POINTS_PER_HASH;
+    ketama_point* ring = malloc(sizeof(ketama_point) * (max_points ? max_points : 1));
+    if(ring == NULL) {
+        return PyErr_NoMemory();
+    }
+
+    size_t ring_len = 0;
+
+    for(i = 0; i < num_servers; i++) {
+        char* name = NULL;
+        int weight = 0;
+        PyArg_ParseTuple(PyList_GET_ITEM(servers, i), "si", &name, &weight);
+
+        // (truncating is flooring, since everything is positive)
+        int hashes = (int)(weight / total_weight
+                           * KETAMA_HASHES_PER_SERVER * num_servers);
+        int h;
+
+        for(h = 0; h < hashes; h++) {
+            char point_name[1024];
+            unsigned char digest[16];
+            int n;
+
+            int point_name_len = snprintf(point_name, sizeof(point_name),
+                                          "%s-%d", name, h);
+            if(point_name_len < 0 || point_name_len >= sizeof(point_name)) {
+                free(ring);
+                PyErr_SetString(PyExc_ValueError, "server name too long");
+                return NULL;
+            }
+
+            md5(point_name, point_name_len, digest);
+
+            for(n = 0; n < KETAMA_POINTS_PER_HASH; n++) {
+                ring[ring_len].point = ketama_point_from_digest(digest, n);
+                ring[ring_len].server = i;
+                ring_len++;
+            }
+        }
+    }
+
+    qsort(ring, ring_len, sizeof(ketama_point), compare_ketama_points);
+
+    free(self->ketama);
+    self->ketama = ring;
+    self->ketama_len = ring_len;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* _MemcevClient__ketama_lookup(_MemcevClient *self, PyObject *args) {
+    const char* key = NULL;
+    int key_len = 0;
+
+    if(!PyArg_ParseTuple(args, "s#", &key, &key_len)) {
+        return NULL;
+    }
+
+    return PyInt_FromLong(ketama_server(self, key, key_len));
+}
+
+/*
+ * The near cache. Reads of a handful of very hot keys can be answered out of
+ * this without going anywhere near the event loop, at the cost of possibly
+ * being up to cache_ttl seconds out of date with changes made by anybody
+ * else. It's bounded by the memory that its keys and values take up, and
+ * when it's full the least recently used entries make room
+ */
+
+#define CACHE_INITIAL_BUCKETS 256
+
+static double cache_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static uint32_t cache_hash(const char* key, size_t key_len) {
+    // FNV-1a. The keys are short and this only has to be good enough to
+    // spread them over the buckets
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for(i = 0; i < key_len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static cache_entry** cache_slot(_MemcevClient* self, PyObject* key, uint32_t hash) {
+    // find where the entry for key is (or would go) in its bucket's chain
+    cache_entry** slot = &self->cache_buckets[hash & self->cache_mask];
+
+    while(*slot != NULL) {
+        cache_entry* entry = *slot;
+        if(entry->hash == hash
+           && PyString_GET_SIZE(entry->key) == PyString_GET_SIZE(key)
+           && memcmp(PyString_AS_STRING(entry->key), PyString_AS_STRING(key),
+                     PyString_GET_SIZE(key)) == 0) {
+            break;
+        }
+        slot = &entry->hash_next;
+    }
+    return slot;
+}
+
+static void cache_unlink_lru(_MemcevClient* self, cache_entry* entry) {
+    if(entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        self->cache_head = entry->lru_next;
+    }
+    if(entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        self->cache_tail = entry->lru_prev;
+    }
+}
+
+static void cache_push_lru(_MemcevClient* self, cache_entry* entry) {
+    // make it the most recently used
+    entry->lru_prev = NULL;
+    entry->lru_next = self->cache_head;
+    if(self->cache_head != NULL) {
+        self->cache_head->lru_prev = entry;
+    } else {
+        self->cache_tail = entry;
+    }
+    self->cache_head = entry;
+}
+
+static void cache_remove(_MemcevClient* self, cache_entry** slot) {
+    // throw away the entry at slot. Must be called with the GIL held
+    cache_entry* entry = *slot;
+
+    *slot = entry->hash_next;
+    cache_unlink_lru(self, entry);
+    self->cache_count--;
+    self->cache_bytes -= entry->size;
+
+    Py_DECREF(entry->key);
+    Py_DECREF(entry->value);
+    free(entry);
+}
+
+static void cache_evict(_MemcevClient* self, size_t wanted) {
+    // make room for wanted more bytes by throwing away whatever hasn't been
+    // used for longest
+    while(self->cache_tail != NULL
+          && self->cache_bytes + wanted > self->cache_max_bytes) {
+        cache_entry* victim = self->cache_tail;
+        cache_remove(self, cache_slot(self, victim->key, victim->hash));
+        self->cache_evictions++;
+    }
+}
+
+static void cache_grow(_MemcevClient* self) {
+    // double the number of buckets once there are more entries than them,
+    // so that the chains stay short
+    size_t new_size = (self->cache_mask + 1) * 2;
+    cache_entry** new_buckets = calloc(new_size, sizeof(cache_entry*));
+    size_t i;
+
+    if(new_buckets == NULL) {
+        // we'll just have longer chains
+        return;
+    }
+
+    for(i = 0; i <= self->cache_mask; i++) {
+        cache_entry* entry = self->cache_buckets[i];
+        while(entry != NULL) {
+            cache_entry* next = entry->hash_next;
+            entry->hash_next = new_buckets[entry->hash & (new_size - 1)];
+            new_buckets[entry->hash & (new_size - 1)] = entry;
+            entry = next;
+        }
+    }
+
+    free(self->cache_buckets);
+    self->cache_buckets = new_buckets;
+    self->cache_mask = new_size - 1;
+}
+
+static int cache_store(_MemcevClient* self, PyObject* key, PyObject* value,
+                       double expires) {
+    // remember a value that the server gave us, replacing anything that we
+    // had for it. Values too big to be worth taking up the cache with aren't
+    // kept at all
+    size_t size = sizeof(cache_entry) + PyString_GET_SIZE(key)
+                  + PyString_GET_SIZE(value);
+    uint32_t hash = cache_hash(PyString_AS_STRING(key), PyString_GET_SIZE(key));
+    cache_entry** slot = cache_slot(self, key, hash);
+
+    if(*slot != NULL) {
+        cache_remove(self, slot);
+    }
+
+    if(size > self->cache_max_bytes / 4) {
+        return 0;
+    }
+
+    cache_entry* entry = malloc(sizeof(cache_entry));
+    if(entry == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    cache_evict(self, size);
+
+    Py_INCREF(key);
+    Py_INCREF(value);
+    entry->key = key;
+    entry->value = value;
+    entry->hash = hash;
+    entry->expires = expires;
+    entry->size = size;
+
+    // evicting may have moved things around in the chain
+    slot = cache_slot(self, key, hash);
+    entry->hash_next = NULL;
+    *slot = entry;
+    cache_push_lru(self, entry);
+    self->cache_count++;
+    self->cache_bytes += size;
+
+    if(self->cache_count > self->cache_mask + 1) {
+        cache_grow(self);
+    }
+
+    return 0;
+}
 
-            // rejigger the watcher to catch READ events now
-            ev_io_stop(loop, watcher);
-            ev_io_set(watcher, connection->fd, EV_READ);
-            ev_io_start(loop, watcher);
-        }
-    } else if(EV_READ & revents) {
-        if(req->state != getset_awaiting_response) {
-            PyErr_SetString(PyExc_RuntimeError, "bad i/o state");
-            goto error;
-        }
+static void cache_clear(_MemcevClient* self) {
+    // throw away everything. Must be called with the GIL held
+    while(self->cache_head != NULL) {
+        cache_entry* entry = self->cache_head;
+        cache_remove(self, cache_slot(self, entry->key, entry->hash));
+    }
+    free(self->cache_buckets);
+    self->cache_buckets = NULL;
+}
 
-        const size_t buffer_size = 1024;
-        char buffer[buffer_size];
+static PyObject* _MemcevClient__cache_lookup(_MemcevClient *self, PyObject *args) {
+    // returns a dict of the keys that we have fresh values for, a list of the
+    // ones that we still have to ask the server for, and the generation to
+    // pass to _cache_fill with what it says
+    PyObject* keys = NULL;
+    PyObject* found = NULL;
+    PyObject* missing = NULL;
+    double now = 0;
+    Py_ssize_t i;
+
+    if(!PyArg_ParseTuple(args, "O!", &PyList_Type, &keys)) {
+        return NULL;
+    }
 
-        size_t received_size = recv(connection->fd, buffer, buffer_size, 0);
+    if(self->cache_buckets == NULL) {
+        return Py_BuildValue("({}Ok)", keys, self->cache_generation);
+    }
 
-        if(received_size == -1) {
-            PyErr_SetFromErrno(PyExc_IOError);
-            goto error;
-        }
+    if((found = PyDict_New()) == NULL || (missing = PyList_New(0)) == NULL) {
+        goto error;
+    }
 
-        parse_response = PyObject_CallFunction(req->parse_cb,
-                                               "s#O",
-                                               buffer, received_size,
-                                               req->acc);
-        if(parse_response == NULL) {
-            goto error;
-        }
+    for(i = 0; i < PyList_GET_SIZE(keys); i++) {
+        PyObject* key = PyList_GET_ITEM(keys, i);
 
-        if(!PyArg_ParseTuple(parse_response, "OO", &done_bool, &newacc)) {
+        if(!PyString_Check(key)) {
+            check_key(key);
             goto error;
         }
 
-        // we own these now
-        Py_INCREF(done_bool);
-        Py_INCREF(newacc);
+        uint32_t hash = cache_hash(PyString_AS_STRING(key), PyString_GET_SIZE(key));
+        cache_entry** slot = cache_slot(self, key, hash);
+        cache_entry* entry = *slot;
 
-        if(PyObject_IsTrue(done_bool)) {
-            // we're done!
-            done_none_result = PyObject_CallFunctionObjArgs(req->done_cb, newacc, NULL);
+        if(entry != NULL) {
+            if(now == 0) {
+                now = cache_now();
+            }
+            if(entry->expires <= now) {
+                cache_remove(self, slot);
+                entry = NULL;
+            }
+        }
 
-            if(done_none_result == NULL) {
+        if(entry == NULL) {
+            self->cache_misses++;
+            if(PyList_Append(missing, key) == -1) {
                 goto error;
             }
+            continue;
+        }
 
-            // all done!
-            goto bailout;
+        self->cache_hits++;
+        cache_unlink_lru(self, entry);
+        cache_push_lru(self, entry);
+        if(PyDict_SetItem(found, key, entry->value) == -1) {
+            goto error;
         }
+    }
 
-        // otherwise done_bool is Falsy so we need to replace acc with newacc
-        // and call him again with more data
-        Py_DECREF(req->acc);
-        req->acc = newacc;
-        // now there are two references here: the struct's, and this function's.
-        // this function will release his on cleanup
-        Py_INCREF(req->acc);
+    return Py_BuildValue("(NNk)", found, missing, self->cache_generation);
+
+error:
+    Py_XDECREF(found);
+    Py_XDECREF(missing);
+    return NULL;
+}
 
-        // we're still listening for reads, so we'll just get called again when
-        // there's more data available
+static PyObject* _MemcevClient__cache_fill(_MemcevClient *self, PyObject *args) {
+    // remember the values in a dict that came back from the server for a get
+    // that was looked up in the given generation. If there's been a set of a
+    // key since then, its value may be older than what it set, so we don't
+    PyObject* found = NULL;
+    unsigned long generation = 0;
+    PyObject* key;
+    PyObject* value;
+    Py_ssize_t pos = 0;
+
+    if(!PyArg_ParseTuple(args, "O!k", &PyDict_Type, &found, &generation)) {
+        return NULL;
     }
 
-    goto cleanup;
+    if(self->cache_buckets == NULL) {
+        Py_RETURN_NONE;
+    }
 
-error:
-    // there's an exception on the stack that occurred that we can report back
-    // up through the cb
-    PyErr_Fetch(&ptype, &pvalue, &ptraceback);
-    // since we're actually "handling" it, we can normalise it
-    PyErr_NormalizeException(&ptype, &pvalue, &ptraceback);
+    double expires = cache_now() + self->cache_ttl;
 
-    error_none_result = PyObject_CallFunction(req->done_cb, "((sO))", "error", pvalue);
+    while(PyDict_Next(found, &pos, &key, &value)) {
+        if(!PyString_Check(key) || !PyString_Check(value)) {
+            continue;
+        }
+        if(generation != self->cache_generation) {
+            // something has been set since, though keys that share its slot
+            // are skipped along with it
+            uint32_t hash = cache_hash(PyString_AS_STRING(key), PyString_GET_SIZE(key));
+            if(self->cache_set_stamps[hash & (CACHE_SET_STAMPS - 1)] > generation) {
+                continue;
+            }
+        }
+        if(cache_store(self, key, value, expires) == -1) {
+            return NULL;
+        }
+    }
 
-    Py_XDECREF(error_none_result);
-    Py_XDECREF(ptype);
-    Py_XDECREF(pvalue);
-    Py_XDECREF(ptraceback);
+    Py_RETURN_NONE;
+}
 
-bailout:
-    // we're totally done so free everything up now
-    Py_DECREF(req->connection);
-    Py_DECREF(req->body);
-    Py_DECREF(req->parse_cb);
-    Py_DECREF(req->acc);
-    Py_DECREF(req->done_cb);
+static PyObject* _MemcevClient__cache_invalidate(_MemcevClient *self, PyObject *args) {
+    // forget a key because we're setting it
+    PyObject* key = NULL;
 
-    free(req);
+    if(!PyArg_ParseTuple(args, "S", &key)) {
+        return NULL;
+    }
 
-    ev_io_stop(loop, watcher);
-    free(watcher);
+    if(self->cache_buckets != NULL) {
+        uint32_t hash = cache_hash(PyString_AS_STRING(key), PyString_GET_SIZE(key));
+        cache_entry** slot = cache_slot(self, key, hash);
 
-cleanup:
-    Py_XDECREF(newacc);
-    Py_XDECREF(done_bool);
-    Py_XDECREF(parse_response);
-    Py_XDECREF(done_none_result);
+        self->cache_generation++;
+        self->cache_set_stamps[hash & (CACHE_SET_STAMPS - 1)] = self->cache_generation;
 
-    if(PyErr_Occurred()) {
-        // we've already cleaned up but if there's still an exception there's no
-        // way to bubble this back up, so the best we can do is print and clear
-        // it. TODO we should invalidate this connection so a new one can be
-        // established
-        PyErr_Print();
+        if(*slot != NULL) {
+            cache_remove(self, slot);
+        }
     }
 
-    PyGILState_Release(gstate);
+    Py_RETURN_NONE;
 }
 
-static PyObject* _MemcevClient__getset_request(_MemcevClient *self, PyObject *args) {
-    // memcached requests are always request->response, so this abstracts that
-    // pattern while allowing the parsing to be done in Python where it's easier
+static int loop_init(memcev_loop* self, int queue_size, int pool_size) {
+    // set up one of a client's loops, whose settings have already been
+    // filled in. If this fails then whatever it did manage is cleaned up by
+    // loop_dealloc
+    int i;
 
-    PyObject* connection_obj = NULL;
-    PyObject* body = NULL;
-    PyObject* parse_cb = NULL;
-    PyObject* done_cb = NULL;
-    PyObject* acc = NULL;
+    self->pool = pool_new(pool_size);
+    if(self->pool == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
 
-    ev_io* watcher = NULL;
-    getset_request* req = NULL;
+    self->ring = malloc(queue_size * sizeof(submission_cell));
+    if(self->ring == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for(i = 0; i < queue_size; i++) {
+        self->ring[i].sequence = i;
+        self->ring[i].req = NULL;
+    }
+    self->ring_mask = queue_size - 1;
+    self->enqueue_pos = 0;
+    self->dequeue_pos = 0;
+    self->stopped = 0;
 
-    if(!PyArg_ParseTuple(args, "OSOOO",
-                         &connection_obj, &body, &parse_cb, &acc, &done_cb)) {
-        return NULL;
+    // we have to initialise this here instead of letting the eventloop thread
+    // do it, because we need a handle to it and to be able to promise that it
+    // can be called before we can promise that the event loop has initialised
+    // it
+    self->loop = ev_loop_new(EVFLAG_AUTO);
+    if(self->loop == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Couldn't power up ev_loop_new");
+        return -1;
     }
 
-    // we're going to hold onto these in C so we'd better have a reference
-    Py_INCREF(connection_obj);
-    Py_INCREF(body);
-    Py_INCREF(parse_cb);
-    Py_INCREF(done_cb);
-    Py_INCREF(acc);
+    ev_async_init(&self->async_watcher, notify_event_loop);
+    ev_async_start(self->loop, &self->async_watcher);
 
-    ev_connection* connection = PyCapsule_GetPointer(connection_obj, "connection");
-    if(connection == NULL) {
-        goto error;
+    // this is only started while there are deadlines in the wheel
+    self->wheel = calloc(WHEEL_SLOTS, sizeof(memcev_request*));
+    if(self->wheel == NULL) {
+        PyErr_NoMemory();
+        return -1;
     }
+    self->wheel_count = 0;
+    ev_init(&self->wheel_timer, wheel_cb);
 
-    if((watcher = malloc(sizeof(ev_async))) == NULL) {
+    self->inflight = calloc(INFLIGHT_BUCKETS, sizeof(memcev_request*));
+    if(self->inflight == NULL) {
         PyErr_NoMemory();
-        goto error;
+        return -1;
     }
+    self->inflight_generation = 0;
 
-    ev_io_init(watcher, getset_request_cb, connection->fd, EV_WRITE);
+    // and this only while there are hedges waiting to be sent
+    ev_init(&self->hedge_timer, hedge_cb);
 
-    if((req = malloc(sizeof(getset_request))) == NULL) {
-        PyErr_NoMemory();
-        goto error;
+    // and this only while there are sets buffered
+    if(self->write_behind > 0) {
+        self->wb_table = calloc(WRITE_BEHIND_BUCKETS, sizeof(memcev_request*));
+        if(self->wb_table == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    ev_init(&self->wb_timer, write_behind_cb);
+
+    if(self->idle_timeout > 0 && self->max_connections > self->min_connections) {
+        // it's safe to start this here because the loop isn't running yet.
+        // Connections can be idle for up to half as long again before we
+        // notice, which is close enough
+        ev_timer_init(&self->idle_timer, idle_cb,
+                      self->idle_timeout / 2, self->idle_timeout / 2);
+        ev_timer_start(self->loop, &self->idle_timer);
     }
 
-    req->connection = connection_obj;
-    req->body = body;
-    req->parse_cb = parse_cb;
-    req->acc = acc;
-    req->done_cb = done_cb;
-    req->state = getset_not_started;
+    /* give that watcher access to our struct */
+    ev_set_userdata(self->loop, self);
 
-    watcher->data = req;
+    return 0;
+}
 
-    ev_io_start(self->loop, watcher);
+static int _MemcevClient_init(_MemcevClient *self, PyObject *args, PyObject *kwargs) {
+    int pipeline_depth = 8;
+    int queue_size = 4096;
+    int min_connections = 1;
+    int max_connections = 5;
+    double idle_timeout = 60;
+    int compress_threshold = 0;
+    Py_ssize_t cache_size = 0;
+    double cache_ttl = 1.0;
+    int num_loops = 1;
+    int pool_size = REQUEST_POOL_SIZE;
+    int max_pending = 1024;
+    int replicas = 1;
+    double hedge_delay = 0;
+    double write_behind = 0;
+    Py_ssize_t write_behind_bytes = 65536;
+    int i;
+
+    static char *kwdlist[] = {"pipeline_depth", "queue_size",
+                              "min_connections", "max_connections",
+                              "idle_timeout", "compress_threshold",
+                              "cache_size", "cache_ttl", "loops",
+                              "request_pool", "max_pending", "replicas",
+                              "hedge_delay", "write_behind",
+                              "write_behind_bytes", NULL};
 
-    Py_RETURN_NONE;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "|iiiidindiiiiddn",
+                                     kwdlist,
+                                     &pipeline_depth, &queue_size,
+                                     &min_connections, &max_connections,
+                                     &idle_timeout, &compress_threshold,
+                                     &cache_size, &cache_ttl, &num_loops,
+                                     &pool_size, &max_pending, &replicas,
+                                     &hedge_delay, &write_behind,
+                                     &write_behind_bytes)) {
+        // everything else is expected to be handled by our superclass
+        return -1;
+    }
 
-error:
-    Py_DECREF(connection_obj);
-    Py_DECREF(body);
-    Py_DECREF(parse_cb);
-    Py_DECREF(done_cb);
-    Py_DECREF(acc);
+    if(pipeline_depth < 1) {
+        PyErr_SetString(PyExc_ValueError, "pipeline_depth must be positive");
+        return -1;
+    }
 
-    if(watcher != NULL) {
-        free(watcher);
+    if(queue_size < 2 || (queue_size & (queue_size - 1)) != 0) {
+        PyErr_SetString(PyExc_ValueError, "queue_size must be a power of two");
+        return -1;
     }
-    if(req != NULL) {
-        free(req);
+
+    if(min_connections < 1 || max_connections < min_connections) {
+        PyErr_SetString(PyExc_ValueError,
+                        "need 1 <= min_connections <= max_connections");
+        return -1;
     }
 
-    // there's an exception already on the stack if we're down here
-    return NULL;
-}
+    if(num_loops < 1) {
+        PyErr_SetString(PyExc_ValueError, "loops must be positive");
+        return -1;
+    }
 
-static void free_connection_capsule(PyObject *capsule) {
-    ev_connection* connection = PyCapsule_GetPointer(capsule, "connection");
-    if(connection == NULL) {
-        return;
+    if(max_pending < 1) {
+        PyErr_SetString(PyExc_ValueError, "max_pending must be positive");
+        return -1;
     }
 
-    // if the capsule has lost all references, there can be no more watchers or
-    // anything so this should be safe
+    if(pool_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "request_pool can't be negative");
+        return -1;
+    }
 
-    // this may block because it may have to flush anything in the socket. in
-    // real life it shouldn't though
-    Py_BEGIN_ALLOW_THREADS;
+    if(replicas < 1 || replicas > MAX_REPLICAS) {
+        PyErr_Format(PyExc_ValueError, "replicas must be from 1 to %d", MAX_REPLICAS);
+        return -1;
+    }
 
-    close(connection->fd);
+    if(write_behind < 0 || write_behind_bytes < 1) {
+        PyErr_SetString(PyExc_ValueError,
+                        "write_behind can't be negative and write_behind_bytes must be positive");
+        return -1;
+    }
 
-    Py_END_ALLOW_THREADS;
+    // a negative hedge_delay means that the loops work it out for
+    // themselves
+    self->replicas = replicas;
+    self->hedging = replicas > 1 && hedge_delay != 0;
 
-    free(connection);
-}
+    if(cache_size > 0 && cache_ttl > 0) {
+        self->cache_buckets = calloc(CACHE_INITIAL_BUCKETS, sizeof(cache_entry*));
+        if(self->cache_buckets == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->cache_mask = CACHE_INITIAL_BUCKETS - 1;
+        self->cache_max_bytes = cache_size;
+        self->cache_ttl = cache_ttl;
+    }
 
-static void connect_cb(struct ev_loop* loop, ev_io *watcher, int revents) {
-    if(!(EV_WRITE & revents)) {
-        return;
+    self->loops = calloc(num_loops, sizeof(memcev_loop));
+    if(self->loops == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->num_loops = num_loops;
+
+    for(i = 0; i < num_loops; i++) {
+        memcev_loop* loop = &self->loops[i];
+
+        loop->pipeline_depth = pipeline_depth;
+        loop->max_pending = max_pending;
+        loop->min_connections = min_connections;
+        loop->max_connections = max_connections;
+        loop->idle_timeout = idle_timeout;
+        loop->compress_threshold = compress_threshold > 0 ? compress_threshold : 0;
+        loop->hedge_auto = hedge_delay < 0;
+        loop->hedge_delay = hedge_delay > 0 ? hedge_delay : 0;
+        loop->write_behind = write_behind;
+        loop->write_behind_bytes = write_behind_bytes;
+
+        if(loop_init(loop, queue_size, pool_size) == -1) {
+            return -1;
+        }
     }
 
-    // clean all of this up first and extract just the connection and callback
-    ev_io_stop(loop, watcher);
-    connect_request* request = watcher->data;
-    ev_connection* connection = request->connection;
-    PyObject* callback = request->callback;
-    free(request);
-    free(watcher);
+    return 0;
+}
 
-    int so_error;
-    socklen_t len = sizeof(so_error);
-    int sockopt_result = getsockopt(connection->fd, SOL_SOCKET,
-                                    SO_ERROR, &so_error, &len);
+static void discard_followers(memcev_request* req) {
+    // like discard_requests, for a list of followers
+    while(req != NULL) {
+        memcev_request* next = req->follow_next;
+        release_request(req);
+        req = next;
+    }
+}
 
-    if(sockopt_result != -1 && so_error == 0) {
-        // success!
-        connection->state = connection_connected;
-    } else {
-        connection->state = connection_error;
-        if(sockopt_result == -1) {
-            connection->error = strerror(errno);
-        } else {
-            connection->error = strerror(so_error);
+static void discard_requests(memcev_request* req) {
+    // throw away a list of requests without telling anybody. Must be called
+    // with the GIL held
+    while(req != NULL) {
+        memcev_request* next = req->next;
+        // nobody else knows about its followers, or its hedge if it hasn't
+        // been sent. If it has then it'll be found by itself
+        discard_followers(req->followers);
+        if(req->hedge != NULL && req->hedge->state == request_submitted) {
+            release_request(req->hedge);
+        } else if(req->hedge != NULL) {
+            req->hedge->hedged = NULL;
         }
-        close(connection->fd);
+        if(req->hedged != NULL) {
+            req->hedged->hedge = NULL;
+        }
+        release_request(req);
+        req = next;
     }
+}
 
-    // now grab the GIL so we can tell the client about it
-    PyGILState_STATE gstate;
-    gstate = PyGILState_Ensure();
-
-    // call the callback with either an error tuple or a success tuple
-    // containing PyCapsule containing a connection*
+static void loop_dealloc(memcev_loop* self) {
+    // this isn't called until the event loop finishes running, so it should be
+    // safe to clean up everything including the libev objects. Must be called
+    // with the GIL held
+    int i, c, lane;
 
-    PyObject* none_result = NULL;
-    PyObject* capsule = NULL;
+    if(self->loop != NULL) {
+        ev_loop_destroy(self->loop);
+        self->loop = NULL;
+    }
 
-    if(connection->state == connection_error) {
-        none_result = PyObject_CallFunction(callback, "((ss))", "error", connection->error);
-        if(none_result == NULL) {
-            goto sock_cleanup;
-        }
-    } else {
-        capsule = PyCapsule_New(connection, "connection", free_connection_capsule);
-        if(capsule == NULL) {
-            goto sock_cleanup;
+    if(self->ring != NULL) {
+        memcev_request* req;
+        while((req = submission_pop(self)) != NULL) {
+            req->next = NULL;
+            discard_requests(req);
         }
+        free(self->ring);
+        self->ring = NULL;
+    }
 
-        none_result = PyObject_CallFunction(callback, "((sO))", "connected", capsule);
+    for(i = 0; i < self->num_servers; i++) {
+        memcev_server* server = &self->servers[i];
 
-        if(none_result == NULL) {
-            // if he didn't exit successfully, we don't really know if he did
-            // his job to add the capsule to the connections queue, so we don't
-            // know whether we should close the socket. but since we're this
-            // far, we know that the capsule has been created successfully so
-            // can rely on refcounting to close it from now on
-            goto sock_cleanup;
+        for(lane = 0; lane < PRIORITY_LANES; lane++) {
+            discard_requests(server->pending_head[lane]);
         }
-    }
 
-    goto cleanup;
+        for(c = 0; c < server->num_connections; c++) {
+            ev_connection* connection = server->connections[c];
+
+            discard_requests(connection->head);
+            if(connection->connecting != NULL) {
+                discard_requests(connection->connecting);
+            }
 
-sock_cleanup:
-    // an error occurred that means we need to clean up the socket first
-    close(connection->fd);
-    free(connection);
+            if(connection->fd != -1) {
+                // this may block because it may have to flush anything in the
+                // socket. in real life it shouldn't though
+                Py_BEGIN_ALLOW_THREADS;
+                close(connection->fd);
+                Py_END_ALLOW_THREADS;
+            }
 
-cleanup:
-    Py_DECREF(callback);
-    Py_XDECREF(capsule);
-    Py_XDECREF(none_result);
+            free(connection->rbuf);
+            free(connection);
+        }
 
-    if(PyErr_Occurred()) {
-        // not much else I can do here, we're on the event loop's thread
-        PyErr_Print();
+        free(server->connections);
+        free(server->host);
+    }
+    free(self->servers);
+    self->servers = NULL;
+    self->num_servers = 0;
+
+    if(self->wb_table != NULL) {
+        for(i = 0; i < WRITE_BEHIND_BUCKETS; i++) {
+            memcev_request* req;
+            while((req = self->wb_table[i]) != NULL) {
+                self->wb_table[i] = req->wb_next;
+                req->next = NULL;
+                discard_requests(req);
+            }
+        }
+        free(self->wb_table);
+        self->wb_table = NULL;
+    }
+    discard_requests(self->flush_head);
+    self->flush_head = NULL;
+
+    // everything that was in here has been freed already
+    free(self->wheel);
+    self->wheel = NULL;
+    free(self->inflight);
+    self->inflight = NULL;
+
+    // its requests have all been given back by now, except any that are
+    // still waiting for a waiter to collect them, which keep it alive
+    if(self->pool != NULL) {
+        pool_release(self->pool);
+        self->pool = NULL;
     }
 
-    PyGILState_Release(gstate);
+    // the async_watcher has no cleanup method, so I think it's safe to assume
+    // that it has no state after it's not used?
 }
 
-static PyObject* _MemcevClient__connect(_MemcevClient *self, PyObject *args) {
-    PyObject* ret = NULL;
-    PyObject* cb = NULL;
-    char* hostname = NULL;
-    int port = 0;
+static void _MemcevClient_dealloc(_MemcevClient* self) {
+    int i;
 
-    if (!PyArg_ParseTuple(args, "siO",
-                          &hostname, &port, &cb)) {
-        return NULL;
+    for(i = 0; i < self->num_loops; i++) {
+        loop_dealloc(&self->loops[i]);
     }
+    free(self->loops);
+    self->loops = NULL;
+    self->num_loops = 0;
 
-    // cb will escape this function, even though hostname and port will not
-    Py_INCREF(cb);
+    free(self->ketama);
+    self->ketama = NULL;
 
-    ev_connection* connection = NULL;
-    ev_io* connect_watcher = NULL;
-    connect_request* request = NULL;
+    cache_clear(self);
 
-    connect_watcher = malloc(sizeof(ev_io));
-    if(connect_watcher == NULL) {
-        ret = PyErr_NoMemory();
-        goto error;
-    }
+    self->ob_type->tp_free((PyObject*)self);
+}
 
-    request = malloc(sizeof(connect_request));
-    if(request == NULL) {
-        ret = PyErr_NoMemory();
-        goto error;
-    }
 
-    // he's going to do a blocking network call to resolve DNS
-    Py_BEGIN_ALLOW_THREADS;
 
-    connection = make_connection(hostname, port);
+static int _MemcevWaiter_init(_MemcevWaiter *self, PyObject *args, PyObject *kwargs) {
+    static char *kwdlist[] = {NULL};
 
-    Py_END_ALLOW_THREADS;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "", kwdlist)) {
+        return -1;
+    }
 
-    if(connection == NULL) {
-        ret = PyErr_NoMemory();
-        goto error;
+    if(self->waiter != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "waiter is already initialised");
+        return -1;
     }
 
-    if(connection->state == connection_error) {
-        // since we're connecting in a non-blocking way, these errors can only
-        // be errors in DNS resolution or allocation failures. we don't find out
-        // about any others until later
-        PyErr_SetString(PyExc_RuntimeError, connection->error);
-        goto error;
+    memcev_waiter* waiter = malloc(sizeof(memcev_waiter));
+    if(waiter == NULL) {
+        PyErr_NoMemory();
+        return -1;
     }
 
-    connect_watcher->data = request;
-    request->connection = connection;
-    request->callback = cb;
+    if(pthread_mutex_init(&waiter->lock, NULL) != 0) {
+        free(waiter);
+        PyErr_SetString(PyExc_RuntimeError, "Couldn't create the waiter's lock");
+        return -1;
+    }
 
-    ev_io_init(connect_watcher, connect_cb, connection->fd, EV_WRITE);
-    ev_io_start(self->loop, connect_watcher);
+    if(pthread_cond_init(&waiter->cond, NULL) != 0) {
+        pthread_mutex_destroy(&waiter->lock);
+        free(waiter);
+        PyErr_SetString(PyExc_RuntimeError, "Couldn't create the waiter's condition");
+        return -1;
+    }
 
-    Py_RETURN_NONE;
+    waiter->done_head = NULL;
+    waiter->done_tail = NULL;
+    waiter->refs = 1; // ours
+    waiter->abandoned = 0;
 
-error:
-    if(connection != NULL) {
-        free(connection);
-    }
-    if(connect_watcher != NULL) {
-        free(connect_watcher);
-    }
-    if(request != NULL) {
-        free(request);
-    }
-    Py_DECREF(cb);
+    self->waiter = waiter;
 
-    return ret;
+    return 0;
 }
 
-static ev_connection* make_connection(char* host, int port) {
-    ev_connection* ret = malloc(sizeof(ev_connection));
+static PyObject* _MemcevWaiter_wait(_MemcevWaiter *self, PyObject *args) {
+    // wait for the next of our requests to finish and return its result
+    // tuple. We sleep on a condition variable without the GIL, so (unlike
+    // Queue.get) we wake up as soon as the event loop signals us
+    PyObject* timeout_obj = Py_None;
+    double timeout = -1;
 
-    if(ret == NULL) {
+    if(!PyArg_ParseTuple(args, "|O", &timeout_obj)) {
         return NULL;
     }
 
-    int sock = socket(PF_INET, SOCK_STREAM, 0);
-
-    if(sock == -1) {
-        ret->state = connection_error;
-        ret->error = strerror(errno);
-
-        goto cleanup;
+    if(timeout_obj != Py_None) {
+        timeout = PyFloat_AsDouble(timeout_obj);
+        if(timeout == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if(timeout < 0) {
+            timeout = 0;
+        }
     }
 
-    ret->fd = sock;
-    ret->state = connection_connecting;
-
-    /* set it non-blocking */
-    if(-1 == fcntl(sock, F_SETFL, O_NONBLOCK | fcntl(sock, F_GETFL))) {
-        ret->state = connection_error;
-        ret->error = strerror(errno);
-
-        goto cleanup;
+    memcev_waiter* waiter = self->waiter;
+    if(waiter == NULL) {
+        PyErr_SetString(PyExc_ValueError, "waiter isn't initialised");
+        return NULL;
     }
 
-    // libev doesn't have an async DNS implementation like libevent, and I don't
-    // really want to pull in libadns as a dependency. but we won't be doing
-    // this very often anyway and connections are already blocking from the
-    // caller's perspective
-    struct hostent* he = gethostbyname(host);
-    if(he == NULL) {
-        ret->state = connection_error;
-        ret->error = (char*)hstrerror(h_errno);
-        goto cleanup;
-    }
+    memcev_request* req = NULL;
 
-    struct sockaddr_in server;
-    server.sin_family = AF_INET;
-    server.sin_port = htons(port);
+    Py_BEGIN_ALLOW_THREADS;
 
-    memcpy(&server.sin_addr, he->h_addr_list[0], he->h_length);
+    struct timespec deadline;
+    if(timeout >= 0) {
+        // condition variables want an absolute deadline
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)timeout;
+        deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
 
-    int connect_status = connect(sock, (struct sockaddr *)&server, sizeof(server));
+    pthread_mutex_lock(&waiter->lock);
 
-    if(connect_status == 0) {
-        ret->state = connection_error;
-        ret->error = "unexpected success";
-    } else if(errno != EINPROGRESS) {
-        // anything else is wrong
-        ret->state = connection_error;
-        ret->error = strerror(errno);
+    while(waiter->done_head == NULL) {
+        if(timeout < 0) {
+            pthread_cond_wait(&waiter->cond, &waiter->lock);
+        } else if(pthread_cond_timedwait(&waiter->cond, &waiter->lock,
+                                         &deadline) == ETIMEDOUT) {
+            break;
+        }
     }
 
-cleanup:
-    if(ret->state == connection_error && sock != -1) {
-        close(sock);
+    req = waiter->done_head;
+    if(req != NULL) {
+        waiter->done_head = req->next;
+        if(waiter->done_head == NULL) {
+            waiter->done_tail = NULL;
+        }
     }
 
-    // hostents are cleaned up/reused by the system
+    pthread_mutex_unlock(&waiter->lock);
 
-    return ret;
-}
-
-static int _MemcevClient_init(_MemcevClient *self, PyObject *args, PyObject *kwargs) {
-    int ret = 0;
-
-    static char *kwdlist[] = {NULL};
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
-                                     "",
-                                     kwdlist)) {
-        // we take no arguments because our superclass is expected to handle
-        // them
-        return -1;
-    }
+    Py_END_ALLOW_THREADS;
 
-    // we have to initialise this here instead of letting the eventloop thread
-    // do it, because we need a handle to it and to be able to promise that it
-    // can be called before we can promise that the event loop has initialised
-    // it
-    self->loop = ev_loop_new(EVFLAG_AUTO);
-    if(self->loop == NULL) {
-        PyErr_SetString(PyExc_RuntimeError, "Couldn't power up ev_loop_new");
-        ret = -1;
-        goto cleanup;
+    if(req == NULL) {
+        // timed out
+        Py_RETURN_NONE;
     }
 
-    ev_async_init(&self->async_watcher, notify_event_loop);
-    ev_async_start(self->loop, &self->async_watcher);
-
-    /* give that watcher access to our struct */
-    ev_set_userdata(self->loop, self);
-
-cleanup:
+    PyObject* result = response_tuple(req);
+    release_request(req);
 
-    return ret;
+    return result;
 }
 
-static void _MemcevClient_dealloc(_MemcevClient* self) {
-    // this isn't called until the event loop finishes running, so it should be
-    // safe to clean up everything including the libev objects
-    if(self->loop != NULL) {
-        ev_loop_destroy(self->loop);
-        self->loop = NULL;
-    }
+static void _MemcevWaiter_dealloc(_MemcevWaiter* self) {
+    memcev_waiter* waiter = self->waiter;
+
+    if(waiter != NULL) {
+        // there may still be requests in flight that will be handed to us
+        // later. Tell the event loop to throw them away instead, and throw
+        // away the ones that have already finished ourselves
+        pthread_mutex_lock(&waiter->lock);
+        waiter->abandoned = 1;
+        memcev_request* done = waiter->done_head;
+        waiter->done_head = NULL;
+        waiter->done_tail = NULL;
+        pthread_mutex_unlock(&waiter->lock);
+
+        while(done != NULL) {
+            memcev_request* next = done->next;
+            release_request(done);
+            done = next;
+        }
 
-    // the async_watcher has no cleanup method, so I think it's safe to assume
-    // that it has no state after it's not used?
+        // the last request to finish will free it if that isn't us
+        release_waiter(waiter);
+        self->waiter = NULL;
+    }
 
     self->ob_type->tp_free((PyObject*)self);
 }
 
-
 PyMODINIT_FUNC init_memcev(void) {
     // initialise the module
 
@@ -612,12 +5792,17 @@ PyMODINIT_FUNC init_memcev(void) {
     // have to do this here because some C compilers have issues with static
     // references between modules. we can take this out when we make our own
     _MemcevClientType.tp_new = PyType_GenericNew;
+    _MemcevWaiterType.tp_new = PyType_GenericNew;
 
     if (PyType_Ready(&_MemcevClientType) < 0) {
         /* exception raised in preparing */
         return;
     }
 
+    if (PyType_Ready(&_MemcevWaiterType) < 0) {
+        return;
+    }
+
     module = Py_InitModule3("_memcev",
         NULL, /* no functions of our own */
         "C module that implements the memcev event loop");
@@ -630,4 +5815,26 @@ PyMODINIT_FUNC init_memcev(void) {
     /* make it visible */
     Py_INCREF(&_MemcevClientType);
     PyModule_AddObject(module, "_MemcevClient", (PyObject *)&_MemcevClientType);
+
+    Py_INCREF(&_MemcevWaiterType);
+    PyModule_AddObject(module, "_MemcevWaiter", (PyObject *)&_MemcevWaiterType);
+
+    MemcevTimeoutError = PyErr_NewException("_memcev.TimeoutError",
+                                            PyExc_IOError, NULL);
+    if (MemcevTimeoutError == NULL) {
+        return;
+    }
+    Py_INCREF(MemcevTimeoutError);
+    PyModule_AddObject(module, "TimeoutError", MemcevTimeoutError);
+
+    MemcevOverloadError = PyErr_NewException("_memcev.OverloadError",
+                                             MemcevTimeoutError, NULL);
+    if (MemcevOverloadError == NULL) {
+        return;
+    }
+    Py_INCREF(MemcevOverloadError);
+    PyModule_AddObject(module, "OverloadError", MemcevOverloadError);
+
+    PyModule_AddIntConstant(module, "INTERACTIVE", PRIORITY_INTERACTIVE);
+    PyModule_AddIntConstant(module, "BULK", PRIORITY_BULK);
 }
@@ -15,87 +15,791 @@
 /* prototypes */
 
 typedef struct {
-    PyObject_HEAD
-    /* our own C-visible fields go here. */
+    uint32_t point;
+    int server; // index into the server list that the ring was built from
+} ketama_point;
 
-    ev_async async_watcher;
-    struct ev_loop *loop;
-} _MemcevClient;
+typedef struct {
+    // somewhere that a server can be connected to
+    struct sockaddr_storage addr;
+    socklen_t len;
+} memcev_address;
+
+// latencies are counted in HDR-style log-linear buckets: one per nanosecond
+// below HIST_SUBS, and after that HIST_SUBS of them for every power of two,
+// so a bucket's bounds are never more than 1/HIST_SUBS apart. Anything from
+// 2^HIST_MAX_BITS ns (about 18 minutes) up goes in the last one
+#define HIST_SUB_BITS 4
+#define HIST_SUBS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUBS)
+
+// what each request's time is split into: waiting to be written (on the
+// submission ring and in line for a connection), from being written to
+// having its response, and the whole thing
+#define LATENCY_QUEUE 0
+#define LATENCY_WIRE 1
+#define LATENCY_TOTAL 2
+#define LATENCY_STAGES 3
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total_ns;
+    uint64_t max_ns;
+} memcev_histogram;
+
+typedef struct {
+    // counters that the event loop keeps about what it's been doing. Only it
+    // writes them, and _stats reads them from other threads with atomic loads
+    uint64_t compressed_values;
+    uint64_t bytes_before_compression;
+    uint64_t bytes_after_compression;
+    uint64_t decompressed_values;
+    uint64_t unreadable_values;
+    uint64_t coalesced_gets;
+
+    // gets and sets that have finished, and how many of those failed (and
+    // of them, how many timed out)
+    uint64_t gets;
+    uint64_t sets;
+    uint64_t errors;
+    uint64_t timeouts;
+    uint64_t overloaded;
+
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+
+    // how many times requests were left waiting because every connection
+    // to their server already had pipeline_depth in flight
+    uint64_t pool_exhausted;
+
+    // how many gets had a copy sent to a replica because they were taking
+    // too long, and how many of those copies answered first. Nobody waits
+    // for the copies of sets that go to replicas, so this is the only place
+    // that their failures show up
+    uint64_t hedges;
+    uint64_t hedge_wins;
+    uint64_t replica_set_failures;
+
+    // sets written behind that were replaced by a newer one for the same
+    // key before they were sent
+    uint64_t write_behind_coalesced;
+
+    // indexed by request_get or request_set, and then by LATENCY_*
+    memcev_histogram latency[2][LATENCY_STAGES];
+} memcev_stats;
+
+typedef struct {
+    // counters for everything that's gone over the connections to one
+    // server. Connections come and go, so they're kept here rather than on
+    // each of them
+    uint64_t requests;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t failures; // connections that broke
+} memcev_server_stats;
+
+typedef struct cache_entry {
+    // a value that we've recently seen from the server, kept in front of it
+    // until it expires. Entries are in a chained hash table by their key, and
+    // in a list from the most to the least recently used
+    struct cache_entry* hash_next;
+    struct cache_entry* lru_prev;
+    struct cache_entry* lru_next;
+    uint32_t hash;
+    double expires;
+    size_t size; // what it counts against cache_max_bytes
+    PyObject* key;
+    PyObject* value;
+} cache_entry;
+
+typedef struct dns_entry dns_entry;
+
+struct dns_entry {
+    char* host;
+    int port;
+
+    // all of its addresses, in the order that we should prefer them
+    memcev_address* addrs;
+    int naddrs;
+
+    // when they should be resolved again, and whether somebody's already
+    // doing that
+    time_t expires;
+    int refreshing;
+
+    dns_entry* next;
+};
+
+typedef struct {
+    // what a dns_refresh_thread is resolving
+    char* host;
+    int port;
+} dns_refresh_job;
 
 typedef enum {
     connection_not_started,
     connection_connecting,
     connection_error,
+    connection_backoff, // it broke, and we're waiting to reconnect it
     connection_connected,
 } ev_connection_state;
 
+typedef struct memcev_request memcev_request;
+typedef struct request_pool request_pool;
+
+typedef struct {
+    // somewhere for a caller to wait for its requests to finish without
+    // holding the GIL. The event loop puts each one on done as it finishes
+    // and signals cond, and the caller takes them off again
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    memcev_request* done_head;
+    memcev_request* done_tail;
+
+    // the _MemcevWaiter holds one reference and every request that hasn't
+    // been freed yet holds another, so the event loop never has to touch the
+    // Python object (or know whether it still exists)
+    int refs;
+
+    // set once the _MemcevWaiter is gone and nobody will collect results
+    int abandoned;
+} memcev_waiter;
+
+typedef struct {
+    PyObject_HEAD
+    memcev_waiter* waiter;
+} _MemcevWaiter;
+
 typedef struct {
     int fd;
     ev_connection_state state;
     char* error;
+    int server; // index of the server that it's connected to
+
+    // while we're connecting, the connect request that's waiting to hear
+    // whether it worked (if it's a reconnect then nobody is)
+    memcev_request* connecting;
+
+    // when it breaks we reconnect it, backing off exponentially for as long
+    // as it keeps failing. failures is how many times that's been in a row
+    // without a response in between
+    ev_timer retry_timer;
+    int failures;
+
+    // when it last did anything, so that we can close it when it's been
+    // idle too long
+    ev_tstamp last_used;
+
+    // a single watcher handles all of the I/O for every request on this
+    // connection. events is what it's currently watching for
+    ev_io watcher;
+    int events;
+
+    // requests are pipelined: they're written in the order they were issued
+    // and the server responds in the same order, so we keep them in a FIFO.
+    // Everything from head up to (but not including) unsent has been written
+    // and is waiting for its response; unsent onwards hasn't been written yet
+    memcev_request* head;
+    memcev_request* tail;
+    memcev_request* unsent;
+    int inflight; // how many requests are in the FIFO
+
+    // the socket may only take part of a request, in which case this is how
+    // much of unsent has already been written
+    size_t wpos;
+
+    // responses are read into this growable buffer and parsed in place, so we
+    // don't have to go back up to Python for every chunk that we recv()
+    char* rbuf;
+    size_t rbuf_len; // how much of it is filled with data
+    size_t rbuf_size; // how much of it is allocated
+    size_t rpos; // where the response for head starts
 } ev_connection;
 
+// gets and sets wait for a connection in one of these lanes, and nothing in
+// a lane is sent while there's anything waiting in the ones before it
+#define PRIORITY_INTERACTIVE 0
+#define PRIORITY_BULK 1
+#define PRIORITY_LANES 2
+
+// how many counters there are in each server's filter of the keys of bulk
+// sets that are waiting. Must be a power of two
+#define BULK_SET_FILTER 256
+
+// how many slots the near cache has for remembering when keys were last set
+// locally, by their hash. Must be a power of two
+#define CACHE_SET_STAMPS 1024
+
 typedef struct {
-    ev_connection* connection;
-    PyObject* callback;
-} connect_request;
+    char* host;
+    int port;
+
+    // every connection that we've opened to it, including broken ones
+    ev_connection** connections;
+    int num_connections;
+    int connections_size;
+
+    // get and set requests that are waiting for a connection with room,
+    // with a queue for each priority. There are pending_count of them
+    // altogether, which is never allowed to go past the loop's max_pending
+    memcev_request* pending_head[PRIORITY_LANES];
+    memcev_request* pending_tail[PRIORITY_LANES];
+    int pending_count;
+
+    // how many sets are waiting in the bulk lane, and how many of them have
+    // keys with each hash. Anything for one of their keys has to wait
+    // behind them, even if it's interactive, so that it doesn't overtake
+    // them
+    int bulk_sets;
+    uint32_t bulk_set_keys[BULK_SET_FILTER];
+
+    memcev_server_stats stats;
+} memcev_server;
+
+typedef struct {
+    // see submission_push for how these sequence numbers work
+    size_t sequence;
+    memcev_request* req;
+} submission_cell;
+
+typedef enum {
+    request_get,
+    request_set,
+    request_connect, // open another connection to the server
+    request_check, // make sure that the event loop is alive
+    request_stop, // stop the event loop
+    request_cancel, // cancel everything outstanding for a waiter
+    request_flush, // send every set that's being written behind, and wait for them
+} request_op;
+
+typedef enum {
+    request_submitted, // it's on the submission ring
+    request_pending, // it's waiting in line at its server for a connection
+    request_connecting, // it's a connect that's in progress
+    request_not_started, // we're waiting for the connection to become writeable
+    request_awaiting_response, // we sent the request and are waiting for the response
+    request_following, // it's the same as a get that's already running, and will share its response
+    request_flushing, // it's a flush that's waiting for sets to finish
+    request_finished, // it's been failed early and is on its way back
+} request_state;
+
+typedef enum {
+    response_get, // zero or more VALUE blocks followed by END
+    response_set, // a single STORED
+    response_none, // nothing, because it was sent with noreply
+} response_type;
 
 typedef enum {
-    getset_not_started, // we're waiting for the connection to become writeable
-    getset_awaiting_response, // we sent the request and are waiting for the response
-} getset_request_state;
+    parse_line, // we're waiting for a full \r\n-terminated line
+    parse_value, // we're inside of a VALUE block waiting for its payload
+    parse_value_end, // we read the payload by itself and need its \r\n
+    parse_done, // we saw the terminating line and have the whole response
+    parse_error, // the server sent an error (or garbage we can't understand)
+} parse_state;
 
 typedef struct {
-    PyObject* connection; // capsule containing the ev_connection
-    PyObject* body;
-    PyObject* parse_cb;
-    PyObject* acc; // somewhere for _parse_response to store its intermediate states
-    PyObject* done_cb; // who to call with the result    
-    getset_request_state state;
-} getset_request;
+    // a VALUE block. These are offsets into the rbuf rather than pointers
+    // because it may be realloc()d under us
+    size_t key_start;
+    size_t key_len;
+    unsigned long flags;
+    size_t value_start;
+    size_t value_len;
+
+    // big values are read straight into their final string instead of into
+    // the rbuf, in which case here it is
+    PyObject* direct;
+
+    // if it was compressed, the original that we got back out of it
+    char* inflated;
+    size_t inflated_len;
+
+    // it said it was compressed but wouldn't decompress, so it's left out of
+    // the results as though the server hadn't had it
+    int unreadable;
+} parsed_value;
+
+typedef struct {
+    response_type type;
+    parse_state state;
+    size_t pos; // how far into the connection's rbuf we've parsed
+
+    // the VALUE block that we're currently reading
+    parsed_value current;
+
+    // if we're reading its payload straight into a string, the string and
+    // how much of it we've filled
+    PyObject* direct;
+    size_t direct_filled;
+
+    // and all of the ones we've finished, since a multi-key get can return
+    // any number of them
+    parsed_value* values;
+    size_t values_len;
+    size_t values_size;
+
+    // if state == parse_error, what went wrong. The message is a static
+    // prefix and optionally some detail from the response line itself
+    const char* error;
+    size_t error_start;
+    size_t error_len;
+
+    // whether the error means that we can no longer make sense of the rest of
+    // the stream (as opposed to the server cleanly reporting an error)
+    int fatal;
+} response_parser;
+
+// request bodies up to this big are kept in the request itself instead of
+// needing their own allocation, which covers most gets and small sets
+#define REQUEST_INLINE_BODY 128
+
+struct memcev_request {
+    request_op op;
+    int server; // index into the client's servers, if the op needs one
+
+    // the loop's pool that it came from, and goes back to when it's freed
+    request_pool* pool;
+
+    // the request already encoded in the memcached protocol. This is our own
+    // copy so that the event loop never has to touch a Python object to send
+    // it. It's either body_inline or its own allocation
+    char* body;
+    size_t body_len;
+    char body_inline[REQUEST_INLINE_BODY];
+
+    // for big sets, the caller's value itself. It's sent between the body and
+    // a \r\n without being copied, which means holding onto their buffer
+    Py_buffer value;
+    int has_value;
+
+    // set if we compressed the value into the body instead, in which case we
+    // still hold onto the buffer but don't send it
+    int value_compressed;
+
+    // for sets that _submit_set encoded, what's in their set line (whose key
+    // starts right after "set "), so that it can be rewritten without being
+    // parsed again. set_header_len is 0 for sets whose body came from Python
+    size_t set_header_len;
+    size_t set_key_len;
+    long set_expire;
+    size_t set_value_len;
+
+    // who to tell about the result. At most one of these is set: done_cb is
+    // called on the event loop's thread, and the waiter is woken up so that
+    // its caller can pick up the result on theirs
+    PyObject* done_cb;
+    memcev_waiter* waiter;
+
+    // if the result is going to a waiter, our own copy of the response,
+    // because the connection's rbuf will be long gone by the time they get it
+    char* response;
+    size_t response_len;
+
+    // for cancels, whose requests we're cancelling
+    memcev_waiter* target;
+
+    ev_connection* conn; // the connection that it was sent on (or is connecting)
+    request_state state;
+    response_parser parser;
+
+    // how long it's allowed to take in seconds (or 0 for forever), and once
+    // the event loop has it, when that runs out
+    double timeout;
+    ev_tstamp deadline;
+
+    // when it was submitted, and when we finished writing it (or 0 if we
+    // haven't), in CLOCK_MONOTONIC nanoseconds
+    uint64_t submitted_ns;
+    uint64_t sent_ns;
+
+    // which of its server's pending lanes it waits in, and if it's a set in
+    // the bulk lane, the hash of its key
+    int priority;
+    uint32_t key_hash;
+
+    // set if the request failed before we could get a response at all.
+    // overloaded means that it was shed because too much was waiting ahead
+    // of it, either when it arrived or by the time its deadline came
+    int errnum;
+    const char* error;
+    int timed_out;
+    int overloaded;
+    int cancelled;
+
+    // the next request in whichever FIFO (or list of completed requests)
+    // that it's in. prev is only kept up to date in the server's pending
+    // queue, so we can take requests out of the middle of it when they time
+    // out
+    memcev_request* next;
+    memcev_request* prev;
+
+    // its place in the timer wheel, if it has a deadline. wheel_slot is -1
+    // if it isn't in there
+    int wheel_slot;
+    memcev_request* wheel_next;
+    memcev_request* wheel_prev;
+
+    // identical gets that turn up while one is already running follow it
+    // instead of going to the server themselves. The one that's running is
+    // in the client's inflight table, with the body_hash and generation that
+    // it was put there with, and the rest are on its list of followers
+    int inflight;
+    uint32_t body_hash;
+    unsigned long generation;
+    memcev_request* inflight_next;
+    memcev_request* leader;
+    memcev_request* followers;
+    memcev_request* follow_next;
+
+    // a get that a replica could answer too comes with hedge, a copy of
+    // itself for the replica, which is sent if the original hasn't been
+    // answered by hedge_at. Until then the original waits in its loop's
+    // hedge queue. The copy points back at the original with hedged, and
+    // once they're both out, whichever answers first is delivered (though
+    // a copy that found nothing never wins). hedge_lost is set on the other
+    // one, which is thrown away when it finishes. replica is set on the
+    // copies of a set that go to replicas
+    memcev_request* hedge;
+    memcev_request* hedged;
+    ev_tstamp hedge_at;
+    int hedge_queued;
+    memcev_request* hedge_next;
+    memcev_request* hedge_prev;
+    int hedge_lost;
+    int replica;
+
+    // a set that's written behind waits in its loop's write-behind table,
+    // chained by wb_next, until it's flushed, and is sent with noreply.
+    // flush is the flush that's waiting for it to finish, if any, and a
+    // flush's flush_waiting is how many it's waiting for
+    int write_behind;
+    memcev_request* wb_next;
+    memcev_request* flush;
+    int flush_waiting;
+};
+
+typedef struct request_slab {
+    struct request_slab* next;
+    size_t count;
+    memcev_request requests[];
+} request_slab;
+
+struct request_pool {
+    // recycled requests for one loop, carved out of slabs that are only given
+    // back when the pool goes away. Requests are only taken from it by
+    // submit, which holds the GIL, so by one thread at a time: they come off
+    // free, which is refilled all at once from returned whenever it runs
+    // out. Requests are freed on any thread (the event loop's, or a
+    // waiter's), which push them onto returned without a lock
+    memcev_request* free;
+    memcev_request* returned;
+    request_slab* slabs;
+
+    // one for the loop and one for each request that's in use, so that a
+    // pool outlives its loop for as long as anybody still has one of its
+    // requests, like a waiter whose results nobody has collected
+    uint64_t refs;
+
+    // for stats: how many requests the slabs hold, and the most that have
+    // been in use at once
+    uint64_t allocated;
+    uint64_t high_water;
+};
+
+typedef struct {
+    // an event loop and everything that belongs to it. A client has one or
+    // more of these, each run on its own thread, and each of them has its own
+    // pool of connections to every server. Nothing in here is touched by any
+    // other thread except through the submission ring and the stats
+    ev_async async_watcher;
+    struct ev_loop *loop;
+
+    // the servers that we talk to. This is only set up once, before the
+    // event loop starts, and after that is only touched by the event loop
+    memcev_server* servers;
+    int num_servers;
+
+    // how many requests we'll pipeline on a single connection
+    int pipeline_depth;
+
+    // how many gets and sets can wait for a connection to each server
+    int max_pending;
+
+    // set values at least this big are compressed, if it's not 0
+    size_t compress_threshold;
+
+    memcev_stats stats;
+
+    // where its requests come from
+    request_pool* pool;
+
+    // each server's pool grows on demand up to max_connections, and
+    // connections that have been idle for idle_timeout seconds are closed
+    // again until it's back down to min_connections. idle_timer checks for
+    // them
+    int min_connections;
+    int max_connections;
+    double idle_timeout;
+    ev_timer idle_timer;
+
+    // requests are handed to the event loop through this bounded ring. Any
+    // thread can push onto it, but only the event loop pops from it
+    submission_cell* ring;
+    size_t ring_mask; // the ring's size is a power of two, so this is size-1
+    size_t enqueue_pos; // shared by the submitting threads
+    size_t dequeue_pos; // only used by the event loop
+
+    // set once the event loop has been told to stop, after which nothing new
+    // will be accepted
+    int stopped;
+
+    // every request with a deadline is in this hashed timer wheel: a ring of
+    // WHEEL_SLOTS lists, one per WHEEL_TICK, that a request is put in by when
+    // its deadline is. A single timer visits each slot in turn, so we don't
+    // need a timer per request. It only runs while there's anything in there
+    memcev_request** wheel;
+    size_t wheel_count;
+    uint64_t wheel_tick; // the next tick that the timer will visit
+    ev_timer wheel_timer;
+
+    // every get that other identical ones can follow, in INFLIGHT_BUCKETS
+    // chains by the hash of their body. inflight_generation changes with
+    // every set, because a get that was sent before a set may not see it, so
+    // gets that come after it can't follow one from before it
+    memcev_request** inflight;
+    unsigned long inflight_generation;
+
+    // gets waiting to send their hedges, in the order that they're due, and
+    // the timer that sends them. hedge_delay is how long they wait in
+    // seconds, or 0 for never. If hedge_auto is set then it's the 95th
+    // percentile of the latest HEDGE_WINDOW gets' latencies, which are
+    // counted in hedge_window
+    memcev_request* hedge_head;
+    memcev_request* hedge_tail;
+    ev_timer hedge_timer;
+    double hedge_delay;
+    int hedge_auto;
+    memcev_histogram hedge_window;
+    uint64_t hedge_samples;
+
+    // sets that are written behind wait in wb_table, in WRITE_BEHIND_BUCKETS
+    // chains by the hash of their key, for up to write_behind seconds
+    // (which wb_timer counts down) or until there are write_behind_bytes of
+    // them. If write_behind is 0 then nothing is. Flushes that are waiting
+    // for sets to finish are in flush_head, in the order that they came in,
+    // which is the order that they finish in
+    double write_behind;
+    size_t write_behind_bytes;
+    memcev_request** wb_table;
+    size_t wb_count;
+    size_t wb_bytes;
+    ev_timer wb_timer;
+    memcev_request* flush_head;
+    memcev_request* flush_tail;
+} memcev_loop;
+
+typedef struct {
+    PyObject_HEAD
+    /* our own C-visible fields go here. */
+
+    // gets and sets are spread over the loops by their key, so that
+    // everything for one key happens in order on one loop. Everything else
+    // goes to all of them
+    memcev_loop* loops;
+    int num_loops;
+
+    // the near cache of recent gets. It's turned off if cache_max_bytes is
+    // 0. Everything in here is only touched by Python threads holding the
+    // GIL, never by the event loops. cache_generation changes with every
+    // local set, which stamps it into cache_set_stamps by its key's hash, so
+    // that a get that was already on its way when it happened doesn't put
+    // back what the set replaced (but can still fill in other keys)
+    cache_entry** cache_buckets;
+    size_t cache_mask; // the table's size is a power of two, so this is size-1
+    size_t cache_count;
+    size_t cache_bytes;
+    size_t cache_max_bytes;
+    double cache_ttl;
+    cache_entry* cache_head; // the most recently used
+    cache_entry* cache_tail; // the next one to go when we need room
+    unsigned long cache_generation;
+    unsigned long cache_set_stamps[CACHE_SET_STAMPS];
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_evictions;
+
+    // the consistent hashing ring, sorted by point
+    ketama_point* ketama;
+    size_t ketama_len;
+
+    // how many servers each key is written to, and whether its gets are
+    // hedged to the second of them
+    int replicas;
+    int hedging;
+} _MemcevClient;
+
 
 PyMODINIT_FUNC init_memcev(void);
-static PyObject* _MemcevClient_notify(_MemcevClient *self, PyObject *unused);
-static PyObject* _MemcevClient_start(_MemcevClient *self, PyObject *unused);
+static PyObject* _MemcevClient_start(_MemcevClient *self, PyObject *args);
 static PyObject* _MemcevClient_stop(_MemcevClient *self, PyObject *unused);
-static PyObject* _MemcevClient__connect(_MemcevClient *self, PyObject *args);
-static PyObject* _MemcevClient__getset_request(_MemcevClient *self, PyObject *args);
+static PyObject* _MemcevClient__submit(_MemcevClient *self, PyObject *args);
+static PyObject* _MemcevClient__cancel(_MemcevClient *self, PyObject *args);
+static PyObject* _MemcevClient__stats(_MemcevClient *self, PyObject *unused);
+static PyObject* _MemcevClient__cache_lookup(_MemcevClient *self, PyObject *args);
+static PyObject* _MemcevClient__cache_fill(_MemcevClient *self, PyObject *args);
+static PyObject* _MemcevClient__cache_invalidate(_MemcevClient *self, PyObject *args);
+static PyObject* _MemcevClient__submit_get(_MemcevClient *self, PyObject *args);
+static PyObject* _MemcevClient__submit_set(_MemcevClient *self, PyObject *args);
+static PyObject* _MemcevClient__split_keys(_MemcevClient *self, PyObject *args);
+static PyObject* _MemcevClient__valid_key(PyObject *unused, PyObject *args);
+static PyObject* _MemcevClient__set_servers(_MemcevClient *self, PyObject *args);
+static PyObject* _MemcevClient__ketama_build(_MemcevClient *self, PyObject *args);
+static PyObject* _MemcevClient__ketama_lookup(_MemcevClient *self, PyObject *args);
 
 static int _MemcevClient_init(_MemcevClient *self, PyObject *args, PyObject *kwds);
 static void _MemcevClient_dealloc(_MemcevClient* self);
 
+static PyObject* _MemcevWaiter_wait(_MemcevWaiter *self, PyObject *args);
+static int _MemcevWaiter_init(_MemcevWaiter *self, PyObject *args, PyObject *kwds);
+static void _MemcevWaiter_dealloc(_MemcevWaiter* self);
+
 static void notify_event_loop(struct ev_loop *loop, ev_async *watcher, int revents);
-static ev_connection* make_connection(char* host, int port);
+static void compress_request(memcev_loop* self, memcev_request* req);
+static int coalesce_get(memcev_loop* self, memcev_request* req);
+static uint32_t cache_hash(const char* key, size_t key_len);
+static int ketama_server(_MemcevClient* self, const char* key, size_t key_len);
+static int ketama_servers(_MemcevClient* self, const char* key, size_t key_len,
+                          int* servers, int max);
+static ev_connection* make_connection(const memcev_address* address);
+static void connection_open(ev_connection* connection, const memcev_address* address);
+static int server_address(memcev_server* server, int index, memcev_address* address);
+static ev_connection* add_connection(memcev_loop* self, int server_index,
+                                     int* errnum, const char** error);
+static void connection_reconnect(memcev_loop* self, ev_connection* connection);
+static void retry_cb(struct ev_loop* loop, ev_timer* timer, int revents);
+static void idle_cb(struct ev_loop* loop, ev_timer* timer, int revents);
+static PyObject* submit(memcev_loop* self, request_op op, int server,
+                        const char* body, size_t body_len, PyObject* value,
+                        PyObject* done_cb, memcev_waiter* waiter,
+                        double timeout, memcev_waiter* target);
+static int submit_all(_MemcevClient* self, request_op op, int server,
+                      PyObject* done_cb, memcev_waiter* waiter,
+                      double timeout, memcev_waiter* target);
+static void fail_submissions(memcev_loop* self);
+static memcev_request** start_connect(memcev_loop* self, memcev_request* req,
+                                      memcev_request** completed_tail);
+static memcev_request** stop_client(memcev_loop* self,
+                                    memcev_request** completed_tail);
+static memcev_request** dispatch_server(memcev_loop* self, memcev_server* server,
+                                        memcev_request** completed_tail);
+static void deliver_requests(memcev_loop* self, memcev_request* completed);
+static void pending_push(memcev_server* server, memcev_request* req);
+static memcev_request** admit_pending(memcev_loop* self, memcev_server* server,
+                                      memcev_request* req,
+                                      memcev_request** completed_tail);
+static void wheel_add(memcev_loop* self, memcev_request* req);
+static void wheel_remove(memcev_loop* self, memcev_request* req);
+static void wheel_cb(struct ev_loop* loop, ev_timer* timer, int revents);
+static void hedge_queue(memcev_loop* self, memcev_request* req);
+static void hedge_sample(memcev_loop* self, uint64_t ns);
+static void settle_hedge(memcev_loop* self, memcev_request* req);
+static void hedge_cb(struct ev_loop* loop, ev_timer* timer, int revents);
+static void write_behind_add(memcev_loop* self, memcev_request* req);
+static void write_behind_release(memcev_loop* self, memcev_request* req);
+static void write_behind_flush(memcev_loop* self, memcev_request* flush);
+static void write_behind_cb(struct ev_loop* loop, ev_timer* timer, int revents);
+static memcev_request** start_flush(memcev_loop* self, memcev_request* req,
+                                    memcev_request** completed_tail);
+static memcev_request** finish_flushes(memcev_loop* self,
+                                       memcev_request** completed_tail);
+static void flush_detach(memcev_loop* self, memcev_request* flush);
+static void flush_written(memcev_loop* self, memcev_request* req);
+static memcev_request** cancel_waiter(memcev_loop* self, memcev_waiter* target,
+                                      memcev_request** completed_tail);
+static void connect_cb(struct ev_loop* loop, ev_io *watcher, int revents);
+static void parse_response(response_parser* parser, const char* buf, size_t len);
+static void connection_io_cb(struct ev_loop* loop, ev_io *watcher, int revents);
 
 /* the method table */
 static PyMethodDef _MemcevClientType_methods[] = {
     /* Python-visible methods go here */
-    {
-        "notify",
-        (PyCFunction)_MemcevClient_notify, METH_NOARGS,
-        "we've added something to the requests queue, notify the eventloop"
-    },
     {
         "start",
-        (PyCFunction)_MemcevClient_start, METH_NOARGS,
-        "start the eventloop (probably in its own Thread)"
+        (PyCFunction)_MemcevClient_start, METH_VARARGS,
+        "start one of the eventloops (probably in its own Thread)"
     },
     {
         "stop",
         (PyCFunction)_MemcevClient_stop, METH_NOARGS,
-        "stop the eventloop (forcefully)"
+        "stop the eventloops, failing anything that's still outstanding"
     },
 
     {
-        "_connect",
-        (PyCFunction)_MemcevClient__connect, METH_VARARGS,
-        "make an new connection (internal C implementation)"
+        "_submit",
+        (PyCFunction)_MemcevClient__submit, METH_VARARGS,
+        "hand a request to the eventloop (internal C implementation)"
+    },
+    {
+        "_submit_get",
+        (PyCFunction)_MemcevClient__submit_get, METH_VARARGS,
+        "check and encode a get and hand it to the eventloop (internal C implementation)"
+    },
+    {
+        "_submit_set",
+        (PyCFunction)_MemcevClient__submit_set, METH_VARARGS,
+        "check and encode a set and hand it to the eventloop (internal C implementation)"
+    },
+    {
+        "_split_keys",
+        (PyCFunction)_MemcevClient__split_keys, METH_VARARGS,
+        "check keys and group them by server (internal C implementation)"
+    },
+    {
+        "_valid_key",
+        (PyCFunction)_MemcevClient__valid_key, METH_VARARGS | METH_STATIC,
+        "whether something can be used as a memcached key"
+    },
+    {
+        "_cancel",
+        (PyCFunction)_MemcevClient__cancel, METH_VARARGS,
+        "cancel everything outstanding for a waiter (internal C implementation)"
+    },
+    {
+        "_stats",
+        (PyCFunction)_MemcevClient__stats, METH_NOARGS,
+        "the event loop's counters as a dict (internal C implementation)"
+    },
+    {
+        "_cache_lookup",
+        (PyCFunction)_MemcevClient__cache_lookup, METH_VARARGS,
+        "split keys into what the near cache has and what it doesn't (internal C implementation)"
+    },
+    {
+        "_cache_fill",
+        (PyCFunction)_MemcevClient__cache_fill, METH_VARARGS,
+        "remember values that we got from the server (internal C implementation)"
+    },
+    {
+        "_cache_invalidate",
+        (PyCFunction)_MemcevClient__cache_invalidate, METH_VARARGS,
+        "forget a key that we're setting (internal C implementation)"
+    },
+    {
+        "_set_servers",
+        (PyCFunction)_MemcevClient__set_servers, METH_VARARGS,
+        "set the list of (host, port) servers, before the eventloop starts"
     },
 
     {
-        "_getset_request",
-        (PyCFunction)_MemcevClient__getset_request, METH_VARARGS,
-        "perform a memcached round trip (internal C implementation)"
+        "_ketama_build",
+        (PyCFunction)_MemcevClient__ketama_build, METH_VARARGS,
+        "build the consistent hashing ring from a list of (name, weight)"
+    },
+    {
+        "_ketama_lookup",
+        (PyCFunction)_MemcevClient__ketama_lookup, METH_VARARGS,
+        "find the index of the server that a key belongs to"
     },
     {NULL, NULL, 0, NULL}
 };
@@ -148,4 +852,55 @@ static PyTypeObject _MemcevClientType = {
     0,                         /* tp_new, will set in init_memcev */
 };
 
+static PyMethodDef _MemcevWaiterType_methods[] = {
+    {
+        "wait",
+        (PyCFunction)_MemcevWaiter_wait, METH_VARARGS,
+        "wait up to timeout seconds for the next result, returning None if none came"
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject _MemcevWaiterType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /* ob_size */
+    "_memcev._MemcevWaiter",   /* tp_name */
+    sizeof(_MemcevWaiter),     /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)_MemcevWaiter_dealloc,  /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_compare */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash  */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,        /* tp_flags */
+    "Collects the results of requests passed to _submit in the order that they finish.", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    _MemcevWaiterType_methods, /* tp_methods */
+    0,                         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)_MemcevWaiter_init, /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new, will set in init_memcev */
+};
+
 #endif /* __MEMCEV_H__ */
\ No newline at end of file
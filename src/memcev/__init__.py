@@ -1 +1,2 @@
-from .memcev import Client
\ No newline at end of file
+from .memcev import (Client, Future, TimeoutError, OverloadError, wait_all,
+                     INTERACTIVE, BULK)
@@ -0,0 +1,334 @@
+"""
+Measures throughput and latency of get, set and get_multi. Unless it's given
+a server, it starts memcev.fakememcached in a subprocess to run against, so
+it doesn't need a real memcached. Run it with:
+
+    python -m memcev.benchmark [options]
+
+A table of results is printed to stderr, and the same results as JSON to
+stdout (or --output). Passing an earlier run's JSON as --baseline fails the
+run if anything has got slower than that by more than --tolerance.
+"""
+
+import json
+import optparse
+import os
+import platform
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from memcev import Client
+
+OPS = ('get', 'set', 'get_multi')
+
+def percentile(ordered, fraction):
+    # ordered must already be sorted
+    if not ordered:
+        return 0
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+def parse_sizes(spec):
+    # "100:0.9,10000:0.1" is values of 100 bytes 90% of the time and 10000
+    # bytes 10% of the time. The weights don't have to add up to anything
+    sizes = []
+    for part in spec.split(','):
+        size, _, weight = part.partition(':')
+        sizes.append((int(size), float(weight or 1)))
+    return sizes
+
+def parse_ints(spec):
+    return [int(x) for x in spec.split(',')]
+
+class Sizes(object):
+    "picks value sizes from a weighted distribution"
+
+    def __init__(self, sizes):
+        self.sizes = sizes
+        self.total = sum(weight for size, weight in sizes)
+
+    def pick(self, rand):
+        point = rand.uniform(0, self.total)
+        for size, weight in self.sizes:
+            point -= weight
+            if point <= 0:
+                return size
+        return self.sizes[-1][0]
+
+class FakeServer(object):
+    "memcev.fakememcached in a subprocess, so that it has its own GIL"
+
+    def __init__(self, latency, unix=None):
+        args = [sys.executable, '-m', 'memcev.fakememcached',
+                '--port', '0', '--latency', str(latency)]
+        if unix is not None:
+            args += ['--unix', unix]
+
+        env = dict(os.environ)
+        env['PYTHONPATH'] = os.pathsep.join(
+            [os.path.dirname(os.path.dirname(os.path.abspath(__file__)))]
+            + filter(None, [env.get('PYTHONPATH')]))
+
+        self.process = subprocess.Popen(args, stdout=subprocess.PIPE, env=env)
+        line = self.process.stdout.readline()
+        if not line.startswith('listening on '):
+            self.stop()
+            raise RuntimeError("fake memcached didn't start: %r" % line)
+        self.address = line[len('listening on '):].strip()
+
+    def stop(self):
+        if self.process.poll() is None:
+            self.process.terminate()
+        self.process.wait()
+
+def client_for(address, **kwargs):
+    if address.startswith('unix:'):
+        return Client(address, **kwargs)
+    host, port = address.rsplit(':', 1)
+    return Client(host, int(port), **kwargs)
+
+def run_op(client, op, threads, duration, keys, multi, values, seed):
+    """
+    Run op from threads threads for duration seconds, returning how many
+    were done and a sorted list of their latencies in seconds
+    """
+    latencies = []
+    errors = []
+    lock = threading.Lock()
+    start_line = threading.Event()
+    deadline = [None]
+
+    def worker(n):
+        rand = random.Random(seed + n)
+        mine = []
+        start_line.wait()
+        try:
+            while time.time() < deadline[0]:
+                if op == 'get':
+                    key = keys[rand.randrange(len(keys))]
+                    start = time.time()
+                    client.get(key)
+                elif op == 'set':
+                    key = keys[rand.randrange(len(keys))]
+                    value = values[rand.randrange(len(values))]
+                    start = time.time()
+                    client.set(key, value)
+                else:
+                    chosen = rand.sample(keys, min(multi, len(keys)))
+                    start = time.time()
+                    client.get_multi(chosen)
+                mine.append(time.time() - start)
+        except Exception as e:
+            errors.append(e)
+        with lock:
+            latencies.extend(mine)
+
+    workers = [threading.Thread(target=worker, args=(n,)) for n in range(threads)]
+    for t in workers:
+        t.daemon = True
+        t.start()
+
+    began = time.time()
+    deadline[0] = began + duration
+    start_line.set()
+    for t in workers:
+        t.join()
+    elapsed = time.time() - began
+
+    if errors:
+        raise errors[0]
+
+    latencies.sort()
+    return elapsed, latencies
+
+def run_config(address, transport, options, threads, pool, loops):
+    rand = random.Random(options.seed)
+    sizes = Sizes(parse_sizes(options.value_sizes))
+    keys = ['bench%d' % x for x in range(options.keys)]
+
+    # a fixed set of values to choose from, so that building them isn't part
+    # of what we're measuring
+    values = ['v' * sizes.pick(rand) for x in range(100)]
+
+    client = client_for(address, size=pool, loops=loops,
+                        pipeline_depth=options.pipeline_depth)
+    results = []
+    try:
+        for key in keys:
+            client.set(key, values[rand.randrange(len(values))], wait=False)
+        client.get(keys[-1])
+
+        for op in options.ops:
+            elapsed, latencies = run_op(client, op, threads, options.duration,
+                                        keys, options.multi, values,
+                                        options.seed)
+            results.append({
+                'op': op,
+                'transport': transport,
+                'threads': threads,
+                'pool': pool,
+                'loops': loops,
+                'ops': len(latencies),
+                'seconds': round(elapsed, 3),
+                'ops_per_sec': round(len(latencies) / elapsed, 1),
+                'p50_ms': round(percentile(latencies, 0.5) * 1000, 3),
+                'p99_ms': round(percentile(latencies, 0.99) * 1000, 3),
+                'p999_ms': round(percentile(latencies, 0.999) * 1000, 3),
+            })
+    finally:
+        client.close()
+
+    return results
+
+def result_key(result):
+    return tuple(result[field] for field in
+                 ('op', 'transport', 'threads', 'pool', 'loops'))
+
+def compare(results, baseline, tolerance):
+    # returns a description of everything that's got slower than it was in
+    # the baseline by more than tolerance (as a fraction)
+    before = dict((result_key(result), result) for result in baseline['results'])
+    regressions = []
+
+    for result in results:
+        old = before.get(result_key(result))
+        if old is None or not old['ops_per_sec']:
+            continue
+        change = result['ops_per_sec'] / old['ops_per_sec'] - 1
+        if change < -tolerance:
+            regressions.append('%s: %.1f ops/s, was %.1f (%+.1f%%)'
+                               % ('/'.join(map(str, result_key(result))),
+                                  result['ops_per_sec'], old['ops_per_sec'],
+                                  change * 100))
+
+    return regressions
+
+def print_table(results, out):
+    header = ('op', 'transport', 'threads', 'pool', 'loops',
+              'ops_per_sec', 'p50_ms', 'p99_ms', 'p999_ms')
+    print >>out, ' '.join('%11s' % field for field in header)
+    for result in results:
+        print >>out, ' '.join('%11s' % result[field] for field in header)
+
+def main(argv=None):
+    parser = optparse.OptionParser(usage="%prog [options]")
+    parser.add_option('--server', default=None,
+                      help="host:port or unix:/path of a memcached to use "
+                           "instead of starting a fake one")
+    parser.add_option('--transport', default='tcp',
+                      help="tcp, unix or tcp,unix: which of them to start "
+                           "the fake memcached on")
+    parser.add_option('--latency', type='float', default=0,
+                      help="milliseconds that the fake memcached holds back "
+                           "every response for")
+    parser.add_option('--threads', default='1,8',
+                      help="comma-separated numbers of threads to run with")
+    parser.add_option('--pool', default='4',
+                      help="comma-separated connection pool sizes to run with")
+    parser.add_option('--loops', default='1',
+                      help="comma-separated numbers of event loops to run with")
+    parser.add_option('--pipeline-depth', type='int', default=8)
+    parser.add_option('--keys', type='int', default=1000,
+                      help="how many different keys to use")
+    parser.add_option('--value-sizes', default='100:0.9,10000:0.1',
+                      help="value sizes in bytes and how often to use them, "
+                           "as size:weight,...")
+    parser.add_option('--multi', type='int', default=20,
+                      help="how many keys each get_multi asks for")
+    parser.add_option('--ops', default=','.join(OPS),
+                      help="comma-separated operations to measure")
+    parser.add_option('--duration', type='float', default=2,
+                      help="seconds to run each operation for")
+    parser.add_option('--seed', type='int', default=0)
+    parser.add_option('--output', default=None,
+                      help="write the JSON results here instead of stdout")
+    parser.add_option('--baseline', default=None,
+                      help="JSON results from an earlier run to compare with")
+    parser.add_option('--tolerance', type='float', default=0.1,
+                      help="how much slower than the baseline (as a fraction) "
+                           "counts as a regression")
+    options, args = parser.parse_args(argv)
+
+    options.ops = options.ops.split(',')
+    for op in options.ops:
+        if op not in OPS:
+            parser.error("unknown op %r" % op)
+
+    servers = []
+    tempdir = None
+    try:
+        if options.server is not None:
+            targets = [('unix' if options.server.startswith('unix:') else 'tcp',
+                        options.server)]
+        else:
+            targets = []
+            for transport in options.transport.split(','):
+                if transport == 'unix':
+                    tempdir = tempdir or tempfile.mkdtemp()
+                    server = FakeServer(options.latency,
+                                        unix=os.path.join(tempdir, 'memcached.sock'))
+                elif transport == 'tcp':
+                    server = FakeServer(options.latency)
+                else:
+                    parser.error("unknown transport %r" % transport)
+                servers.append(server)
+                targets.append((transport, server.address))
+
+        results = []
+        for transport, address in targets:
+            for loops in parse_ints(options.loops):
+                for pool in parse_ints(options.pool):
+                    for threads in parse_ints(options.threads):
+                        results.extend(run_config(address, transport, options,
+                                                  threads, pool, loops))
+    finally:
+        for server in servers:
+            server.stop()
+        if tempdir is not None:
+            shutil.rmtree(tempdir)
+
+    print_table(results, sys.stderr)
+
+    document = {
+        'benchmark': 'memcev',
+        'version': 1,
+        'time': int(time.time()),
+        'python': platform.python_version(),
+        'platform': platform.platform(),
+        'settings': {
+            'server': options.server or 'fake',
+            'latency_ms': options.latency,
+            'keys': options.keys,
+            'value_sizes': options.value_sizes,
+            'multi': options.multi,
+            'duration': options.duration,
+            'pipeline_depth': options.pipeline_depth,
+            'seed': options.seed,
+        },
+        'results': results,
+    }
+
+    if options.output is not None:
+        with open(options.output, 'w') as f:
+            json.dump(document, f, indent=2, sort_keys=True)
+    else:
+        json.dump(document, sys.stdout, indent=2, sort_keys=True)
+        print
+
+    if options.baseline is not None:
+        with open(options.baseline) as f:
+            regressions = compare(results, json.load(f), options.tolerance)
+        if regressions:
+            print >>sys.stderr, 'regressions against %s:' % options.baseline
+            for regression in regressions:
+                print >>sys.stderr, '  ' + regression
+            return 1
+
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
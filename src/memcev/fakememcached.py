@@ -0,0 +1,306 @@
+"""
+A stand-in for memcached that speaks enough of the text protocol (get,
+gets, set, delete, version, flush_all, quit) to benchmark against without
+a real one, or to run the tests against. Keys expire the way that they do
+in memcached. It can add latency to every response, to look like a server
+that's further away. Run it with:
+
+    python -m memcev.fakememcached [--port 11211 | --unix /path] [--latency ms]
+
+It prints a line saying where it's listening once it's ready.
+"""
+
+import errno
+import heapq
+import optparse
+import os
+import select
+import socket
+import sys
+import time
+
+# exptimes up to this many seconds are relative to now, and anything bigger
+# is a unix timestamp, like memcached's
+RELATIVE_EXPTIME_MAX = 60 * 60 * 24 * 30
+
+class FakeMemcached(object):
+    """
+    A single-threaded poll() server. Responses are queued in order for each
+    client, and held back until latency seconds after the request arrived,
+    so pipelined requests are still answered in parallel
+    """
+
+    def __init__(self, port=0, host='127.0.0.1', unix=None, latency=0):
+        self.latency = latency
+        self.store = {} # key -> (flags, value, expires at or None)
+
+        if unix is not None:
+            if os.path.exists(unix):
+                os.unlink(unix)
+            self.listener = socket.socket(socket.AF_UNIX)
+            self.listener.bind(unix)
+            self.address = 'unix:' + unix
+        else:
+            self.listener = socket.socket(socket.AF_INET)
+            self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            self.listener.bind((host, port))
+            self.address = '%s:%d' % self.listener.getsockname()
+
+        self.listener.listen(128)
+        self.listener.setblocking(False)
+
+        self.poll = select.poll()
+        self.poll.register(self.listener, select.POLLIN)
+        self.clients = {} # fd -> _Client
+        self.delayed = [] # a heap of (due, sequence, client, response)
+        self.sequence = 0
+        self.running = False
+
+    def serve_forever(self):
+        self.running = True
+        while self.running:
+            timeout = None
+            if self.delayed:
+                timeout = max(0, (self.delayed[0][0] - time.time()) * 1000)
+
+            try:
+                events = self.poll.poll(timeout)
+            except select.error as e:
+                if e.args[0] == errno.EINTR:
+                    continue
+                raise
+
+            for fd, event in events:
+                if fd == self.listener.fileno():
+                    self.accept()
+                elif fd in self.clients:
+                    self.handle(self.clients[fd], event)
+
+            now = time.time()
+            while self.delayed and self.delayed[0][0] <= now:
+                due, sequence, client, response = heapq.heappop(self.delayed)
+                client.queue(response)
+
+    def stop(self):
+        self.running = False
+
+    def accept(self):
+        while True:
+            try:
+                conn, addr = self.listener.accept()
+            except socket.error as e:
+                if e.args[0] in (errno.EAGAIN, errno.EWOULDBLOCK):
+                    return
+                raise
+            conn.setblocking(False)
+            if conn.family == socket.AF_INET:
+                conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            client = _Client(self, conn)
+            self.clients[conn.fileno()] = client
+            self.poll.register(conn, select.POLLIN)
+
+    def handle(self, client, event):
+        if event & select.POLLOUT:
+            client.flush()
+        if event & (select.POLLIN | select.POLLHUP | select.POLLERR):
+            client.read()
+
+    def respond(self, client, response):
+        if not self.latency:
+            client.queue(response)
+            return
+        self.sequence += 1
+        heapq.heappush(self.delayed, (time.time() + self.latency,
+                                      self.sequence, client, response))
+
+    def close(self, client):
+        self.poll.unregister(client.conn)
+        del self.clients[client.conn.fileno()]
+        client.conn.close()
+        client.closed = True
+
+    def lookup(self, key):
+        # what's stored under a key, as (flags, value), or None if there's
+        # nothing or it has expired. Expired keys are only thrown away when
+        # somebody asks for them
+        found = self.store.get(key)
+        if found is None:
+            return None
+        flags, value, expires = found
+        if expires is not None and expires <= time.time():
+            del self.store[key]
+            return None
+        return flags, value
+
+    @staticmethod
+    def expires(exptime):
+        # when a set's exptime runs out, or None if it never does
+        if exptime == 0:
+            return None
+        if exptime < 0:
+            return 0
+        if exptime <= RELATIVE_EXPTIME_MAX:
+            return time.time() + exptime
+        return exptime
+
+    def command(self, client, line):
+        # handle one command line, returning how many bytes of data after it
+        # we need before it can be finished (or 0 if it's already done)
+        parts = line.split()
+        if not parts:
+            self.respond(client, 'ERROR\r\n')
+            return 0
+
+        cmd = parts[0]
+
+        if cmd in ('get', 'gets'):
+            response = []
+            for key in parts[1:]:
+                found = self.lookup(key)
+                if found is not None:
+                    flags, value = found
+                    if cmd == 'gets':
+                        response.append('VALUE %s %d %d 0\r\n%s\r\n'
+                                        % (key, flags, len(value), value))
+                    else:
+                        response.append('VALUE %s %d %d\r\n%s\r\n'
+                                        % (key, flags, len(value), value))
+            response.append('END\r\n')
+            self.respond(client, ''.join(response))
+
+        elif cmd == 'set' and len(parts) in (5, 6):
+            try:
+                int(parts[2])
+                int(parts[3])
+                length = int(parts[4])
+            except ValueError:
+                self.respond(client, 'CLIENT_ERROR bad data chunk\r\n')
+                return 0
+            client.pending = parts
+            return length + 2
+
+        elif cmd == 'delete' and len(parts) in (2, 3):
+            found = self.lookup(parts[1])
+            self.store.pop(parts[1], None)
+            if parts[-1] != 'noreply':
+                self.respond(client, 'DELETED\r\n' if found else 'NOT_FOUND\r\n')
+
+        elif cmd == 'version':
+            self.respond(client, 'VERSION fakememcached\r\n')
+
+        elif cmd == 'flush_all':
+            self.store.clear()
+            self.respond(client, 'OK\r\n')
+
+        elif cmd == 'quit':
+            self.close(client)
+
+        else:
+            self.respond(client, 'ERROR\r\n')
+
+        return 0
+
+    def finish_set(self, client, data):
+        parts = client.pending
+        client.pending = None
+
+        if data[-2:] != '\r\n':
+            self.respond(client, 'CLIENT_ERROR bad data chunk\r\n')
+            return
+
+        self.store[parts[1]] = (int(parts[2]), data[:-2],
+                                self.expires(int(parts[3])))
+        if parts[-1] != 'noreply':
+            self.respond(client, 'STORED\r\n')
+
+class _Client(object):
+    def __init__(self, server, conn):
+        self.server = server
+        self.conn = conn
+        self.rbuf = ''
+        self.wbuf = []
+        self.wanted = 0 # bytes of set data that we're waiting for
+        self.pending = None # the set that they're for
+        self.closed = False
+
+    def read(self):
+        try:
+            data = self.conn.recv(65536)
+        except socket.error as e:
+            if e.args[0] in (errno.EAGAIN, errno.EWOULDBLOCK):
+                return
+            data = ''
+
+        if not data:
+            self.server.close(self)
+            return
+
+        self.rbuf += data
+        pos = 0
+
+        while not self.closed:
+            if self.wanted:
+                if len(self.rbuf) - pos < self.wanted:
+                    break
+                self.server.finish_set(self, self.rbuf[pos:pos+self.wanted])
+                pos += self.wanted
+                self.wanted = 0
+                continue
+
+            end = self.rbuf.find('\r\n', pos)
+            if end == -1:
+                break
+            line = self.rbuf[pos:end]
+            pos = end + 2
+            self.wanted = self.server.command(self, line)
+
+        self.rbuf = self.rbuf[pos:]
+
+    def queue(self, response):
+        if self.closed:
+            return
+        self.wbuf.append(response)
+        self.flush()
+
+    def flush(self):
+        data = ''.join(self.wbuf)
+        self.wbuf = []
+
+        try:
+            sent = self.conn.send(data) if data else 0
+        except socket.error as e:
+            if e.args[0] not in (errno.EAGAIN, errno.EWOULDBLOCK):
+                self.server.close(self)
+                return
+            sent = 0
+
+        if sent < len(data):
+            self.wbuf.append(data[sent:])
+            self.server.poll.modify(self.conn, select.POLLIN | select.POLLOUT)
+        else:
+            self.server.poll.modify(self.conn, select.POLLIN)
+
+def main(argv=None):
+    parser = optparse.OptionParser(usage="%prog [options]")
+    parser.add_option('--host', default='127.0.0.1')
+    parser.add_option('--port', type='int', default=11211,
+                      help="TCP port to listen on, 0 for any free one")
+    parser.add_option('--unix', default=None,
+                      help="listen on this Unix domain socket instead")
+    parser.add_option('--latency', type='float', default=0,
+                      help="milliseconds to hold back every response for")
+    options, args = parser.parse_args(argv)
+
+    server = FakeMemcached(port=options.port, host=options.host,
+                           unix=options.unix, latency=options.latency / 1000.0)
+
+    print 'listening on %s' % server.address
+    sys.stdout.flush()
+
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == '__main__':
+    main()
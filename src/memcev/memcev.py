@@ -1,270 +1,423 @@
-from Queue import Queue, Empty
-from collections import deque
 import threading
-import re
-from functools import partial
+import time
 
 import _memcev
+from _memcev import TimeoutError, OverloadError, INTERACTIVE, BULK
+
+class _Server(object):
+    """
+    One of the memcached servers that we distribute keys over. Its pool of
+    connections lives in C, where it's known by its index in Client.servers
+    """
+
+    def __init__(self, host, port, weight=1):
+        self.host = host
+        self.port = port
+        self.weight = weight
+
+    @property
+    def name(self):
+        # this is what identifies the server on the hash ring
+        if self.host.startswith('unix:'):
+            return self.host
+        return '%s:%d' % (self.host, self.port)
+
+    @classmethod
+    def parse(cls, spec):
+        # servers can be given as 'host:port' strings (with IPv6 addresses in
+        # [brackets]), 'unix:/path/to/socket' strings, or (host, port) or
+        # (host, port, weight) tuples
+        if isinstance(spec, str):
+            if spec.startswith('unix:'):
+                return cls(spec, 0)
+            host, port = spec.rsplit(':', 1)
+            if host.startswith('[') and host.endswith(']'):
+                host = host[1:-1]
+            return cls(host, int(port))
+        return cls(*spec)
+
+    def __repr__(self):
+        return '%s(%r, %r, %r)' % (self.__class__.__name__,
+                                   self.host, self.port, self.weight)
+
+def _latency_summary(buckets, total_ns, max_ns):
+    """
+    turn one of _stats's histograms into its count, mean, max and
+    percentiles in milliseconds. The percentiles are the upper bounds of the
+    buckets that they fall in, so they may be up to 1/16th too high. The
+    buckets themselves are kept as (limit_ms, count) pairs
+    """
+    count = sum(n for limit, n in buckets)
+    summary = {
+        'count': count,
+        'mean_ms': total_ns / 1e6 / count if count else 0.0,
+        'max_ms': max_ns / 1e6,
+        'buckets': [(limit / 1e6, n) for limit, n in buckets],
+    }
+
+    for name, fraction in (('p50_ms', 0.5), ('p99_ms', 0.99), ('p999_ms', 0.999)):
+        seen = 0
+        summary[name] = 0.0
+        for limit, n in buckets:
+            seen += n
+            if seen >= fraction * count:
+                summary[name] = min(limit, max_ns) / 1e6
+                break
+
+    return summary
+
+class Future(object):
+    """
+    The result of a request that's still running on the event loop. Get it
+    with result(), or wait for a whole list of them with wait_all()
+    """
+
+    def __init__(self, client, waiter, count, tags, finish):
+        self._client = client
+        self._waiter = waiter
+        self._pending = count # responses that we haven't collected yet
+        self._tags = tags
+        self._finish = finish
+
+        self._responses = []
+        self._exception = None
+        self._lock = threading.Lock()
+
+    def done(self):
+        "whether the result is ready, without waiting for it"
+        return self._collect(0)
+
+    def result(self, timeout=None):
+        """
+        Wait up to timeout seconds (or until the request's own deadline if
+        it's None) for the result and return it, or raise the exception if the
+        request failed. Running out of either raises a TimeoutError
+        """
+        if not self._collect(timeout):
+            raise TimeoutError("Timed out waiting for a response")
+
+        if self._exception is not None:
+            raise self._exception
+
+        return self._finish(self._responses)
+
+    def cancel(self):
+        """
+        Give up on the request. Whatever parts of it haven't finished yet fail
+        with an IOError, and if any of them had already been sent then the
+        connections that they were sent on are replaced
+        """
+        if not self.done():
+            self._client._cancel(self._waiter)
+
+    def _collect(self, timeout):
+        # collect our responses from the waiter, returning whether we've got
+        # all of them (or an error) within the timeout
+        deadline = None if timeout is None else time.time() + timeout
+
+        with self._lock:
+            while self._pending and self._exception is None:
+                remaining = (None if deadline is None
+                             else max(0, deadline - time.time()))
+
+                response = self._waiter.wait(remaining)
+                if response is None:
+                    return False
+
+                self._pending -= 1
+
+                try:
+                    self._responses.append(
+                        Client._check_response(response, self._tags))
+                except Exception as e:
+                    # the rest don't matter any more
+                    self._exception = e
+
+            return True
+
+def wait_all(futures, timeout=None):
+    """
+    Wait up to timeout seconds in total for all of the given Futures, returning
+    a list of their results in the same order. Raises the first failure, or if
+    they don't all finish in time
+    """
+    deadline = None if timeout is None else time.time() + timeout
+
+    for future in futures:
+        remaining = None if deadline is None else max(0, deadline - time.time())
+        if not future._collect(remaining):
+            raise TimeoutError("Timed out waiting for a response")
+
+    return [future.result(0) for future in futures]
 
 class Client(_memcev._MemcevClient):
     """
-    A libev-based memcached client that manages a fixed-size pool
+    A libev-based memcached client that manages a pool of connections to each
+    of a list of servers, distributing keys over them with ketama consistent
+    hashing
     """
 
-    # 5 seconds is a long time for a memcached call
+    # in milliseconds. 5 seconds is a long time for a memcached call. Every
+    # request that we send has this long to finish (including waiting for a
+    # connection), after which it fails with a TimeoutError. If it had
+    # already been sent, the connection that it was sent on is replaced. If
+    # it was still waiting for a connection then it's an OverloadError
     timeout = 5000
 
-    def __init__(self, host, port, size=5, debug=False):
+    # get_multi won't split up a request into pieces smaller than this
+    get_multi_chunk_size = 100
+
+    def __init__(self, host, port=None, size=None, pipeline_depth=8,
+                 queue_size=4096, min_size=1, max_size=5, idle_timeout=60,
+                 compress_threshold=None, cache_size=0, cache_ttl=1.0,
+                 loops=1, request_pool=256, max_pending=1024, replicas=1,
+                 hedge_delay=None, write_behind=None,
+                 write_behind_bytes=65536, debug=False):
         """
         Build a Client
 
         Arguments:
-        host: The hostname of the memcached server
-        port: the TCP port that memcached is running on
-        size: how many connections to build and keep around
+        host: The hostname of the memcached server, 'unix:/path/to/socket'
+              for one listening on a Unix domain socket, or a list of servers
+              as 'host:port' or 'unix:...' strings or (host, port) or (host,
+              port, weight) tuples
+        port: the TCP port that memcached is running on, if host is a hostname
+        size: if it's given, keep exactly this many connections to each
+              server (the same as passing it as both min_size and max_size)
+        pipeline_depth: how many requests can be in flight on a single
+                        connection at once
+        queue_size: how many requests can be waiting to be picked up by the
+                    event loop before submitters have to wait for it. Must be
+                    a power of two
+        min_size: how many connections to each server to open up front and
+                  always keep, for each loop
+        max_size: how many connections to each server we'll open when
+                  requests are waiting for one, for each loop
+        idle_timeout: seconds after which connections that haven't been used
+                      are closed, down to min_size
+        compress_threshold: if it's given, values at least this many bytes
+                            long are zlib-compressed before they're sent,
+                            when that makes them smaller
+        cache_size: if it's given, keep up to this many bytes of recently
+                    got values in a near cache in front of the servers, so
+                    that getting them again doesn't need to ask them
+        cache_ttl: seconds that values are kept in the near cache for. They
+                   can be this out of date with sets made by anybody else
+        loops: how many event loops to run, each on its own thread and with
+               its own connections. Keys are spread over them, so that busy
+               clients can use more than one core
+        request_pool: how many requests each loop sets aside up front to
+                      reuse, rather than allocating each one. It grows past
+                      this when more are in flight at once, and stats()'s
+                      request_pool_high_water says by how much
+        max_pending: how many gets and sets can wait for a connection to
+                     each server, for each loop. Past that, new ones fail
+                     straight away with an OverloadError, unless there are
+                     BULK ones waiting that INTERACTIVE ones can take the
+                     place of
+        replicas: how many servers each key is set on: the one that it
+                  hashes to, and then the next ones around the ketama ring.
+                  Only the first one's response is waited for
+        hedge_delay: with replicas, if a get for a single key hasn't been
+                     answered after this many milliseconds, it's sent to the
+                     second server too, and whichever answers first wins.
+                     'auto' uses the 95th percentile of recent gets'
+                     latencies, and None never does
+        write_behind: if it's given, set(wait=False) only buffers the set
+                      in its event loop, where a newer set of the same key
+                      replaces it, and the buffer is sent as a batch of
+                      noreply sets at most this many milliseconds later.
+                      flush() sends it straight away and waits for it
+        write_behind_bytes: with write_behind, the buffer is also sent as
+                            soon as it holds this many bytes (for each loop)
         """
 
-        _memcev._MemcevClient.__init__(self)
+        # until the event loop is running there's nothing for close() to do
+        self._closed = True
 
-        self.host = host
-        self.port = port
-        self.size = size
+        if size is not None:
+            min_size = max_size = size
+
+        # the event loops take it in seconds, or -1 to work it out
+        if hedge_delay == 'auto':
+            hedge_seconds = -1
+        elif hedge_delay is None:
+            hedge_seconds = 0
+        elif hedge_delay > 0:
+            hedge_seconds = hedge_delay / 1000.0
+        else:
+            raise ValueError("hedge_delay must be positive, 'auto' or None")
+
+        if write_behind is not None and write_behind <= 0:
+            raise ValueError("write_behind must be positive or None")
+
+        _memcev._MemcevClient.__init__(self,
+                                       pipeline_depth=pipeline_depth,
+                                       queue_size=queue_size,
+                                       min_connections=min_size,
+                                       max_connections=max_size,
+                                       idle_timeout=idle_timeout,
+                                       compress_threshold=compress_threshold or 0,
+                                       cache_size=cache_size,
+                                       cache_ttl=cache_ttl,
+                                       request_pool=request_pool,
+                                       max_pending=max_pending,
+                                       replicas=replicas,
+                                       hedge_delay=hedge_seconds,
+                                       write_behind=(write_behind or 0) / 1000.0,
+                                       write_behind_bytes=write_behind_bytes,
+                                       loops=loops)
+
+        if isinstance(host, (list, tuple)):
+            assert port is None, "the port goes in the server list"
+            self.servers = [_Server.parse(spec) for spec in host]
+        elif host.startswith('unix:'):
+            assert port is None, "Unix sockets don't have ports"
+            self.servers = [_Server.parse(host)]
+        else:
+            self.servers = [_Server(host, port)]
+
+        if not self.servers:
+            raise ValueError("no servers")
+
+        self.min_size = min_size
+        self.max_size = max_size
+        self.cache_size = cache_size
+        self.loops = loops
+        self.pipeline_depth = pipeline_depth
+        self.write_behind = write_behind
+
+        # all communication with the event loop is done by handing requests
+        # to C with self._submit, which refers to servers by their index here
+        self._set_servers([(server.host, server.port)
+                           for server in self.servers])
+        self._ketama_build([(server.name, server.weight)
+                            for server in self.servers])
 
         # makes multiple calls to close() idempotent
         self._closed = False
 
-        # all communication with the event loop is done via this queue by
-        # inserting work tuples. A work tuple consists in a string, a response
-        # Queue, and then any arguments to the command. Any changes here must be
-        # paid with a call to self.notify()
-        self.requests = deque()
-
-        # we'll encase our connections in a queue to easily use it as a
-        # list/semaphore at the same time. Any changes here must be paid with a
-        # call to self.notify()
-        self.connections = Queue()
-
-        # the actual thread that runs the event loop
-        self.thread = threading.Thread(name="_memcev._MemcevClient.start",
-                                       target=self.start)
-        self.thread.daemon = debug
-        self.thread.start()
+        # the actual threads that run the event loops
+        self.threads = []
+        for loop in range(loops):
+            thread = threading.Thread(name="_memcev._MemcevClient.start",
+                                      target=self.start, args=(loop,))
+            thread.daemon = debug
+            thread.start()
+            self.threads.append(thread)
 
         # make sure all of our machinery is running
         self.check()
 
-        # connections will be built and connected by the eventloop thread, so
-        # make sure that the first thing that he does when he comes up is
-        # connect to them
-        for x in range(self.size):
-
-            # a better algorithm here is to start by establishing one connection
-            # to check for reachability, and establish all of the other ones
-            # lazily, up to self.size. Often you also want to close them over
-            # time if your steady-state is a smaller number. But here we'll just
-            # make a fixed pool for simplicity
-
-            try:
-                self._simple_request('connect', tags='connected')
-            except Exception:
-                # raise an exception of any of these fail to connect
-                self.close()
-                raise
+        # connections will be built and connected by the eventloop threads, so
+        # make sure that the first thing that they do when they come up is
+        # connect to them. Each loop opens its own, and they're all started at
+        # once, from the addresses that _set_servers resolved, and this also
+        # proves that they're reachable. Any more that we need are opened by
+        # the event loop when requests are waiting for them, and closed again
+        # when they've been idle for a while
+        connects = self._submit_future([(server, None, None)
+                                        for server in range(len(self.servers))
+                                        for x in range(self.min_size)],
+                                       'connect', 'connected',
+                                       lambda responses: None)
+        try:
+            connects.result()
+        except Exception:
+            # raise an exception of any of these fail to connect
+            self.close()
+            raise
 
     def check(self):
         "make sure that the event loop stuff all works started successfully"
-        return self._simple_request('check', timeout=10, tags='checked')
+        return self._simple_request('check', timeout=10000, tags='checked')
 
     def __repr__(self):
-        return "%s(%r, %r)" % (self.__class__.__name__,
-                               self.host,
-                               self.port)
+        if len(self.servers) == 1:
+            return "%s(%r, %r)" % (self.__class__.__name__,
+                                   self.servers[0].host,
+                                   self.servers[0].port)
+        return "%s(%r)" % (self.__class__.__name__,
+                           [server.name for server in self.servers])
 
     def __del__(self):
         # calling this isn't strictly necessary but can help speed up the
         # disconnection process
-        if self.requests:
-            print 'Warning: stopping %r with %d requests remaining' % (self, len(self.requests))
         self.close()
         # super's dealloc is always called
 
-    def _handle_work(self):
-        # somebody told our C client that there is work to be done in the
-        # self.requests queue by calling self.notify() and he's asking us to
-        # check on it. Because of libev event coallescing there may be several
-        # items, or none, so we make it safe to have multiple outstanding
-        # notifies
-        while not self._closed:
-            try:
-                work = self.requests.popleft()
-            except IndexError:
-                # no work to do, exit and move on
-                return
-
-            tag = work[0]
-            queue = work[1]
-            args = work[2:]
-
-            try:
-                self.__handle_work(tag, queue, args)
-            except StopIteration:
-                return
-            except Exception as e:
-                # if we hit an error in that function, which should never happen
-                # except due to bugs, we can try to propagate it out into the
-                # calling queue if there is one
-                if not queue:
-                    raise
-
-                # let the empty queue exception get bubbled back into C
-                queue.put_nowait(('error', e))
-
-    def __handle_work(self, tag, queue, args):
-        # handle a single work item
-        if tag == 'check':
-            assert not args
-
-            # should we do this check in C to verify that that machinery works
-            # too?
-            if queue:
-                queue.put(('checked',))
-
-            return
-
-        elif tag == 'connect':
-            assert not args
-
-            # call out to C to start the process
-            self._connect(self.host, self.port,
-                          partial(self._notify_connected, queue))
-
-            return
+    def _simple_request(self, tag, server=-1, body=None,
+                        wait=True, timeout=None, tags=None):
+        # submit a request and wait for the event loop to finish it. Requests
+        # for a server need its index, and gets and sets need their body
+        # already encoded in the memcached protocol. timeout is in
+        # milliseconds
+        if timeout is None:
+            timeout = self.timeout
 
-        elif tag == 'stop':
-            assert not args
+        waiter = _memcev._MemcevWaiter() if wait else None
 
-            self.stop()
+        # requests that aren't for a key are done by every loop, and each of
+        # them answers
+        count = self._submit(tag, server, body, waiter, None, timeout / 1000.0)
 
-            if queue:
-                queue.put(('stopped',))
-
-            # we can't handle any more work without hanging
-            raise StopIteration
-
-        elif tag not in ('get', 'set'):
-            raise Exception("Unknown tag %r" % (tag,))
+        if wait:
+            # the event loop enforces the timeout for requests that it's
+            # handling, so this is only in case it isn't running at all
+            for x in range(count):
+                response = self._get_response(waiter, timeout / 1000.0 + 1, tags)
+            return response
 
-        # those are the only commands that can be done without a connection,
-        # so next step is to get one
+    @classmethod
+    def _get_response(cls, waiter, timeout, tags=None):
+        # wait for a single response on a waiter that we passed to _submit,
+        # and raise it if it's an error
+        response = waiter.wait(timeout)
+        if response is None:
+            raise TimeoutError("Timed out waiting for a response")
 
-        try:
-            connection = self.connections.get_nowait()
-        except Empty:
-            # no connections available, just put the work tuple back where
-            # we found it. when the next person finishes, we'll get called
-            # again
-
-            # n.b. there is a subtle request scheduling/ordering issue here
-            # with request scheduling that can happen if we are pre-empted. We
-            # popped from the left of the deque, and if we didn't find any
-            # connections to use we pushed it back on the left where we found
-            # it, right? But if we've been pre-empted by another thread who
-            # called popleft in the mean time, it's possible that we aren't
-            # doing the work in exactly the order that we received it. This is
-            # a small enough issue and since we're trying not to block here
-            # it's not really worth solving; but if it leads to starvation or
-            # something in practise it could be solved at a mild performance
-            # cost by wrapping the get-check-return operation in a mutex
-            self.requests.appendleft((tag, queue) + args)
-            return
+        return cls._check_response(response, tags)
 
-        # it's very important that the callback functions here (1) are called
-        # and (2) free up the connection when we're done. Exceptions thrown
-        # here are bad because we can't know how much of the work they did
-        # (did they start using the connection? is it in a good state? can we
-        # put it back in the connections queue?). So there needs to be effort
-        # done to make sure that they can't throw any, since that exception
-        # will occur in another thread where we can't get to it
-
-        if tag == 'get':
-            key, = args
-
-            return self._getset_request(connection,
-                                        self._build_get_request(key),
-                                        partial(self._parse_get_response, key), '',
-                                        partial(self._notify_getset, queue, connection))
-
-        elif tag == 'set':
-            key, value, expire = args
-
-            return self._getset_request(connection,
-                                        self._build_set_request(key, value, expire),
-                                        partial(self._parse_set_response, key), '',
-                                        partial(self._notify_getset, queue, connection))
-
-    def _send_request(self, *a):
-        # validate and send a request to the event loop
-
-        # make sure they're valid work tuples. We'd much rather bail here than
-        # in the thread where the eventloop can't respond
-        assert len(a) >= 2
-        assert isinstance(a[0], str)
-        assert a[1] is None or isinstance(a[1], Queue)
-
-        self.requests.append(a)
-        self.notify()
-
-    def _simple_request(self, *a, **kw):
-        # we communicate via a queue, so this tries to wrap that behaviour to
-        # make it simpler
-
-        # mixing *a and regular kw args can be a pain
-        wait = kw.pop('wait', True)
-        timeout = kw.pop('timeout', self.timeout)
-        tags = kw.pop('tags', None)
+    @staticmethod
+    def _check_response(response, tags=None):
+        # raise the response if it's an error, or return it if it's what we
+        # were expecting
         if isinstance(tags, str):
             # in the common case there's only one allowed response type, so
             # remove the tuple boiler plate where possible
             tags = (tags,)
-        assert not kw
 
-        q = Queue() if wait else None
+        tag = response[0]
 
-        self._send_request(a[0], q, *a[1:])
+        if tag == 'error':
+            # we can either get real exception objects or just strings
+            if isinstance(response[1], Exception):
+                raise response[1]
+            else:
+                raise Exception(response[1])
 
-        if wait:
-            response = q.get(timeout=timeout)
-            tag = response[0]
-
-            if tag == 'error':
-                # we can either get real exception objects or just strings
-                if isinstance(response[1], Exception):
-                    raise response[1]
-                else:
-                    raise Exception(response[1])
-
-            if tags and tag not in tags:
-                raise Exception("Unexpected tag %r in %r" % (tag, response))
-
-            return response
-
-    @staticmethod
-    def _valid_key(key, valid_re = re.compile('^[a-zA-Z0-9]{1,250}$')):
-        # Make sure the key is a valid memcached key
+        if tags and tag not in tags:
+            raise Exception("Unexpected tag %r in %r" % (tag, response))
 
-        # this isn't actually the valid set of memcached keys, in actuality
-        # the valid set of characters is everything *except*:
+        return response
 
-        # null (0x00)
-        # space (0x20)
-        # tab (0x09)
-        # newline (0x0a)
-        # carriage-return (0x0d)
-
-        # but since this is just a toy library I'm optimising for debugging
-        # ease and this makes it easier to type and read them for now
-
-        return isinstance(key, str) and valid_re.match(key)
+    def stats(self):
+        """
+        counters about what the event loop has been doing, as a dict. It's a
+        snapshot taken while the loops keep running, so it's cheap enough to
+        scrape regularly. 'latency' has a summary of how long gets and sets
+        took, split into queue (waiting to be written), wire (from being
+        written to having the response) and total, and 'servers' has a dict
+        of counters for each server
+        """
+        stats = self._stats()
+        stats['compression_saved_bytes'] = (stats['bytes_before_compression']
+                                            - stats['bytes_after_compression'])
+        stats['latency'] = dict((name, _latency_summary(*histogram))
+                                for name, histogram in stats['latency'].items())
+        for server, counters in zip(self.servers, stats['servers']):
+            counters['name'] = server.name
+        return stats
 
     def close(self):
         """
@@ -273,131 +426,153 @@ class Client(_memcev._MemcevClient):
         if self._closed:
             return
 
-        self._simple_request('stop', tags='stopped')
-        self.thread.join()
-        del self.thread
+        if self.write_behind:
+            # give whatever is still buffered its chance to get out. If it
+            # can't then there's nobody left to tell
+            try:
+                self.flush()
+            except IOError:
+                pass
+
+        try:
+            self._simple_request('stop', tags='stopped')
+        except IOError:
+            # somebody already called stop()
+            pass
+        for thread in self.threads:
+            thread.join()
+        del self.threads
         self._closed = True
 
-    def set(self, key, value, expire=0, wait=True):
+    def set(self, key, value, expire=0, wait=True, priority=BULK):
         "Set the given key with the given value into memcached"
 
-        if not self._valid_key(key) or len(key) > 250:
-            raise ValueError("Invalid key: %r" % (key,))
+        if not wait:
+            # nobody is going to hear about the result, so don't even ask for
+            # it. With write_behind it may not even be sent for a while
+            self._submit_set(key, value, expire, None, self.timeout / 1000.0,
+                             priority, bool(self.write_behind))
+            self._cache_invalidate(key)
+            return
 
-        if not isinstance(value, str) or len(value) > 1024*1024:
-            raise ValueError("values must be strings of len<=1mb")
+        return self.set_async(key, value, expire, priority).result()
 
-        return self._simple_request('set', key, value, expire, wait=wait, tags='setted')
+    def flush(self):
+        """
+        Send every set that write_behind is holding onto, and wait until they
+        and the ones that were already on their way have all been done,
+        raising if any of them failed
+        """
+        self._simple_request('flush', tags='flushed')
 
-    def get(self, key):
+    def get(self, key, priority=INTERACTIVE):
         "Get the given key from memcached and return it, or None if it's not present"
 
-        if not self._valid_key(key):
-            raise ValueError("Invalid key: %r" % (key,))
-
-        tag, key, value = self._simple_request('get', key, tags='getted')
-
-        return value
-
-    def _notify_connected(self, response_q, result_tuple):
-        # Callback function called on the event loop thread after a connection
-        # has been attempted. Note that this may be a success or failure message
-
-        if result_tuple[0] == 'connected':
-            tag, connection = result_tuple
-            self.connections.put(connection)
+        return self.get_async(key, priority).result()
 
-        if response_q:
-            response_q.put(result_tuple)
-
-        self.notify()
-
-    def _notify_getset(self, response_q, connection, result_tuple):
-        # Callback function called on the event loop thread after a get or set
-        # has been attempted
-        if response_q:
-            response_q.put(result_tuple)
-
-        self.connections.put(connection)
-
-        self.notify()
-
-    @staticmethod
-    def _check_server_errors(body):
-        if body == 'ERROR\r\n':
-            raise Exception('Unknown error from server')
-
-        m = re.match('CLIENT_ERROR (.*)\r\n', body)
-        if m:
-            raise Exception("Client error: %s" % m.group(1))
-
-        m = re.match('SERVER_ERROR (.*)\r\n', body)
-        if m:
-            raise Exception("Server error: %s" % m.group(1))
-
-    @classmethod
-    def _build_get_request(cls, key):
-        assert cls._valid_key(key)
-        request = 'get %s\r\n' % (key,)
-        return request
-
-    @classmethod
-    def _parse_get_response(cls, key, acc, newdata):
-        # parse a response from a GET request. May be a partial response. return
-        # a tuple of one of:
-        #   (True, response)
-        #   (False, new accumulator)
-
-        # we're just doing regex matching here rather than any proper parsing.
-        # this works for our limited use case but if we add get_multi or
-        # anything more complicated we'll have to revisit
-
-        # acc starts as ''
-        received_so_far = acc + newdata
-
-        try:
-            cls._check_server_errors(received_so_far)
-        except Exception as e:
-            return True, ('error', e)
-
-        # these will need to be changed if we support get_multi in the future
+    def get_multi(self, keys, priority=INTERACTIVE):
+        """
+        Get all of the given keys from memcached, returning a dict of the ones
+        that are present
+        """
 
-        if received_so_far == 'END\r\n':
-            return True, ('getted', key, None)
+        return self.get_multi_async(keys, priority).result()
 
-        m = re.match(r'VALUE ([^ ]+) ([^ ]+) ([0-9]+)\r\n(.*)\r\nEND\r\n', received_so_far)
+    def set_async(self, key, value, expire=0, priority=BULK):
+        """
+        Start setting the given key with the given value into memcached,
+        returning a Future for when it's done. The value can be a string or
+        anything else that supports the buffer protocol, and mustn't be
+        changed until the Future is done. While connections are busy, BULK
+        requests wait behind INTERACTIVE ones
+        """
 
-        if not m:
-            return False, received_so_far
+        waiter = _memcev._MemcevWaiter()
+        count = self._submit_set(key, value, expire, waiter,
+                                 self.timeout / 1000.0, priority)
 
-        rkey = m.group(1)
-        #rflags = m.group(2)
-        byteslen = int(m.group(3))
-        payload = m.group(4)
+        # our own sets replace whatever's in the near cache straight away.
+        # Gets that were already running when it started might bring the old
+        # value back, so we forget it again once it's done too
+        self._cache_invalidate(key)
 
-        if len(payload) != byteslen:
-            # we're not done, this is a coincidence
-            return False, received_so_far
+        def finish(responses):
+            self._cache_invalidate(key)
 
-        return True, ('getted', rkey, payload)
+        return Future(self, waiter, count, 'setted', finish)
 
-    @classmethod
-    def _build_set_request(cls, key, value, expiration):
-        assert cls._valid_key(key)
+    def get_async(self, key, priority=INTERACTIVE):
+        """
+        Start getting the given key from memcached, returning a Future for its
+        value (or None if it's not present). While connections are busy,
+        BULK requests wait behind INTERACTIVE ones
+        """
 
-        return "set %s 0 %d %d\r\n%s\r\n" % (key, expiration, len(value), value)
+        found, missing, generation = self._cache_lookup([key])
+        if found:
+            # the near cache had it, so there's no need to bother the event
+            # loop at all
+            return Future(self, None, 0, 'getted', lambda responses: found[key])
 
-    @classmethod
-    def _parse_set_response(cls, key, acc, newdata):
-        received_so_far = acc + newdata
+        def finish(responses):
+            values = responses[0][1]
+            self._cache_fill(values, generation)
+            return values.get(key)
 
-        try:
-            cls._check_server_errors(received_so_far)
-        except Exception as e:
-            return True, ('error', e)
+        waiter = _memcev._MemcevWaiter()
+        count = self._submit_get([key], waiter, self.timeout / 1000.0, -1,
+                                 priority)
+        return Future(self, waiter, count, 'getted', finish)
 
-        # the only valid response
-        if received_so_far == 'STORED\r\n':
-            return True, ('setted',)
+    def get_multi_async(self, keys, priority=INTERACTIVE):
+        """
+        Start getting all of the given keys from memcached, returning a Future
+        for a dict of the ones that are present
+        """
 
-        return False, received_so_far
+        # only the ones that the near cache doesn't have need to go to the
+        # servers. Splitting them up by the server and the event loop that
+        # they live on checks that they're all valid before we send any of
+        # them, and keeps each get behind any sets of its keys that are
+        # still on their way
+        found, keys, generation = self._cache_lookup(list(set(keys)))
+        by_server = self._split_keys(keys)
+
+        waiter = _memcev._MemcevWaiter()
+        count = 0
+
+        for (server, loop), server_keys in by_server.iteritems():
+            # memcached can send back any number of keys in one round trip, so
+            # we only split them up further when there are enough that it's
+            # worth fetching the pieces in parallel over different connections
+            chunks = max(1, min(self.max_size,
+                                len(server_keys) // self.get_multi_chunk_size))
+            chunk_size = -(-len(server_keys) // chunks) # rounding up
+
+            for x in range(0, len(server_keys), chunk_size):
+                count += self._submit_get(server_keys[x:x+chunk_size], waiter,
+                                          self.timeout / 1000.0, server,
+                                          priority)
+
+        def gather(responses):
+            ret = {}
+            for tag, values in responses:
+                ret.update(values)
+            self._cache_fill(ret, generation)
+            ret.update(found)
+            return ret
+
+        return Future(self, waiter, count, 'getted', gather)
+
+    def _submit_future(self, requests, tag, tags, finish):
+        # submit a list of (server, body, value) requests that all share a
+        # waiter, which hands their responses back in whatever order they
+        # finish. finish turns the list of them into the Future's result
+        waiter = _memcev._MemcevWaiter()
+        count = 0
+
+        for server, body, value in requests:
+            count += self._submit(tag, server, body, waiter, value,
+                                  self.timeout / 1000.0)
+
+        return Future(self, waiter, count, tags, finish)
@@ -1,16 +1,112 @@
 #!/usr/bin/env python2.7
 
+import bisect
+import hashlib
+import json
+import os
+import socket
+import struct
+import tempfile
 import time
+import threading
 import unittest
+import zlib
 
-from memcev import Client
+import _memcev
+from memcev import (Client, TimeoutError, OverloadError, INTERACTIVE, BULK,
+                    wait_all, benchmark)
+
+class FakeMemcached(object):
+    """
+    Just enough of a memcached to answer gets with misses (after delay
+    seconds), or with whatever response it's given, which can be made to
+    hang up on all of its clients, or to go away and come back. active is
+    how many clients are connected, gets is how many gets it's been sent and
+    keys is what they were for, in order
+    """
+
+    def __init__(self, delay=0, host='127.0.0.1', family=socket.AF_INET,
+                 response='END\r\n'):
+        self.host = host
+        self.family = family
+        self.port = 0
+        self.delay = delay
+        self.response = response
+        self.active = 0
+        self.gets = 0
+        self.keys = []
+        self.lock = threading.Lock()
+        self.start()
+
+    def start(self):
+        self.clients = []
+        self.listener = socket.socket(self.family)
+        if self.family == socket.AF_UNIX:
+            if os.path.exists(self.host):
+                os.unlink(self.host)
+            self.listener.bind(self.host)
+        else:
+            self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            self.listener.bind((self.host, self.port))
+            self.port = self.listener.getsockname()[1]
+        self.listener.listen(50)
+        self.spawn(self.accept, self.listener)
+
+    @staticmethod
+    def spawn(target, *args):
+        thread = threading.Thread(target=target, args=args)
+        thread.daemon = True
+        thread.start()
+
+    def accept(self, listener):
+        while True:
+            try:
+                conn, addr = listener.accept()
+            except socket.error:
+                return
+            self.clients.append(conn)
+            self.spawn(self.serve, conn)
+
+    def serve(self, conn):
+        with self.lock:
+            self.active += 1
+        try:
+            for line in iter(conn.makefile().readline, ''):
+                if line.startswith('get '):
+                    with self.lock:
+                        self.gets += 1
+                        self.keys.append(line[4:].strip())
+                    time.sleep(self.delay)
+                    conn.sendall(self.response)
+        except socket.error:
+            pass
+        finally:
+            with self.lock:
+                self.active -= 1
+
+    def drop(self):
+        for conn in self.clients:
+            try:
+                conn.shutdown(socket.SHUT_RDWR)
+            except socket.error:
+                # the client already hung up
+                pass
+            conn.close()
+        self.clients = []
+
+    def stop(self):
+        # shutting it down is what wakes up accept()
+        self.listener.shutdown(socket.SHUT_RDWR)
+        self.listener.close()
+        self.drop()
 
 class TestMemcev(unittest.TestCase):
     def setUp(self):
         try:
             self.client = Client('localhost', 11211)
         except:
-            print "tests need memcached running on localhost:11211"
+            print ("tests need memcached (or python -m memcev.fakememcached)"
+                   " running on localhost:11211")
             raise
 
     def tearDown(self):
@@ -23,7 +119,28 @@ class TestMemcev(unittest.TestCase):
     def test_check_fails(self):
         # make sure that check actually proves that the queueing machinery works
         self.client.stop()
-        self.assertRaises(Exception, self.client.check())
+        self.assertRaises(Exception, self.client.check)
+
+    def test_waiter(self):
+        waiter = _memcev._MemcevWaiter()
+        self.assertEqual(waiter.wait(0.01), None)
+        self.client._submit('check', -1, None, waiter)
+        self.assertEqual(waiter.wait(1), ('checked',))
+
+        # nobody ever collects these, which the event loop mustn't mind
+        waiter = _memcev._MemcevWaiter()
+        for x in range(10):
+            self.client._submit('get', 0, 'get abandoned\r\n', waiter)
+        del waiter
+        self.assertEqual(self.client.get('abandoned'), None)
+
+        # and plain callbacks still work too
+        results = []
+        done = threading.Event()
+        self.client._submit('check', -1, None,
+                            lambda result: (results.append(result), done.set()))
+        done.wait(1)
+        self.assertEqual(results, [('checked',)])
 
     def test_get_missing(self):
         self.assertEqual(self.client.get('doesntexist'), None)
@@ -36,10 +153,842 @@ class TestMemcev(unittest.TestCase):
         self.client.set('empty', '')
         self.assertEqual(self.client.get('empty'), '')
 
+    def test_set_large(self):
+        # big enough that it has to come back over many recv() calls
+        value = ''.join(chr(x % 256) for x in range(1024*1024))
+        self.client.set('large', value)
+        self.assertEqual(self.client.get('large'), value)
+
+    def test_set_buffers(self):
+        # anything with a buffer can be set, big or small
+        for value in ['small', 'x' * 100000]:
+            self.client.set('buf1', bytearray(value))
+            self.client.set('buf2', memoryview(value))
+            self.client.set('buf3', memoryview(value), wait=False)
+            self.assertEqual(self.client.get_multi(['buf1', 'buf2', 'buf3']),
+                             {'buf1': value, 'buf2': value, 'buf3': value})
+        self.assertRaises(ValueError, lambda: self.client.set('foo', u'unicode'))
+
+    def test_get_multi_large(self):
+        # several big values in one response, each of which is read straight
+        # into its own string, mixed in with small ones that aren't
+        values = dict(('large%d' % x, chr(ord('a') + x) * (50000 * x + 1))
+                      for x in range(6))
+        for key, value in values.iteritems():
+            self.client.set(key, value)
+        self.assertEqual(self.client.get_multi(values.keys()), values)
+        self.assertEqual(wait_all([self.client.get_async(key) for key in values]),
+                         [self.client.get(key) for key in values])
+
+    def test_partial_writes(self):
+        # far more than the socket will take at once, all on one connection,
+        # so the requests have to be streamed out in pieces as it drains
+        c = Client('localhost', 11211, size=1)
+        try:
+            values = dict(('partial%d' % x, chr(ord('a') + x) * (1024*1024 - x))
+                          for x in range(16))
+            futures = [c.set_async(key, value) for key, value in values.iteritems()]
+            futures += [c.set_async('partialsmall%d' % x, str(x)) for x in range(100)]
+            wait_all(futures, 30)
+
+            self.assertEqual(c.get_multi(values.keys()), values)
+            self.assertEqual(c.get('partialsmall99'), '99')
+        finally:
+            c.close()
+
+    def test_timeouts(self):
+        # a server that accepts connections but never answers, so everything
+        # sent to it has to be timed out, and the connections replaced
+        silent = socket.socket()
+        silent.bind(('127.0.0.1', 0))
+        silent.listen(50)
+        c = Client('127.0.0.1', silent.getsockname()[1], size=1, pipeline_depth=2)
+        try:
+            c.timeout = 100
+            start = time.time()
+            futures = [c.get_async('timeout%d' % x) for x in range(10)]
+            for future in futures:
+                self.assertRaises(TimeoutError, future.result)
+            self.assertRaises(TimeoutError, lambda: c.get('timeout'))
+            self.assert_(time.time() - start < 2)
+
+            # cancelling doesn't have to wait for the deadline
+            c.timeout = 60000
+            future = c.get_async('cancelled')
+            self.assertRaises(TimeoutError, lambda: future.result(0.01))
+            start = time.time()
+            future.cancel()
+            self.assertRaises(IOError, future.result)
+            self.assert_(time.time() - start < 1)
+
+            # and the replacement connections still work
+            c.check()
+        finally:
+            c.close()
+            silent.close()
+
+    def test_reconnect(self):
+        server = FakeMemcached()
+        c = Client('127.0.0.1', server.port, size=2)
+        try:
+            self.assertEqual(c.get('reconnect'), None)
+
+            # connections that the server hangs up on are replaced before
+            # anybody has to notice
+            server.drop()
+            time.sleep(0.1)
+            self.assertEqual(c.get_multi(['reconnect%d' % x for x in range(10)]), {})
+
+            # while it's down everything fails quickly instead of waiting
+            server.stop()
+            time.sleep(0.1)
+            start = time.time()
+            self.assertRaises(IOError, lambda: c.get('reconnect'))
+            self.assert_(time.time() - start < 1)
+
+            # and when it comes back we find it again by ourselves
+            server.start()
+            deadline = time.time() + 5
+            while True:
+                try:
+                    self.assertEqual(c.get('reconnect'), None)
+                    break
+                except IOError:
+                    if time.time() > deadline:
+                        raise
+                    time.sleep(0.05)
+        finally:
+            c.close()
+            server.stop()
+
+    def test_elastic_pool(self):
+        server = FakeMemcached(delay=0.02)
+        c = Client('127.0.0.1', server.port, min_size=1, max_size=4,
+                   pipeline_depth=1, idle_timeout=0.2)
+        try:
+            time.sleep(0.05)
+            self.assertEqual(server.active, 1)
+
+            # more than one connection can keep up with, so the pool grows,
+            # but never past max_size
+            futures = [c.get_async('elastic%d' % x) for x in range(40)]
+            self.assertEqual(wait_all(futures, 5), [None] * 40)
+            self.assertEqual(server.active, 4)
+
+            # and once they've been idle for a while it shrinks back
+            time.sleep(0.5)
+            self.assertEqual(server.active, 1)
+            self.assertEqual(c.get('elastic'), None)
+
+            # results can still be collected after the connections that they
+            # came back on have been closed
+            futures = [c.get_async('elastic%d' % x) for x in range(40)]
+            time.sleep(1)
+            self.assertEqual(server.active, 1)
+            self.assertEqual([future.result() for future in futures], [None] * 40)
+        finally:
+            c.close()
+            server.stop()
+
+        self.assertRaises(ValueError,
+                          lambda: Client('localhost', 11211, min_size=2, max_size=1))
+
+    def test_single_flight(self):
+        server = FakeMemcached(delay=0.2)
+        c = Client('127.0.0.1', server.port)
+        try:
+            # a stampede for the same key only goes to the server once
+            futures = [c.get_async('stampede') for x in range(50)]
+            self.assertEqual(wait_all(futures), [None] * 50)
+            self.assertEqual(server.gets, 1)
+            self.assertEqual(c.stats()['coalesced_gets'], 49)
+
+            # the others don't give up when the one that they're following
+            # does
+            futures = [c.get_async('stampede') for x in range(3)]
+            futures[0].cancel()
+            futures[1].cancel()
+            self.assertEqual(futures[2].result(), None)
+            self.assertRaises(IOError, futures[0].result)
+            self.assertRaises(IOError, futures[1].result)
+        finally:
+            c.close()
+            server.stop()
+
+    def test_multi_loop(self):
+        c = Client('localhost', 11211, loops=4)
+        try:
+            self.assertEqual(len(c.threads), 4)
+            c.check()
+
+            # keys are spread over the loops, but each one is still set and
+            # got in order
+            keys = ['loops%d' % x for x in range(200)]
+            for key in keys:
+                c.set(key, key)
+                self.assertEqual(c.get(key), key)
+            self.assertEqual(c.get_multi(keys), dict((key, key) for key in keys))
+
+            wrong = []
+            def hammer(n):
+                for x in range(100):
+                    key = 'loops%d' % ((n * 100 + x) % 200)
+                    if c.get(key) != key:
+                        wrong.append(key)
+            threads = [threading.Thread(target=hammer, args=(n,)) for n in range(8)]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+            self.assertEqual(wrong, [])
+        finally:
+            c.close()
+        self.assertRaises(IOError, c.check)
+
+        # a get_multi is split up by loop too, so it can't overtake the sets
+        # of its keys that were sent just before it (with one connection per
+        # loop, so that nothing else can reorder them)
+        c = Client('localhost', 11211, size=1, loops=4)
+        try:
+            stamp = str(time.time())
+            for key in keys:
+                c.set(key, key + stamp, wait=False)
+            self.assertEqual(c.get_multi(keys),
+                             dict((key, key + stamp) for key in keys))
+            self.assertRaises(ValueError,
+                              lambda: c._submit_get(keys, None, 1.0, 0))
+        finally:
+            c.close()
+
+        # each loop has its own connections
+        server = FakeMemcached()
+        c = Client('127.0.0.1', server.port, size=2, loops=3)
+        try:
+            time.sleep(0.05)
+            self.assertEqual(server.active, 6)
+        finally:
+            c.close()
+            server.stop()
+
+    def test_ipv6_startup(self):
+        server = FakeMemcached(host='::1', family=socket.AF_INET6)
+        c = Client(['[::1]:%d' % server.port], min_size=3, max_size=3)
+        try:
+            # the whole pool is connected by the time we get it back (give
+            # the server a moment to notice)
+            time.sleep(0.05)
+            self.assertEqual(server.active, 3)
+            self.assertEqual(c.get('ipv6'), None)
+
+            # another client for the same server uses the addresses that the
+            # first one resolved
+            c2 = Client('::1', server.port)
+            self.assertEqual(c2.get('ipv6'), None)
+            c2.close()
+        finally:
+            c.close()
+            server.stop()
+
+    def test_unix_socket(self):
+        path = os.path.join(tempfile.mkdtemp(), 'memcached.sock')
+        server = FakeMemcached(host=path, family=socket.AF_UNIX)
+        c = Client('unix:' + path, min_size=2)
+        try:
+            time.sleep(0.05)
+            self.assertEqual(server.active, 2)
+            self.assertEqual(c.get_multi(['unix%d' % x for x in range(100)]), {})
+
+            # and they reconnect like any other
+            server.drop()
+            time.sleep(0.1)
+            self.assertEqual(c.get('unix'), None)
+        finally:
+            c.close()
+            server.stop()
+            os.unlink(path)
+            os.rmdir(os.path.dirname(path))
+
+        self.assertRaises(IOError, lambda: Client('unix:' + path))
+
+    def test_value_looks_like_protocol(self):
+        # the payload is read by its declared length, not by looking for END
+        value = 'END\r\nVALUE foo 0 3\r\nbar\r\nEND\r\n'
+        self.client.set('tricky', value)
+        self.assertEqual(self.client.get('tricky'), value)
+
+    def test_malformed_value(self):
+        # the declared length has to be one that we can trust to find the end
+        # of the payload with, so anything else fails the connection
+        for line in ['VALUE k 0 -2', 'VALUE k 0 +3', 'VALUE k 0 ',
+                     'VALUE k 0 18446744073709551615', 'VALUE k 0 %d' % (2 * 1024 * 1024),
+                     'VALUE k -1 3', 'VALUE k 4294967296 3']:
+            server = FakeMemcached(response=line + '\r\nabc\r\nEND\r\n')
+            c = Client('127.0.0.1', server.port, size=1)
+            try:
+                self.assertRaisesRegexp(Exception, 'Malformed VALUE line', c.get, 'k')
+            finally:
+                c.close()
+                server.stop()
+
+    @staticmethod
+    def raw_get(key):
+        # what the server really has, as (flags, value), without the client
+        # getting in the way
+        sock = socket.create_connection(('localhost', 11211))
+        try:
+            sock.sendall('get %s\r\n' % key)
+            response = ''
+            while not response.endswith('END\r\n'):
+                response += sock.recv(65536)
+        finally:
+            sock.close()
+        header, rest = response.split('\r\n', 1)
+        flags, length = map(int, header.split()[2:4])
+        return flags, rest[:length]
+
+    def test_compression(self):
+        c = Client('localhost', 11211, compress_threshold=100)
+        try:
+            # one small enough to be copied into the request, and one big
+            # enough to be sent from its own buffer
+            for size in (1000, 50000):
+                value = 'compressible' * size
+                c.set('compressed', value)
+                self.assertEqual(c.get('compressed'), value)
+
+                # it's really stored compressed, in a way that anybody else
+                # can read. Clients without a threshold can read it too
+                flags, stored = self.raw_get('compressed')
+                self.assertEqual(flags, 8)
+                self.assertEqual(zlib.decompress(stored), value)
+                self.assertEqual(self.client.get('compressed'), value)
+
+            # values that are too small or don't shrink are left alone
+            c.set('small', 'x' * 99)
+            self.assertEqual(self.raw_get('small'), (0, 'x' * 99))
+            noise = os.urandom(1000)
+            c.set('noise', noise)
+            self.assertEqual(self.raw_get('noise'), (0, noise))
+            self.assertEqual(c.get_multi(['small', 'noise']),
+                             {'small': 'x' * 99, 'noise': noise})
+
+            stats = c.stats()
+            self.assertEqual(stats['compressed_values'], 2)
+            self.assertEqual(stats['decompressed_values'], 2)
+            self.assertEqual(stats['bytes_before_compression'], 12 * 51000)
+            self.assertTrue(stats['compression_saved_bytes'] > 12 * 50000)
+        finally:
+            c.close()
+
+        # sets that are written behind keep their noreply when they're
+        # compressed
+        c = Client('localhost', 11211, compress_threshold=100, write_behind=1000)
+        try:
+            value = 'behind' * 1000
+            c.set('compressedbehind', value, wait=False)
+            c.flush()
+            flags, stored = self.raw_get('compressedbehind')
+            self.assertEqual((flags, zlib.decompress(stored)), (8, value))
+        finally:
+            c.close()
+
+        # a value that claims to be compressed but isn't is missing, without
+        # losing the rest of the get_multi that it came back with
+        sock = socket.create_connection(('localhost', 11211))
+        sock.sendall('set compressed 8 0 4\r\njunk\r\n')
+        sock.recv(100)
+        sock.close()
+        c = Client('localhost', 11211)
+        try:
+            self.assertEqual(c.get('compressed'), None)
+            self.assertEqual(c.get_multi(['compressed', 'small']),
+                             {'small': 'x' * 99})
+            self.assertEqual(c.stats()['unreadable_values'], 2)
+        finally:
+            c.close()
+
+        # and so is one that inflates to more than we'd ever have compressed
+        huge = zlib.compress('\0' * (2 * 1024 * 1024))
+        sock = socket.create_connection(('localhost', 11211))
+        sock.sendall('set compressed 8 0 %d\r\n%s\r\n' % (len(huge), huge))
+        sock.recv(100)
+        sock.close()
+        self.assertEqual(self.client.get('compressed'), None)
+
+    def test_near_cache(self):
+        c = Client('localhost', 11211, cache_size=1024*1024, cache_ttl=0.2)
+        try:
+            self.client.set('near', 'a')
+            self.assertEqual(c.get('near'), 'a')
+
+            # it's answered from the cache without asking the server, so it
+            # doesn't see other clients' changes until it expires
+            self.client.set('near', 'b')
+            self.assertEqual(c.get('near'), 'a')
+            self.assertEqual(c.get_multi(['near', 'nearmissing']), {'near': 'a'})
+            time.sleep(0.3)
+            self.assertEqual(c.get('near'), 'b')
+
+            # but it does see its own straight away
+            c.set('near', 'c')
+            self.assertEqual(c.get('near'), 'c')
+            c.set('near', 'd', wait=False)
+            self.assertEqual(c.get('near'), 'd')
+
+            stats = c.stats()
+            self.assertEqual(stats['cache_hits'], 2)
+            self.assertEqual(stats['cache_misses'], 5)
+            self.assertEqual(stats['cache_entries'], 1)
+
+            # a get that was on its way while a key was set doesn't fill it
+            # in, but it still fills in the others
+            self.client.set('nearfill', 'e')
+            time.sleep(0.3)
+            future = c.get_multi_async(['near', 'nearfill'])
+            c.set('near', 'f')
+            self.assertEqual(future.result(), {'near': 'd', 'nearfill': 'e'})
+            self.assertEqual(c.get_multi(['near', 'nearfill']),
+                             {'near': 'f', 'nearfill': 'e'})
+            stats = c.stats()
+            self.assertEqual((stats['cache_hits'], stats['cache_misses']), (3, 8))
+        finally:
+            c.close()
+
+        # it's bounded by how much memory it uses, and the least recently
+        # used values go first
+        c = Client('localhost', 11211, cache_size=64*1024, cache_ttl=60)
+        try:
+            for x in range(100):
+                self.client.set('near%d' % x, str(x) * 1000)
+            for x in range(100):
+                c.get('near%d' % x)
+                c.get('near0')
+            stats = c.stats()
+            self.assertTrue(stats['cache_bytes'] <= 64*1024)
+            self.assertTrue(stats['cache_evictions'] > 0)
+
+            self.client.set('near0', 'changed')
+            self.client.set('near1', 'changed')
+            self.assertEqual(c.get_multi(['near0', 'near1']),
+                             {'near0': '0' * 1000, 'near1': 'changed'})
+        finally:
+            c.close()
+
+    def test_stats(self):
+        self.client.set('stats', 'x' * 100)
+        for x in range(10):
+            self.assertEqual(self.client.get('stats'), 'x' * 100)
+
+        stats = self.client.stats()
+        self.assertEqual((stats['gets'], stats['sets'], stats['errors']), (10, 1, 0))
+        self.assertTrue(stats['bytes_received'] > 10 * 100)
+        self.assertTrue(stats['bytes_sent'] > 100)
+        self.assertEqual(stats['servers'][0]['name'], 'localhost:11211')
+        self.assertEqual(stats['servers'][0]['requests'], 11)
+        self.assertEqual(stats['servers'][0]['bytes_received'], stats['bytes_received'])
+
+        for name in ['get_queue', 'get_wire', 'get_total']:
+            latency = stats['latency'][name]
+            self.assertEqual(latency['count'], 10)
+            self.assertEqual(sum(n for limit, n in latency['buckets']), 10)
+            self.assertTrue(0 < latency['p50_ms'] <= latency['p99_ms']
+                            <= latency['p999_ms'] <= latency['max_ms'])
+        self.assertEqual(stats['latency']['set_total']['count'], 1)
+        self.assertTrue(stats['latency']['get_total']['mean_ms']
+                        >= stats['latency']['get_wire']['mean_ms'])
+
+        # with only one connection that takes one request at a time, the rest
+        # have to wait for it, which shows up as queueing rather than time on
+        # the wire
+        server = FakeMemcached(delay=0.02)
+        c = Client('127.0.0.1', server.port, size=1, pipeline_depth=1)
+        c.timeout = 150
+        try:
+            futures = [c.get_async('stats%d' % x) for x in range(10)]
+            for future in futures:
+                try:
+                    future.result(1)
+                except TimeoutError:
+                    pass
+            stats = c.stats()
+            self.assertTrue(stats['pool_exhausted'] > 0)
+            self.assertTrue(stats['timeouts'] > 0)
+            self.assertEqual(stats['errors'], stats['timeouts'])
+            self.assertTrue(stats['latency']['get_queue']['max_ms'] >= 20)
+            self.assertTrue(stats['latency']['get_wire']['max_ms'] < 100)
+            self.assertEqual(stats['latency']['get_total']['count'], 10)
+        finally:
+            c.close()
+            server.stop()
+
+    def test_request_pool(self):
+        c = Client('localhost', 11211, request_pool=4)
+        try:
+            stats = c.stats()
+            self.assertEqual(stats['request_pool_allocated'], 4)
+            self.assertEqual(stats['request_pool_in_use'], 0)
+
+            # it grows to fit however many are in flight at once, and they're
+            # all given back afterwards
+            futures = [c.get_async('pool%d' % x) for x in range(100)]
+            self.assertEqual(wait_all(futures, 5), [None] * 100)
+            stats = c.stats()
+            self.assertTrue(stats['request_pool_allocated'] >= stats['request_pool_high_water'] > 4)
+            self.assertEqual(stats['request_pool_in_use'], 0)
+
+            # and then they're reused instead of it growing again
+            allocated = stats['request_pool_allocated']
+            for x in range(10):
+                wait_all([c.get_async('pool%d' % x) for x in range(50)], 5)
+            self.assertEqual(c.stats()['request_pool_allocated'], allocated)
+
+            # results that nobody has collected yet keep their pool around
+            # after the client has gone
+            waiter = _memcev._MemcevWaiter()
+            c._submit('check', -1, None, waiter)
+            self.assertEqual(waiter.wait(1), ('checked',))
+            c._submit('check', -1, None, waiter)
+            time.sleep(0.1)
+        finally:
+            c.close()
+        del c
+        self.assertEqual(waiter.wait(1), ('checked',))
+
+        self.assertRaises(ValueError,
+                          lambda: Client('localhost', 11211, request_pool=-1))
+
+    def test_priorities(self):
+        server = FakeMemcached(delay=0.05)
+        c = Client('127.0.0.1', server.port, size=1, pipeline_depth=1,
+                   max_pending=4)
+        try:
+            busy = c.get_async('busy')
+            time.sleep(0.02)
+
+            # the queue fills up with bulk work, and then interactive requests
+            # push the newest of it out
+            bulk = [c.get_async('bulk%d' % x, priority=BULK) for x in range(4)]
+            interactive = [c.get_async('interactive%d' % x) for x in range(2)]
+            self.assertRaises(OverloadError, bulk[3].result, 1)
+            self.assertRaises(OverloadError, bulk[2].result, 1)
+
+            # but with nothing to make way, more bulk work is turned away
+            more = c.get_async('more', priority=BULK)
+            self.assertRaises(OverloadError, more.result, 1)
+            self.assertTrue(issubclass(OverloadError, TimeoutError))
+
+            # and the interactive requests went ahead of the bulk ones that
+            # were already waiting
+            self.assertEqual(wait_all([busy] + interactive + bulk[:2], 5), [None] * 5)
+            self.assertEqual(server.keys, ['busy', 'interactive0', 'interactive1',
+                                           'bulk0', 'bulk1'])
+            stats = c.stats()
+            self.assertEqual(stats['overloaded'], 3)
+            self.assertEqual(stats['errors'], 3)
+
+            # something that's still waiting for a connection when its time
+            # runs out is overloaded too
+            c.timeout = 30
+            futures = [c.get_async('late%d' % x) for x in range(2)]
+            self.assertRaises(TimeoutError, futures[0].result, 1)
+            self.assertRaises(OverloadError, futures[1].result, 1)
+        finally:
+            c.close()
+            server.stop()
+
+        # a key's requests stay in order whatever their priorities
+        self.client.set('priorities', 'bulk', wait=False)
+        self.assertEqual(self.client.get('priorities', priority=INTERACTIVE), 'bulk')
+
+        self.assertRaises(ValueError, lambda: self.client.get('priorities', priority=2))
+        self.assertRaises(ValueError,
+                          lambda: Client('localhost', 11211, max_pending=0))
+
+    def test_get_multi(self):
+        self.client.set('multi1', 'a')
+        self.client.set('multi2', '')
+        self.assertEqual(self.client.get_multi(['multi1', 'multi2', 'doesntexist']),
+                         {'multi1': 'a', 'multi2': ''})
+        self.assertEqual(self.client.get_multi([]), {})
+
+    def test_get_multi_split(self):
+        # enough keys that they have to be split up across connections
+        keys = ['split%d' % x for x in range(1000)]
+        for key in keys[::2]:
+            self.client.set(key, key)
+        self.assertEqual(self.client.get_multi(keys),
+                         dict((key, key) for key in keys[::2]))
+
+    def test_async(self):
+        # lots of requests in flight at once from a single thread
+        sets = [self.client.set_async('async%d' % x, str(x)) for x in range(50)]
+        self.assertEqual(wait_all(sets, 5), [None] * 50)
+
+        gets = [self.client.get_async('async%d' % x) for x in range(50)]
+        gets.append(self.client.get_async('doesntexist'))
+        multi = self.client.get_multi_async(['async1', 'async2', 'doesntexist'])
+        self.assertEqual(wait_all(gets + [multi], 5),
+                         [str(x) for x in range(50)] + [None]
+                         + [{'async1': '1', 'async2': '2'}])
+
+        # results can be collected more than once
+        self.assert_(multi.done())
+        self.assertEqual(multi.result(), {'async1': '1', 'async2': '2'})
+        self.assertEqual(self.client.get_multi_async([]).result(), {})
+
+        self.assertRaises(ValueError, lambda: self.client.get_async(''))
+
+    def test_async_error(self):
+        # the server doesn't like this, and we should find out from the future
+        future = self.client._submit_future([(0, 'bogus\r\n', None)],
+                                            'get', 'getted', lambda r: r)
+        self.assertRaises(Exception, future.result)
+        self.assertRaises(Exception, lambda: wait_all([future]))
+
+    def test_pipelining(self):
+        # lots of threads sharing one connection, so their requests have to be
+        # pipelined and the responses matched back up in order
+        c = Client('localhost', 11211, size=1, pipeline_depth=8)
+        errors = []
+
+        def worker(n):
+            try:
+                for x in range(50):
+                    key = 'pipeline%dx%d' % (n, x)
+                    c.set(key, key * (x % 7))
+                    self.assertEqual(c.get(key), key * (x % 7))
+            except Exception as e:
+                errors.append(e)
+
+        try:
+            threads = [threading.Thread(target=worker, args=(n,)) for n in range(16)]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+        finally:
+            c.close()
+
+        self.assertEqual(errors, [])
+
+    def test_submission_queue_full(self):
+        # a tiny submission ring, so that the submitting threads keep finding
+        # it full and having to wait for the event loop to drain it
+        c = Client('localhost', 11211, size=2, queue_size=2)
+        errors = []
+
+        def worker(n):
+            try:
+                keys = ['full%dx%d' % (n, x) for x in range(50)]
+                for key in keys:
+                    c.set(key, key)
+                self.assertEqual(c.get_multi(keys),
+                                 dict((key, key) for key in keys))
+            except Exception as e:
+                errors.append(e)
+
+        try:
+            threads = [threading.Thread(target=worker, args=(n,)) for n in range(8)]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+        finally:
+            c.close()
+
+        self.assertEqual(errors, [])
+        self.assertRaises(ValueError, lambda: Client('localhost', 11211, queue_size=3))
+
+    def test_multiple_servers(self):
+        # two names for the same server, so the keys get split up between two
+        # pools but we only need one memcached
+        c = Client(['localhost:11211', ('127.0.0.1', 11211, 2)])
+        try:
+            keys = ['servers%d' % x for x in range(200)]
+            self.assertEqual(set(c._ketama_lookup(key) for key in keys), set([0, 1]))
+
+            for key in keys:
+                c.set(key, key)
+            for key in keys[:10]:
+                self.assertEqual(c.get(key), key)
+            self.assertEqual(c.get_multi(keys + ['doesntexist']),
+                             dict((key, key) for key in keys))
+        finally:
+            c.close()
+
+    def test_hedged_gets(self):
+        slow = benchmark.FakeServer(latency=300)
+        fast = benchmark.FakeServer(latency=0)
+        c = Client([slow.address, fast.address], replicas=2, hedge_delay=20)
+        try:
+            keys = ['hedge%d' % x for x in range(100)]
+            slow_keys = [key for key in keys if c._ketama_lookup(key) == 0]
+            fast_keys = [key for key in keys if c._ketama_lookup(key) == 1]
+
+            # sets go to both servers, and a get that the first one is slow
+            # to answer is answered by the second
+            c.set(slow_keys[0], 'hedged')
+            started = time.time()
+            self.assertEqual(c.get(slow_keys[0]), 'hedged')
+            self.assertTrue(time.time() - started < 0.2)
+            stats = c.stats()
+            self.assertEqual((stats['gets'], stats['hedges'], stats['hedge_wins']),
+                             (1, 1, 1))
+
+            # the slow server's answer is thrown away when it turns up, and
+            # its connection carries on. Misses from the replica don't win,
+            # because it may just have missed the set, so those are the slow
+            # server's to answer
+            time.sleep(0.4)
+            self.assertEqual(c.stats()['servers'][0]['failures'], 0)
+            futures = [c.get_async(key) for key in slow_keys[:5]]
+            self.assertEqual(wait_all(futures, 1), ['hedged'] + [None] * 4)
+            self.assertEqual(c.stats()['hedge_wins'], 2)
+
+            # so a key that only the slow server has is still found
+            only = Client([slow.address])
+            try:
+                only.set(slow_keys[1], 'primary')
+            finally:
+                only.close()
+            self.assertEqual(c.get(slow_keys[1]), 'primary')
+            self.assertEqual(c.stats()['hedge_wins'], 2)
+
+            # but gets that are answered in time don't need it
+            c.set(fast_keys[0], 'fast')
+            self.assertEqual(c.get(fast_keys[0]), 'fast')
+            self.assertEqual(c.stats()['hedges'], 7)
+
+            # multi-key gets aren't hedged
+            self.assertEqual(c.get_multi(slow_keys[:2]),
+                             {slow_keys[0]: 'hedged', slow_keys[1]: 'primary'})
+            self.assertEqual(c.stats()['hedges'], 7)
+            self.assertEqual(c.stats()['replica_set_failures'], 0)
+        finally:
+            c.close()
+
+        # an automatic delay isn't known until it's seen enough gets
+        c = Client([fast.address, slow.address], replicas=2, hedge_delay='auto')
+        try:
+            slow_key = [key for key in keys if c._ketama_lookup(key) == 1][0]
+            c.set(slow_key, 'auto')
+            self.assertEqual(c.get(slow_key), 'auto')
+            self.assertEqual(c.stats()['hedges'], 0)
+
+            fast_key = [key for key in keys if c._ketama_lookup(key) == 0][0]
+            for x in range(6):
+                wait_all([c.get_async(fast_key) for y in range(200)], 5)
+
+            started = time.time()
+            self.assertEqual(c.get(slow_key), 'auto')
+            self.assertTrue(time.time() - started < 0.2)
+            self.assertTrue(c.stats()['hedge_wins'] >= 1)
+        finally:
+            c.close()
+            slow.stop()
+
+        # nobody waits for the sets that go to replicas, so the ones that fail
+        # are only counted. This one never answers sets
+        silent = FakeMemcached()
+        c = Client([fast.address, '127.0.0.1:%d' % silent.port], replicas=2)
+        try:
+            c.timeout = 100
+            key = [key for key in keys if c._ketama_lookup(key) == 0][0]
+            c.set(key, 'replicated')
+            time.sleep(0.3)
+            self.assertEqual(c.stats()['replica_set_failures'], 1)
+        finally:
+            c.close()
+            silent.stop()
+            fast.stop()
+
+        self.assertRaises(ValueError, lambda: Client('localhost', 11211, replicas=0))
+        self.assertRaises(ValueError, lambda: Client('localhost', 11211, hedge_delay=0))
+
+    def test_write_behind(self):
+        c = Client('localhost', 11211, write_behind=200, write_behind_bytes=1000)
+        try:
+            # only the last of a key's buffered sets is ever sent, and not
+            # until something needs it to be
+            self.client.set('behind', 'before')
+            for x in range(10):
+                c.set('behind', str(x), wait=False)
+            self.assertEqual(self.client.get('behind'), 'before')
+            self.assertEqual(c.get('behind'), '9')
+            stats = c.stats()
+            self.assertEqual((stats['sets'], stats['write_behind_coalesced']), (1, 9))
+
+            # flush() waits for them to be done
+            c.set('behind', 'flushed', wait=False)
+            c.set('behind2', 'flushed', wait=False)
+            c.flush()
+            self.assertEqual(self.client.get_multi(['behind', 'behind2']),
+                             {'behind': 'flushed', 'behind2': 'flushed'})
+
+            # otherwise they're sent when they've waited long enough
+            c.set('behind', 'timer', wait=False)
+            time.sleep(0.4)
+            self.assertEqual(self.client.get('behind'), 'timer')
+
+            # or when there are too many bytes of them
+            for x in range(20):
+                c.set('behind%d' % x, 'x' * 100, wait=False)
+            time.sleep(0.1)
+            self.assertTrue(self.client.get('behind0') is not None)
+
+            # and whatever is left goes before the client closes
+            c.set('behind', 'closed', wait=False)
+        finally:
+            c.close()
+        self.assertEqual(self.client.get('behind'), 'closed')
+
+        # with several loops each one buffers its own keys' sets, and a
+        # get_multi still reads every one of them back
+        c = Client('localhost', 11211, size=1, loops=4, write_behind=2000)
+        try:
+            keys = ['behindloops%d' % x for x in range(50)]
+            stamp = str(time.time())
+            for key in keys:
+                c.set(key, key + stamp, wait=False)
+            self.assertEqual(c.get_multi(keys),
+                             dict((key, key + stamp) for key in keys))
+        finally:
+            c.close()
+
+        self.assertRaises(ValueError, lambda: Client('localhost', 11211, write_behind=0))
+
     def test_invalid_key(self):
         self.assertRaises(ValueError, lambda: self.client.set('a'*500, ''))
+        self.assertRaises(ValueError, lambda: self.client.set('a'*251, ''))
         self.assertRaises(ValueError, lambda: self.client.set(1, ''))
         self.assertRaises(ValueError, lambda: self.client.set('', ''))
+        self.assertRaises(ValueError, lambda: self.client.get('with space'))
+        self.assertRaises(ValueError, lambda: self.client.get(u'unicode'))
+        self.assertRaises(ValueError, lambda: self.client.get_multi(['foo', '']))
+        self.assertRaises(ValueError, lambda: self.client.get_multi(['foo', 'a\r\nb']))
+
+        # everything that memcached takes, up to 250 bytes, is fine
+        for key in ['a' * 250, 'punctuation:/-_.!', '\xff\x01\x7f']:
+            self.client.set(key, 'ok')
+            self.assertEqual(self.client.get(key), 'ok')
+            self.assertEqual(self.client.get_multi([key]), {key: 'ok'})
+
+    def test_valid_key(self):
+        valid = _memcev._MemcevClient._valid_key
+
+        # the bad bytes are found wherever they are, in the words that are
+        # checked 8 at a time and in the bytes left over after them
+        for length in range(1, 21):
+            self.assertTrue(valid('k' * length))
+            for pos in range(length):
+                for bad in '\x00 \t\r\n':
+                    key = 'k' * pos + bad + 'k' * (length - pos - 1)
+                    self.assertFalse(valid(key), repr(key))
+
+        for good in '\x01\x08\x1f!~\x80\xff':
+            self.assertTrue(valid(good * 16))
+        self.assertFalse(valid(''))
+        self.assertFalse(valid(None))
 
     def test_invalid_value(self):
         self.assertRaises(ValueError, lambda: self.client.set('foo', 'a'*1024*1024+'b'))
@@ -63,5 +1012,87 @@ class TestMemcev(unittest.TestCase):
         time.sleep(2)
         self.assertEqual(self.client.get('foo'), None)
 
+class TestKetama(unittest.TestCase):
+    # these don't need a memcached, just the C hash ring
+
+    @staticmethod
+    def reference_ring(servers):
+        # a straightforward implementation of libketama's ring
+        total_weight = float(sum(weight for name, weight in servers))
+        points = []
+        for index, (name, weight) in enumerate(servers):
+            for h in range(int(weight / total_weight * 40 * len(servers))):
+                digest = hashlib.md5('%s-%d' % (name, h)).digest()
+                for n in range(4):
+                    points.append((struct.unpack('<I', digest[n*4:n*4+4])[0], index))
+        points.sort()
+        return points
+
+    @staticmethod
+    def reference_lookup(points, key):
+        hash_ = struct.unpack('<I', hashlib.md5(key).digest()[:4])[0]
+        index = bisect.bisect_left([point for point, server in points], hash_)
+        return points[index % len(points)][1]
+
+    def ring(self, servers):
+        ring = _memcev._MemcevClient()
+        ring._ketama_build(servers)
+        return ring
+
+    def test_compatible(self):
+        servers = [('10.0.0.%d:11211' % x, x % 3 + 1) for x in range(7)]
+        ring = self.ring(servers)
+        points = self.reference_ring(servers)
+
+        # including keys of every length around md5's block size
+        keys = ['key%d' % x for x in range(2000)] + ['k' * x for x in range(1, 150)]
+        for key in keys:
+            self.assertEqual(ring._ketama_lookup(key),
+                             self.reference_lookup(points, key))
+
+    def test_minimal_movement(self):
+        servers = [('10.0.0.%d:11211' % x, 1) for x in range(4)]
+        before = self.ring(servers)
+        after = self.ring(servers + [('10.0.0.4:11211', 1)])
+
+        keys = ['key%d' % x for x in range(10000)]
+        moved = [key for key in keys
+                 if before._ketama_lookup(key) != after._ketama_lookup(key)]
+
+        # about 1/5 of them should move, and all of them to the new server
+        self.assert_(0.1 < len(moved) / float(len(keys)) < 0.3)
+        self.assertEqual(set(after._ketama_lookup(key) for key in moved), set([4]))
+
+class TestBenchmark(unittest.TestCase):
+    # these start their own fake memcached, so they don't need a real one
+
+    def test_benchmark(self):
+        output = tempfile.NamedTemporaryFile(suffix='.json')
+        self.assertEqual(benchmark.main(['--duration', '0.1', '--threads', '2',
+                                         '--keys', '50', '--multi', '5',
+                                         '--transport', 'tcp,unix',
+                                         '--output', output.name]), 0)
+
+        results = json.load(open(output.name))['results']
+        self.assertEqual(set((r['op'], r['transport']) for r in results),
+                         set((op, transport) for op in benchmark.OPS
+                             for transport in ('tcp', 'unix')))
+        for result in results:
+            self.assert_(result['ops'] > 0)
+            self.assert_(result['p50_ms'] <= result['p99_ms'] <= result['p999_ms'])
+
+    def test_compare(self):
+        result = {'op': 'get', 'transport': 'tcp', 'threads': 1, 'pool': 4,
+                  'loops': 1, 'ops_per_sec': 1000.0}
+        baseline = {'results': [result]}
+
+        self.assertEqual(benchmark.compare([dict(result, ops_per_sec=950.0)],
+                                           baseline, 0.1), [])
+        self.assertEqual(len(benchmark.compare([dict(result, ops_per_sec=800.0)],
+                                               baseline, 0.1)), 1)
+        # configurations that aren't in the baseline aren't regressions
+        self.assertEqual(benchmark.compare([dict(result, threads=8, ops_per_sec=1.0)],
+                                           baseline, 0.1), [])
+
 if __name__ == '__main__':
     unittest.main()